@@ -26,7 +26,9 @@
  * 
  * To avoid encurring a discovery timeout for each op, there is a
  * server mode, in which a permanent process executes the above
- * commands, received on Unix socket, and returns the results.
+ * commands, received on Unix socket, and returns the results. The
+ * server can keep a connection open for several, possibly pipelined,
+ * requests (see the protocol description before runCommand()).
  *
  * When executing any of the ops from the command line, the program
  * first tries to contact the server, and does things itself if no
@@ -41,17 +43,40 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #include <string>
 #include <iostream>
 #include <vector>
+#include <map>
+#include <deque>
+#include <list>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <exception>
+#include <sstream>
+#include <fstream>
+#include <iomanip>
 
 #include "libupnpp/upnpplib.hxx"
 #include "libupnpp/log.hxx"
 #include "libupnpp/control/mediarenderer.hxx"
 #include "libupnpp/control/discovery.hxx"
 #include "libupnpp/control/linnsongcast.hxx"
+#include "libupnpp/control/service.hxx"
+#include "libupnpp/control/ohplaylist.hxx"
+#include "libupnpp/control/ohproduct.hxx"
+#include "libupnpp/control/ohreceiver.hxx"
+#include "libupnpp/control/ohsender.hxx"
 
 #include "../src/netcon.h"
 #include "../src/upmpdutils.hxx"
@@ -61,28 +86,47 @@ using namespace UPnPP;
 using namespace std;
 using namespace Songcast;
 
+static const char *stateName(const ReceiverState& scs)
+{
+    switch (scs.state) {
+    case ReceiverState::SCRS_GENERROR:    return "Error";
+    case ReceiverState::SCRS_NOOH:        return "Nooh";
+    case ReceiverState::SCRS_NOTRECEIVER: return "Off";
+    case ReceiverState::SCRS_STOPPED:     return "Stop";
+    case ReceiverState::SCRS_PLAYING:     return "Play";
+    }
+    return "Error";
+}
+
+static void formatReceiver(const ReceiverState& scs, ostream& out)
+{
+    out << left << setw(6) << stateName(scs);
+    out << scs.nm << " ";
+    out << scs.UDN << " ";
+    if (scs.state == ReceiverState::SCRS_PLAYING) {
+        out << scs.uri;
+    } else if (scs.state == ReceiverState::SCRS_GENERROR) {
+        out << scs.reason;
+    }
+    out << endl;
+}
+
+static void formatSender(const SenderState& scs, ostream& out)
+{
+    out << scs.nm << " ";
+    out << scs.UDN << " ";
+    out << scs.reason << " ";
+    out << scs.uri;
+    out << endl;
+}
+
 string showReceivers()
 {
     vector<ReceiverState> vscs;
     listReceivers(vscs);
     ostringstream out;
-
     for (auto& scs: vscs) {
-        switch (scs.state) {
-        case ReceiverState::SCRS_GENERROR:    out << "Error ";break;
-        case ReceiverState::SCRS_NOOH:        out << "Nooh  ";break;
-        case ReceiverState::SCRS_NOTRECEIVER: out << "Off   ";break;
-        case ReceiverState::SCRS_STOPPED:     out << "Stop  ";break;
-        case ReceiverState::SCRS_PLAYING:     out << "Play  ";break;
-        }
-        out << scs.nm << " ";
-        out << scs.UDN << " ";
-        if (scs.state == ReceiverState::SCRS_PLAYING) {
-            out << scs.uri;
-        } else if (scs.state == ReceiverState::SCRS_GENERROR) {
-            out << scs.reason;
-        }
-        out << endl;
+        formatReceiver(scs, out);
     }
     return out.str();
 }
@@ -92,17 +136,329 @@ string showSenders()
     vector<SenderState> vscs;
     listSenders(vscs);
     ostringstream out;
-
     for (auto& scs: vscs) {
-        out << scs.nm << " ";
-        out << scs.UDN << " ";
-        out << scs.reason << " ";
-        out << scs.uri;
-        out << endl;
+        formatSender(scs, out);
+    }
+    return out.str();
+}
+
+// Per-receiver operations are run in parallel, so that the group
+// members start playing at about the same time, and the total time
+// does not grow with the group size.
+static const unsigned int maxParallel = 8;
+// Max time for one receiver operation
+static const int deviceTimeoutSecs = 10;
+
+class FanoutState {
+public:
+    FanoutState(unsigned int n)
+        : results(n), done(n, false), started(n), next(0) {}
+    mutex mmutex;
+    condition_variable cond;
+    vector<string> results;
+    vector<bool> done;
+    vector<chrono::steady_clock::time_point> started;
+    // Next name to process
+    unsigned int next;
+};
+
+// Worker threads for all the operations. An operation does not wait
+// for a device which timed out, but the thread stays here until it
+// is done, and we join it then, or when the program exits, so that
+// no thread is running while the static data is destroyed.
+class FanoutPool {
+public:
+    ~FanoutPool() {
+        reap(true);
+    }
+    bool add(function<void ()> func);
+    // Join the finished threads, or all of them.
+    void reap(bool all);
+private:
+    struct Worker {
+        thread thr;
+        shared_ptr<atomic<bool> > exited;
+    };
+    mutex mmutex;
+    list<Worker> workers;
+};
+
+bool FanoutPool::add(function<void ()> func)
+{
+    Worker w;
+    w.exited = make_shared<atomic<bool> >(false);
+    shared_ptr<atomic<bool> > exited(w.exited);
+    try {
+        w.thr = thread([func, exited] () {
+                func();
+                *exited = true;
+            });
+    } catch (const std::exception& ex) {
+        LOGERR("scctl: could not start thread: " << ex.what() << endl);
+        return false;
+    }
+    unique_lock<mutex> lock(mmutex);
+    workers.push_back(std::move(w));
+    return true;
+}
+
+void FanoutPool::reap(bool all)
+{
+    list<Worker> tojoin;
+    {
+        unique_lock<mutex> lock(mmutex);
+        for (auto it = workers.begin(); it != workers.end();) {
+            auto cur = it++;
+            if (all || *cur->exited)
+                tojoin.splice(tojoin.end(), workers, cur);
+        }
+    }
+    for (auto& w : tojoin) {
+        w.thr.join();
+    }
+}
+
+static FanoutPool fanoutPool;
+
+// Result for each renderer of a multi-receiver operation
+typedef vector<pair<string, string> > OpResults;
+
+static string formatResults(const OpResults& results)
+{
+    ostringstream out;
+    for (auto& res : results) {
+        out << res.first << " " << res.second << endl;
     }
     return out.str();
 }
 
+// Worker: process names until there are none left.
+static void fanOutWorker(shared_ptr<FanoutState> st,
+                         const vector<string>& names,
+                         function<string (const string&)> func)
+{
+    for (;;) {
+        unsigned int idx;
+        {
+            unique_lock<mutex> lock(st->mmutex);
+            if (st->next >= names.size())
+                return;
+            idx = st->next++;
+            st->started[idx] = chrono::steady_clock::now();
+        }
+        string result = func(names[idx]);
+        unique_lock<mutex> lock(st->mmutex);
+        st->results[idx] = result;
+        st->done[idx] = true;
+        st->cond.notify_all();
+    }
+}
+
+// Run func for each name on a pool of worker threads and return the
+// result for each. Each device has deviceTimeoutSecs from the time
+// its operation starts. A worker stuck on a device which timed out
+// is replaced, so that the others don't wait for it.
+static OpResults fanOut(const vector<string>& names,
+                        function<string (const string&)> func)
+{
+    fanoutPool.reap(false);
+    if (names.empty())
+        return OpResults();
+    shared_ptr<FanoutState> st(new FanoutState(names.size()));
+    // The workers may outlive this call
+    shared_ptr<vector<string> > nms(new vector<string>(names));
+
+    unsigned int nworkers = 0;
+    unique_lock<mutex> lock(st->mmutex);
+    for (;;) {
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        chrono::steady_clock::time_point wakeup =
+            now + chrono::seconds(deviceTimeoutSecs);
+        bool finished = true;
+        // Running operations (one per worker), and the ones which
+        // timed out.
+        unsigned int running = 0, stuck = 0;
+        for (unsigned int i = 0; i < st->next; i++) {
+            if (st->done[i])
+                continue;
+            running++;
+            chrono::steady_clock::time_point deadline =
+                st->started[i] + chrono::seconds(deviceTimeoutSecs);
+            if (deadline <= now) {
+                stuck++;
+            } else {
+                finished = false;
+                wakeup = min(wakeup, deadline);
+            }
+        }
+        if (st->next < names.size()) {
+            finished = false;
+            // Idle workers will take the next names. Start new ones
+            // if there are not enough, not counting the stuck ones.
+            unsigned int idle = nworkers - running;
+            unsigned int wanted = min(maxParallel,
+                                      (unsigned int)names.size() - st->next);
+            for (; idle + running - stuck < wanted; idle++) {
+                if (!fanoutPool.add([st, nms, func] () {
+                            fanOutWorker(st, *nms, func);
+                        }))
+                    break;
+                nworkers++;
+            }
+            if (nworkers == running && running == stuck) {
+                // Could not start a thread, and nothing can progress
+                break;
+            }
+        }
+        if (finished)
+            break;
+        st->cond.wait_until(lock, wakeup);
+    }
+
+    OpResults results;
+    for (unsigned int i = 0; i < names.size(); i++) {
+        results.push_back(pair<string, string>(
+                              names[i],
+                              st->done[i] ? st->results[i] : "Timeout"));
+    }
+    return results;
+}
+
+static string stateError(const ReceiverState& st)
+{
+    switch (st.state) {
+    case ReceiverState::SCRS_GENERROR: return "Error " + st.reason;
+    case ReceiverState::SCRS_NOOH: return "Error not an OpenHome renderer";
+    case ReceiverState::SCRS_NOTRECEIVER: return "Error no Receiver service";
+    default: return string();
+    }
+}
+
+// Make the receivers play uri/meta
+static OpResults playReceivers(const vector<string>& names, const string& uri,
+                            const string& meta)
+{
+    return fanOut(names, [uri, meta] (const string& nm) -> string {
+            ReceiverState st;
+            getReceiverState(nm, st);
+            string err = stateError(st);
+            if (!err.empty())
+                return err;
+            return setReceiverPlaying(st, uri, meta) ? "Ok" : "Error";
+        });
+}
+
+OpResults setFromReceiver(const string& master, const vector<string>& slaves)
+{
+    ReceiverState mst;
+    getReceiverState(master, mst);
+    if (mst.state != ReceiverState::SCRS_PLAYING || mst.uri.empty()) {
+        return OpResults(1, pair<string, string>(
+                             master, "Error master not playing"));
+    }
+    return playReceivers(slaves, mst.uri, mst.meta);
+}
+
+OpResults setFromSender(const string& sender,
+                        const vector<string>& receivers)
+{
+    SenderState sst;
+    getSenderState(sender, sst);
+    if (sst.uri.empty()) {
+        return OpResults(1, pair<string, string>(
+                             sender, "Error " + (sst.reason.empty() ?
+                                                 "no sender uri" : sst.reason)));
+    }
+    return playReceivers(receivers, sst.uri, sst.meta);
+}
+
+OpResults stopAll(const vector<string>& names)
+{
+    return fanOut(names, [] (const string& nm) -> string {
+            ReceiverState st;
+            getReceiverState(nm, st);
+            string err = stateError(st);
+            if (!err.empty())
+                return err;
+            return stopReceiver(st) ? "Ok" : "Error";
+        });
+}
+
+// Find a renderer by UDN or friendly name
+static MRDH findRenderer(const string& name)
+{
+    UPnPDeviceDesc ddesc;
+    UPnPDeviceDirectory *dir = UPnPDeviceDirectory::getTheDir();
+    if (dir && (dir->getDevByUDN(name, ddesc) ||
+                dir->getDevByFName(name, ddesc)) &&
+        MediaRenderer::isMRDevice(ddesc.deviceType)) {
+        return MRDH(new MediaRenderer(ddesc));
+    }
+    return MRDH();
+}
+
+// Minimal metadata for an entry which has none
+static string uriToDidl(const string& uri)
+{
+    string::size_type slash = uri.find_last_of("/");
+    string title = slash == string::npos ? uri : uri.substr(slash + 1);
+    return string("<DIDL-Lite xmlns=\"urn:schemas-upnp-org:metadata-1-0/"
+                  "DIDL-Lite/\" xmlns:dc=\"http://purl.org/dc/elements/1.1/\" "
+                  "xmlns:upnp=\"urn:schemas-upnp-org:metadata-1-0/upnp/\">"
+                  "<item id=\"\" parentID=\"\" restricted=\"1\"><dc:title>") +
+        SoapHelp::xmlQuote(title.empty() ? uri : title) + "</dc:title>"
+        "<upnp:class>object.item.audioItem.musicTrack</upnp:class><res>" +
+        SoapHelp::xmlQuote(uri) + "</res></item></DIDL-Lite>";
+}
+
+// Insert the tracks listed in the input in the renderer Playlist, in
+// one call to the upmpdcli InsertList extension action (the renderer
+// must be an upmpdcli one). Each input line holds a uri, optionally
+// followed by a tab and the DIDL-Lite metadata (on one line). The
+// result holds the new track ids.
+static string insertList(const string& name, int afterid, istream& input)
+{
+    string entries("<EntryList>");
+    string line;
+    int cnt = 0;
+    while (getline(input, line)) {
+        string uri, meta;
+        string::size_type tab = line.find('\t');
+        uri = line.substr(0, tab);
+        if (tab != string::npos)
+            meta = line.substr(tab + 1);
+        trimstring(uri, " \t\r");
+        if (uri.empty() || uri[0] == '#')
+            continue;
+        trimstring(meta, " \t\r");
+        if (meta.empty())
+            meta = uriToDidl(uri);
+        entries += "<Entry><Uri>" + SoapHelp::xmlQuote(uri) + "</Uri>"
+            "<Metadata>" + SoapHelp::xmlQuote(meta) + "</Metadata></Entry>";
+        cnt++;
+    }
+    entries += "</EntryList>";
+    if (cnt == 0)
+        return "Error no entries";
+
+    MRDH rdr = findRenderer(name);
+    if (!rdr)
+        return "Error renderer not found";
+    OHPLH ohpl = rdr->ohpl();
+    if (!ohpl)
+        return "Error no Playlist service";
+    SoapOutgoing args(ohpl->getServiceType(), "InsertList");
+    args("AfterId", SoapHelp::i2s(afterid))("EntryList", entries);
+    SoapIncoming data;
+    int ret = ohpl->runAction(args, data);
+    if (ret != 0) {
+        return "Error InsertList failed: " + SoapHelp::i2s(ret);
+    }
+    string ids;
+    data.get("NewIdList", &ids);
+    return "Ok " + ids;
+}
+
 static char *thisprog;
 static char usage [] =
 " -l List renderers with Songcast Receiver capability\n"
@@ -110,16 +466,27 @@ static char usage [] =
 " -s <master> <slave> [slave ...] : Set up the slaves renderers as Songcast\n"
 "    Receivers and make them play from the same uri as the master receiver\n"
 " -x <renderer> [renderer ...] Reset renderers from Songcast to Playlist\n"
-" -S Run as server\n"
+" -S [-H [addr:]port] Run as server. If -H is set, also accept JSON requests\n"
+"    over HTTP on the port. There is no access control: the listener is only\n"
+"    on localhost (127.0.0.1) unless another address is given, e.g. 0.0.0.0\n"
+"    for all interfaces.\n"
 " -f If no server is found, scctl will fork one after performing the\n"
 "    requested command, so that the next execution will not have to wait for\n"
 "    the discovery timeout.\n"
 " -r <sender> <renderer> <renderer> : set up the renderers in Receiver mode\n"
 "    playing data from the sender. This is like -s but we get the uri from \n"
 "    the sender instead of a sibling receiver\n"
+" -i <renderer> <afterid> <file> : insert the tracks listed in file ('-' for\n"
+"    stdin) in the renderer playlist after track afterid (0: at the start),\n"
+"    with the upmpdcli InsertList action. Each line holds a uri, optionally\n"
+"    followed by a tab and the DIDL-Lite metadata. Prints the new ids.\n"
 " -h This help.\n"
 "\n"
 "Renderers may be designated by friendly name or UUID\n"
+"The -r, -s and -x operations are performed in parallel on the renderers,\n"
+"and print one result line for each.\n"
+"When executed by the server, -l and -L are answered from a table kept\n"
+"current by UPnP events, and a last line shows the age of the table.\n"
 "\n"
 ;
 static void
@@ -139,8 +506,9 @@ static int   op_flags;
 #define OPT_p    0x40
 #define OPT_r    0x80
 #define OPT_L    0x100
+#define OPT_i    0x200
 
-int runserver();
+int runserver(int httpport, const string& httpaddr);
 bool tryserver(int flags, int argc, char *argv[]);
 
 int main(int argc, char *argv[])
@@ -148,10 +516,27 @@ int main(int argc, char *argv[])
     thisprog = argv[0];
 
     int ret;
-    while ((ret = getopt(argc, argv, "fhLlrsSx")) != -1) {
+    int httpport = 0;
+    string httpaddr("127.0.0.1");
+    while ((ret = getopt(argc, argv, "fhH:iLlrsSx")) != -1) {
         switch (ret) {
         case 'f': op_flags |= OPT_f; break;
         case 'h': Usage(stdout); break;
+        case 'H': {
+            string value(optarg);
+            string::size_type colon = value.rfind(':');
+            if (colon != string::npos) {
+                httpaddr = value.substr(0, colon);
+                value = value.substr(colon + 1);
+            }
+            httpport = atoi(value.c_str());
+        }
+            break;
+        case 'i':
+            if (op_flags & ~OPT_f)
+                Usage();
+            op_flags |= OPT_i;
+            break;
         case 'l':
             if (op_flags & ~OPT_f)
                 Usage();
@@ -188,8 +573,8 @@ int main(int argc, char *argv[])
     //fprintf(stderr, "argc %d optind %d flgs: 0x%x\n", argc, optind, op_flags);
 
     // If we're not a server, try to contact one to avoid the
-    // discovery timeout
-    if (!(op_flags & OPT_S) && tryserver(op_flags, argc -optind, 
+    // discovery timeout. -i reads local data, and is not a server op.
+    if (!(op_flags & (OPT_S | OPT_i)) && tryserver(op_flags, argc -optind, 
                                          &argv[optind])) {
         exit(0);
     }
@@ -227,19 +612,38 @@ int main(int argc, char *argv[])
     } else if ((op_flags & OPT_r)) {
         if (args.size() < 2)
             Usage();
-        setReceiversFromSender(args[0], vector<string>(args.begin() + 1,
-                                                       args.end()));
+        cout << formatResults(
+            setFromSender(args[0], vector<string>(args.begin() + 1,
+                                                  args.end())));
     } else if ((op_flags & OPT_s)) {
         if (args.size() < 2)
             Usage();
-        setReceiversFromReceiver(args[0], vector<string>(args.begin()+1,
-                                                         args.end()));
+        cout << formatResults(
+            setFromReceiver(args[0], vector<string>(args.begin() + 1,
+                                                    args.end())));
     } else if ((op_flags & OPT_x)) {
         if (args.size() < 1)
             Usage();
-        stopReceivers(args);
+        cout << formatResults(stopAll(args));
+    } else if ((op_flags & OPT_i)) {
+        if (args.size() != 3)
+            Usage();
+        string res;
+        if (args[2] == "-") {
+            res = insertList(args[0], atoi(args[1].c_str()), cin);
+        } else {
+            ifstream input(args[2].c_str());
+            if (!input.is_open()) {
+                cerr << "Can't open " << args[2] << endl;
+                return 1;
+            }
+            res = insertList(args[0], atoi(args[1].c_str()), input);
+        }
+        cout << args[0] << " " << res << endl;
+        if (res.find("Ok") != 0)
+            return 1;
     } else if ((op_flags & OPT_S)) {
-        exit(runserver());
+        exit(runserver(httpport, httpaddr));
     } else {
         Usage();
     }
@@ -250,7 +654,7 @@ int main(int argc, char *argv[])
     if ((op_flags & OPT_f)) {
         // Father exits, son process becomes server
         if (daemon(0, 0) == 0)
-            runserver();
+            runserver(0, string());
     } 
     return 0;
 }
@@ -333,101 +737,1104 @@ bool tryserver(int opflags, int argc, char **argv)
 }
 
 
-// Listening endpoint for the server. For each connection, one request
-// is served immediately and the connection is closed.
-class MyNetconServLis : public NetconServLis {
+// State cache for the server mode. Walking the network and querying
+// each renderer for a listing is slow, so a background thread does it
+// every cacheRefreshSecs, and subscribes to the events from the
+// Product, Receiver and Sender services of the devices found, which
+// keep the table current between walks. Listings are answered from
+// the table, with a last line showing its age.
+static const int cacheRefreshSecs = 60;
+
+class StateCache {
 public:
-protected:
-    int cando(Netcon::Event reason);
+    StateCache() : walktime(0), walkreq(false) {}
+    bool start();
+    // Copy the current state. Returns the age of the table.
+    int getReceivers(vector<ReceiverState>& vscs);
+    int getSenders(vector<SenderState>& vscs);
+    // Formatted listings
+    string receivers();
+    string senders();
+
+    // Entries are their own event reporters.
+    class RcvEntry : public VarEventReporter {
+    public:
+        RcvEntry(StateCache *c, const ReceiverState& s)
+            : cache(c), st(s), tpstate(-1) {}
+        void changed(const char *nm, int val);
+        void changed(const char *nm, const char *val);
+        void autorenew_failed() {
+            cache->requestWalk();
+        }
+        StateCache *cache;
+        ReceiverState st;
+        // Last Receiver TransportState event, -1 if none seen yet
+        int tpstate;
+    };
+    class SndEntry : public VarEventReporter {
+    public:
+        SndEntry(StateCache *c, const SenderState& s) : cache(c), st(s) {}
+        void changed(const char *, int) {}
+        void changed(const char *nm, const char *val);
+        void autorenew_failed() {
+            cache->requestWalk();
+        }
+        StateCache *cache;
+        SenderState st;
+    };
+
+private:
+    void worker();
+    void walk();
+    void requestWalk();
+    void waitReady(unique_lock<mutex>& lock);
+
+    mutex mmutex;
+    condition_variable cond;
+    time_t walktime;
+    bool walkreq;
+    vector<shared_ptr<RcvEntry> > rcvs;
+    vector<shared_ptr<SndEntry> > snds;
+    // Previous generation, kept around until the next walk in case an
+    // event callback is still running.
+    vector<shared_ptr<RcvEntry> > oldrcvs;
+    vector<shared_ptr<SndEntry> > oldsnds;
 };
 
-// Server worker method. Called for each connection, does one thing
-// and returns.
-int MyNetconServLis::cando(Netcon::Event reason)
+static StateCache stateCache;
+
+// The Product SourceIndex tells if the Receiver is the current
+// source, and the Receiver TransportState if it is playing. The error
+// states are only changed by a walk.
+void StateCache::RcvEntry::changed(const char *nm, int val)
 {
-    NetconServCon *con = accept();
-    if (con == 0) {
-        LOGERR("scctl server: accept() failed\n");
-        return 1;
+    bool needwalk = false;
+    {
+        unique_lock<mutex> lock(cache->mmutex);
+        if (st.state != ReceiverState::SCRS_NOTRECEIVER &&
+            st.state != ReceiverState::SCRS_STOPPED &&
+            st.state != ReceiverState::SCRS_PLAYING) {
+            return;
+        }
+        if (!strcmp(nm, "SourceIndex")) {
+            if (val != st.receiverSourceIndex) {
+                st.state = ReceiverState::SCRS_NOTRECEIVER;
+            } else if (st.state == ReceiverState::SCRS_NOTRECEIVER) {
+                if (tpstate == -1) {
+                    // Don't guess, get the real state.
+                    needwalk = true;
+                } else {
+                    st.state = tpstate == OHPlaylist::TPS_Playing ?
+                        ReceiverState::SCRS_PLAYING :
+                        ReceiverState::SCRS_STOPPED;
+                }
+            }
+        } else if (!strcmp(nm, "TransportState")) {
+            tpstate = val;
+            if (st.state != ReceiverState::SCRS_NOTRECEIVER) {
+                st.state = val == OHPlaylist::TPS_Playing ?
+                    ReceiverState::SCRS_PLAYING : ReceiverState::SCRS_STOPPED;
+            }
+        }
     }
-    std::unique_ptr<Netcon> conhold(con);
+    if (needwalk)
+        cache->requestWalk();
+}
 
-    // Get command
-    string line;
+void StateCache::RcvEntry::changed(const char *nm, const char *val)
+{
+    unique_lock<mutex> lock(cache->mmutex);
+    if (!strcmp(nm, "Uri")) {
+        st.uri = val;
+    } else if (!strcmp(nm, "Metadata")) {
+        st.meta = val;
+    }
+}
+
+void StateCache::SndEntry::changed(const char *nm, const char *val)
+{
+    unique_lock<mutex> lock(cache->mmutex);
+    if (!strcmp(nm, "Uri")) {
+        st.uri = val;
+    } else if (!strcmp(nm, "Metadata")) {
+        st.meta = val;
+    }
+}
+
+bool StateCache::start()
+{
+    try {
+        thread(&StateCache::worker, this).detach();
+    } catch (const std::exception& ex) {
+        LOGERR("scctl: server: could not start thread: " << ex.what()
+               << endl);
+        return false;
+    }
+    return true;
+}
+
+void StateCache::requestWalk()
+{
+    unique_lock<mutex> lock(mmutex);
+    walkreq = true;
+    cond.notify_all();
+}
+
+void StateCache::worker()
+{
+    for (;;) {
+        walk();
+        unique_lock<mutex> lock(mmutex);
+        cond.wait_for(lock, chrono::seconds(cacheRefreshSecs),
+                      [this] {return walkreq;});
+        walkreq = false;
+    }
+}
+
+// Get fresh state for all devices, and subscribe to their events. The
+// new handles come with new subscriptions, the old ones are dropped.
+void StateCache::walk()
+{
+    LOGDEB("StateCache::walk\n");
+    vector<ReceiverState> vrcvs;
+    listReceivers(vrcvs);
+    vector<SenderState> vsnds;
+    listSenders(vsnds);
+
+    vector<shared_ptr<RcvEntry> > nrcvs;
+    for (auto& st : vrcvs) {
+        shared_ptr<RcvEntry> e(new RcvEntry(this, st));
+        if (st.prod)
+            st.prod->installReporter(e.get());
+        if (st.rcv)
+            st.rcv->installReporter(e.get());
+        nrcvs.push_back(e);
+    }
+    vector<shared_ptr<SndEntry> > nsnds;
+    for (auto& st : vsnds) {
+        shared_ptr<SndEntry> e(new SndEntry(this, st));
+        if (st.sender)
+            st.sender->installReporter(e.get());
+        nsnds.push_back(e);
+    }
+
+    vector<shared_ptr<RcvEntry> > prevrcvs;
+    vector<shared_ptr<SndEntry> > prevsnds;
     {
-        char buf[2048];
-        if  (con->getline(buf, 2048, 2) <= 0) {
-            LOGERR("scctl: server: getline() failed\n");
-            return 1;
-        }
-        line = buf;
+        unique_lock<mutex> lock(mmutex);
+        oldrcvs.swap(rcvs);
+        rcvs.swap(nrcvs);
+        oldsnds.swap(snds);
+        snds.swap(nsnds);
+        // nrcvs/nsnds now hold the generation before the old one
+        prevrcvs.swap(nrcvs);
+        prevsnds.swap(nsnds);
+        walktime = time(0);
+        cond.notify_all();
+    }
+    // Stop the events for the previous generation outside of the lock
+    for (auto& e : oldrcvs) {
+        if (e->st.prod)
+            e->st.prod->installReporter(0);
+        if (e->st.rcv)
+            e->st.rcv->installReporter(0);
+    }
+    for (auto& e : oldsnds) {
+        if (e->st.sender)
+            e->st.sender->installReporter(0);
     }
+}
 
-    trimstring(line, " \n");
+// Wait for the first walk to complete
+void StateCache::waitReady(unique_lock<mutex>& lock)
+{
+    while (walktime == 0)
+        cond.wait(lock);
+}
 
-    LOGDEB1("scctl: server: got cmd: " << line << endl);
+int StateCache::getReceivers(vector<ReceiverState>& vscs)
+{
+    unique_lock<mutex> lock(mmutex);
+    waitReady(lock);
+    for (auto& e : rcvs) {
+        vscs.push_back(e->st);
+    }
+    return int(time(0) - walktime);
+}
 
-    vector<string> toks;
-    stringToTokens(line, toks);
-    if (toks.empty()) {
-        return 1;
+int StateCache::getSenders(vector<SenderState>& vscs)
+{
+    unique_lock<mutex> lock(mmutex);
+    waitReady(lock);
+    for (auto& e : snds) {
+        vscs.push_back(e->st);
     }
+    return int(time(0) - walktime);
+}
 
-    int opflags = strtoul(toks[0].c_str(), 0, 0);
+string StateCache::receivers()
+{
+    vector<ReceiverState> vscs;
+    int age = getReceivers(vscs);
+    ostringstream out;
+    for (auto& scs : vscs) {
+        formatReceiver(scs, out);
+    }
+    out << "#cache-age=" << age << "s" << endl;
+    return out.str();
+}
 
-    string out;
+string StateCache::senders()
+{
+    vector<SenderState> vscs;
+    int age = getSenders(vscs);
+    ostringstream out;
+    for (auto& scs : vscs) {
+        formatSender(scs, out);
+    }
+    out << "#cache-age=" << age << "s" << endl;
+    return out.str();
+}
+
+// Server mode.
+//
+// Three request formats are accepted on the Unix socket:
+//  - "<opflags> args...": the original protocol, used by
+//    tryserver(). The raw output is returned and the connection is
+//    closed.
+//  - "+<opflags> args...": the response is framed as
+//    "<length>\n<data>", and the connection stays open.
+//  - A line beginning with '{': a JSON request object, answered by a
+//    single-line JSON object, the connection stays open. See runJson()
+//    for the operations.
+// Requests on a connection may be pipelined: responses are returned
+// in request order.
+//
+// If an HTTP port is set (-H), the same JSON requests can be POSTed
+// to /api. GET /receivers, /senders and /ping are shortcuts for the
+// corresponding operations. HTTP/1.1 connections are kept alive.
+// There is no access control, so we only listen on localhost unless
+// told otherwise.
+//
+// All the sockets are handled in the select loop. Requests other than
+// ping are executed by a small pool of worker threads, which hand the
+// results back to the loop through a pipe, so that a slow -s does not
+// delay the listings requested by other clients.
+
+// Number of request worker threads
+static const int serverWorkers = 4;
+// Max size for a request line, or HTTP request
+static const unsigned int maxLineSize = 8192;
+// Max count of HTTP header lines. Their total size is limited to
+// maxLineSize.
+static const unsigned int maxHeaders = 64;
+
+// Execute one text request. Returns false for a bad request.
+static bool runCommand(const vector<string>& toks, string& out)
+{
+    int opflags = strtoul(toks[0].c_str(), 0, 0);
     if (opflags & OPT_p) {
         // ping
         out = "Ok\n";
     } else if (opflags & OPT_l) {
-        out = showReceivers();
+        out = stateCache.receivers();
+    } else if (opflags & OPT_L) {
+        out = stateCache.senders();
     } else if (opflags & OPT_r) {
         if (toks.size() < 3)
-            return 1;
-        vector<string>::iterator beg = toks.begin();
-        beg++;
-        string sender = *beg;
-        beg++;
-        vector<string> receivers(beg, toks.end());
-        setReceiversFromSender(sender, receivers);
+            return false;
+        out = formatResults(
+            setFromSender(toks[1],
+                          vector<string>(toks.begin() + 2, toks.end())));
     } else if (opflags & OPT_s) {
         if (toks.size() < 3)
-            return 1;
-        vector<string>::iterator beg = toks.begin();
-        beg++;
-        string master = *beg;
-        beg++;
-        vector<string> slaves(beg, toks.end());
-        ReceiverState mst;
-        getReceiverState(master, mst);
-        for (auto it = slaves.begin(); it != slaves.end(); it++) {
-            ReceiverState st;
-            getReceiverState(*it, st);
-            setReceiverPlaying(st, mst.uri, mst.meta);
-        }
+            return false;
+        out = formatResults(
+            setFromReceiver(toks[1],
+                            vector<string>(toks.begin() + 2, toks.end())));
     } else if (opflags & OPT_x) {
         if (toks.size() < 2)
-            return 1;
-        vector<string>::iterator beg = toks.begin();
-        beg++;
-        vector<string> slaves(beg, toks.end());
-        stopReceivers(slaves);
+            return false;
+        out = formatResults(
+            stopAll(vector<string>(toks.begin() + 1, toks.end())));
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// JSON request value: we only need scalars and arrays of strings. raw
+// is the JSON text, for echoing the request id.
+struct JsonVal {
+    JsonVal() : isarray(false) {}
+    bool isarray;
+    string s;
+    vector<string> a;
+    string raw;
+};
+typedef map<string, JsonVal> JsonReq;
+
+static string jsonQuote(const string& in)
+{
+    string out("\"");
+    for (unsigned int i = 0; i < in.size(); i++) {
+        unsigned char c = in[i];
+        switch (c) {
+        case '"': out += "\\\""; break;
+        case '\\': out += "\\\\"; break;
+        case '\n': out += "\\n"; break;
+        case '\r': out += "\\r"; break;
+        case '\t': out += "\\t"; break;
+        default:
+            if (c < 0x20) {
+                char buf[10];
+                sprintf(buf, "\\u%04x", c);
+                out += buf;
+            } else {
+                out += c;
+            }
+        }
+    }
+    out += "\"";
+    return out;
+}
+
+static void utf8Append(string& out, unsigned int cp)
+{
+    if (cp < 0x80) {
+        out += char(cp);
+    } else if (cp < 0x800) {
+        out += char(0xc0 | (cp >> 6));
+        out += char(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        out += char(0xe0 | (cp >> 12));
+        out += char(0x80 | ((cp >> 6) & 0x3f));
+        out += char(0x80 | (cp & 0x3f));
     } else {
-        LOGERR("scctl: server: bad cmd:" << toks[0] << endl);
+        out += char(0xf0 | (cp >> 18));
+        out += char(0x80 | ((cp >> 12) & 0x3f));
+        out += char(0x80 | ((cp >> 6) & 0x3f));
+        out += char(0x80 | (cp & 0x3f));
+    }
+}
+
+// Minimal parser for the request objects.
+class JsonParser {
+public:
+    JsonParser(const string& in) : m_in(in), m_pos(0) {}
+
+    bool parseObject(JsonReq& req) {
+        if (!expect('{'))
+            return false;
+        if (peek() == '}') {
+            m_pos++;
+            return atEnd();
+        }
+        for (;;) {
+            string key;
+            if (!parseString(key) || !expect(':'))
+                return false;
+            JsonVal& val = req[key];
+            string::size_type start = (skipws(), m_pos);
+            if (peek() == '[') {
+                val.isarray = true;
+                if (!parseArray(val.a))
+                    return false;
+            } else if (!parseScalar(val.s)) {
+                return false;
+            }
+            val.raw = m_in.substr(start, m_pos - start);
+            if (peek() == ',') {
+                m_pos++;
+                continue;
+            }
+            if (!expect('}'))
+                return false;
+            return atEnd();
+        }
+    }
+
+private:
+    void skipws() {
+        while (m_pos < m_in.size() && isspace((unsigned char)m_in[m_pos]))
+            m_pos++;
+    }
+    int peek() {
+        skipws();
+        return m_pos < m_in.size() ? m_in[m_pos] : -1;
+    }
+    bool expect(char c) {
+        if (peek() != c)
+            return false;
+        m_pos++;
+        return true;
+    }
+    bool atEnd() {
+        skipws();
+        return m_pos == m_in.size();
+    }
+    bool hex4(unsigned int& v) {
+        if (m_pos + 4 > m_in.size())
+            return false;
+        v = 0;
+        for (int i = 0; i < 4; i++) {
+            int c = tolower((unsigned char)m_in[m_pos++]);
+            if (c >= '0' && c <= '9')
+                v = v * 16 + c - '0';
+            else if (c >= 'a' && c <= 'f')
+                v = v * 16 + c - 'a' + 10;
+            else
+                return false;
+        }
+        return true;
+    }
+    bool parseString(string& out) {
+        if (!expect('"'))
+            return false;
+        while (m_pos < m_in.size()) {
+            char c = m_in[m_pos++];
+            if (c == '"')
+                return true;
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (m_pos >= m_in.size())
+                return false;
+            c = m_in[m_pos++];
+            switch (c) {
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                unsigned int cp, lo;
+                if (!hex4(cp))
+                    return false;
+                if (cp >= 0xd800 && cp < 0xdc00 &&
+                    m_in.compare(m_pos, 2, "\\u") == 0) {
+                    m_pos += 2;
+                    if (!hex4(lo))
+                        return false;
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                }
+                utf8Append(out, cp);
+                break;
+            }
+            default: out += c; break;
+            }
+        }
+        return false;
+    }
+    // Numbers and literals are returned as text
+    bool parseScalar(string& out) {
+        if (peek() == '"')
+            return parseString(out);
+        while (m_pos < m_in.size() &&
+               (isalnum((unsigned char)m_in[m_pos]) ||
+                strchr("+-.", m_in[m_pos])))
+            out += m_in[m_pos++];
+        return !out.empty();
+    }
+    bool parseArray(vector<string>& out) {
+        if (!expect('['))
+            return false;
+        if (peek() == ']') {
+            m_pos++;
+            return true;
+        }
+        for (;;) {
+            string s;
+            if (!parseScalar(s))
+                return false;
+            out.push_back(s);
+            if (peek() == ',') {
+                m_pos++;
+                continue;
+            }
+            return expect(']');
+        }
+    }
+
+    const string& m_in;
+    string::size_type m_pos;
+};
+
+static string jsonError(const string& id, const string& reason)
+{
+    return "{" + id + "\"ok\":false,\"error\":" + jsonQuote(reason) + "}";
+}
+
+static string jsonResults(const OpResults& results)
+{
+    string out("[");
+    for (auto& res : results) {
+        if (out.size() > 1)
+            out += ",";
+        out += "{\"name\":" + jsonQuote(res.first) + ",\"result\":" +
+            jsonQuote(res.second) + "}";
+    }
+    return out + "]";
+}
+
+// Execute a JSON request, returns the response object. Operations:
+//  {"op":"ping"}
+//  {"op":"receivers"}
+//  {"op":"senders"}
+//  {"op":"setfromsender","sender":"nm","renderers":["nm1",...]}
+//  {"op":"setfromreceiver","master":"nm","renderers":["nm1",...]}
+//  {"op":"stop","renderers":["nm1",...]}
+// An "id" member is echoed in the response. Responses have an "ok"
+// boolean member, and either an "error" string or the operation data.
+static string runJson(const string& line)
+{
+    JsonReq req;
+    JsonParser parser(line);
+    if (!parser.parseObject(req)) {
+        return jsonError("", "bad JSON request");
+    }
+    string id;
+    if (req.find("id") != req.end()) {
+        id = "\"id\":" + req["id"].raw + ",";
+    }
+    string op = req["op"].s;
+    const vector<string>& renderers = req["renderers"].a;
+
+    ostringstream out;
+    out << "{" << id << "\"ok\":true,";
+    if (op == "ping") {
+        out << "\"op\":\"ping\"";
+    } else if (op == "receivers") {
+        vector<ReceiverState> vscs;
+        int age = stateCache.getReceivers(vscs);
+        out << "\"age\":" << age << ",\"receivers\":[";
+        for (unsigned int i = 0; i < vscs.size(); i++) {
+            const ReceiverState& scs = vscs[i];
+            out << (i ? "," : "") << "{\"name\":" << jsonQuote(scs.nm) <<
+                ",\"udn\":" << jsonQuote(scs.UDN) <<
+                ",\"state\":" << jsonQuote(stateName(scs)) <<
+                ",\"uri\":" << jsonQuote(scs.uri) <<
+                ",\"reason\":" << jsonQuote(scs.reason) << "}";
+        }
+        out << "]";
+    } else if (op == "senders") {
+        vector<SenderState> vscs;
+        int age = stateCache.getSenders(vscs);
+        out << "\"age\":" << age << ",\"senders\":[";
+        for (unsigned int i = 0; i < vscs.size(); i++) {
+            const SenderState& scs = vscs[i];
+            out << (i ? "," : "") << "{\"name\":" << jsonQuote(scs.nm) <<
+                ",\"udn\":" << jsonQuote(scs.UDN) <<
+                ",\"uri\":" << jsonQuote(scs.uri) <<
+                ",\"reason\":" << jsonQuote(scs.reason) << "}";
+        }
+        out << "]";
+    } else if (op == "setfromsender" || op == "setfromreceiver" ||
+               op == "stop") {
+        if (renderers.empty()) {
+            return jsonError(id, "no renderers");
+        }
+        OpResults results;
+        if (op == "stop") {
+            results = stopAll(renderers);
+        } else if (op == "setfromsender") {
+            if (req["sender"].s.empty())
+                return jsonError(id, "no sender");
+            results = setFromSender(req["sender"].s, renderers);
+        } else {
+            if (req["master"].s.empty())
+                return jsonError(id, "no master");
+            results = setFromReceiver(req["master"].s, renderers);
+        }
+        out << "\"results\":" << jsonResults(results);
+    } else {
+        return jsonError(id, "unknown op: " + op);
+    }
+    out << "}";
+    return out.str();
+}
+
+class ScctlServer {
+public:
+    ScctlServer() : nextclient(0) {
+        pipefds[0] = pipefds[1] = -1;
+    }
+    bool init();
+    void newClient(NetconServCon *con, bool http);
+    // Client socket events. Returns 0 if the connection must be closed.
+    int clientData(int id, NetconData *con, Netcon::Event reason);
+    // Process the results returned by the workers.
+    void collect();
+
+    SelectLoop loop;
+
+private:
+    enum Proto {PROTO_TEXT, PROTO_FRAMED, PROTO_JSON, PROTO_HTTP};
+    struct Job {
+        Job() : client(-1), seq(0), proto(PROTO_TEXT), status(200),
+                close(false) {}
+        int client;
+        unsigned int seq;
+        Proto proto;
+        // Text command or JSON request
+        string request;
+        string out;
+        // HTTP status and connection persistence
+        int status;
+        bool close;
+    };
+    struct Client {
+        Client() : http(false), nextseq(0), nextsend(0), stopread(false),
+                   closing(false), headerbytes(0), inbody(false),
+                   bodysize(0) {}
+        NetconP con;
+        bool http;
+        // Sequence number for the next request
+        unsigned int nextseq;
+        // Sequence number of the next response to send
+        unsigned int nextsend;
+        // Done requests waiting for their turn to be sent
+        map<unsigned int, Job> done;
+        // The last request asked for the connection to be closed
+        bool stopread;
+        // Close when the write queue is empty
+        bool closing;
+        // HTTP request being read
+        vector<string> headers;
+        unsigned int headerbytes;
+        bool inbody;
+        int bodysize;
+    };
+
+    void lineRequest(int id, Client& client, const string& line);
+    bool httpRequest(int id, Client& client, NetconData *con);
+    void queue(const Job& job);
+    void done(const Job& job);
+    void finished(const Job& job);
+    bool output(Client& client);
+    void worker();
+
+    int pipefds[2];
+    int nextclient;
+    // Only accessed from the loop thread
+    map<int, Client> clients;
+    // Job queues, shared with the workers
+    mutex mmutex;
+    condition_variable cond;
+    deque<Job> jobs;
+    deque<Job> results;
+};
+
+static ScctlServer theServer;
+
+// Data callback for the client connections
+class ClientWorker : public NetconWorker {
+public:
+    ClientWorker(int id) : m_id(id) {}
+    virtual int data(NetconData *con, Netcon::Event reason) {
+        return theServer.clientData(m_id, con, reason);
+    }
+private:
+    int m_id;
+};
+
+// Data callback for the reading side of the worker results pipe
+class PipeWorker : public NetconWorker {
+public:
+    virtual int data(NetconData *con, Netcon::Event) {
+        // Non-blocking: read directly to avoid the receive() error
+        // messages when the pipe is empty.
+        char buf[100];
+        while (read(con->getfd(), buf, sizeof(buf)) > 0)
+            continue;
+        theServer.collect();
         return 1;
     }
+};
 
-    if (con->send(out.c_str(), out.size(), 0) < 0) {
-        LOGERR("scctl: server: send() failed\n");
+// Listening endpoint: connections are added to the select loop.
+class MyNetconServLis : public NetconServLis {
+public:
+    MyNetconServLis(bool http = false) : m_http(http) {}
+protected:
+    int cando(Netcon::Event) {
+        NetconServCon *con = accept();
+        if (con == 0) {
+            LOGERR("scctl server: accept() failed\n");
+        } else {
+            theServer.newClient(con, m_http);
+        }
         return 1;
     }
+private:
+    bool m_http;
+};
+
+bool ScctlServer::init()
+{
+    if (pipe(pipefds) < 0) {
+        LOGERR("scctl: server: pipe() failed\n");
+        return false;
+    }
+    fcntl(pipefds[1], F_SETFL, fcntl(pipefds[1], F_GETFL) | O_NONBLOCK);
+    NetconCli *pcon = new NetconCli();
+    pcon->setconn(pipefds[0]);
+    pcon->setcallback(std::shared_ptr<NetconWorker>(new PipeWorker()));
+    loop.addselcon(NetconP(pcon), Netcon::NETCONPOLL_READ);
+
+    for (int i = 0; i < serverWorkers; i++) {
+        try {
+            thread(&ScctlServer::worker, this).detach();
+        } catch (const std::exception& ex) {
+            LOGERR("scctl: server: could not start thread: " << ex.what()
+                   << endl);
+            return false;
+        }
+    }
+    return true;
+}
+
+void ScctlServer::newClient(NetconServCon *con, bool http)
+{
+    int id = nextclient++;
+    Client& client = clients[id];
+    client.con = NetconP(con);
+    client.http = http;
+    con->setcallback(std::shared_ptr<NetconWorker>(new ClientWorker(id)));
+    loop.addselcon(client.con, Netcon::NETCONPOLL_READ);
+}
+
+int ScctlServer::clientData(int id, NetconData *con, Netcon::Event reason)
+{
+    auto it = clients.find(id);
+    if (it == clients.end())
+        return 0;
+    Client& client = it->second;
+
+    if (reason & Netcon::NETCONPOLL_WRITE) {
+        // The write queue is empty
+        if (!client.closing)
+            return 1;
+        // The loop holds a reference: we can't remselcon() from here
+        con->setselevents(0);
+        clients.erase(it);
+        return 0;
+    }
 
+    int cnt = con->readavail();
+    if (cnt <= 0) {
+        // EOF or error. Results for pending requests will be dropped.
+        LOGDEB1("scctl: server: client " << id << " gone\n");
+        con->setselevents(0);
+        clients.erase(it);
+        return 0;
+    }
+    if (client.http) {
+        while (!client.stopread && httpRequest(id, client, con))
+            continue;
+    } else {
+        const char *line;
+        int len;
+        while (!client.stopread && con->getlineview(&line, &len)) {
+            lineRequest(id, client, string(line, len));
+        }
+    }
+    if (client.stopread) {
+        // Discard anything after a request which will close the
+        // connection. We keep reading to detect an early close.
+        const char *data;
+        con->getdataview(con->bufferedbytes(), &data);
+        return 1;
+    }
+    if (con->bufferedbytes() > int(maxLineSize)) {
+        LOGERR("scctl: server: request too long\n");
+        con->setselevents(0);
+        clients.erase(it);
+        return 0;
+    }
     return 1;
 }
 
+void ScctlServer::lineRequest(int id, Client& client, const string& _line)
+{
+    string line(_line);
+    trimstring(line, " \r\n");
+    LOGDEB1("scctl: server: got cmd: " << line << endl);
+    if (line.empty())
+        return;
+
+    Job job;
+    job.client = id;
+    job.seq = client.nextseq++;
+    if (line[0] == '{') {
+        job.proto = PROTO_JSON;
+    } else if (line[0] == '+') {
+        job.proto = PROTO_FRAMED;
+        line.erase(0, 1);
+    } else {
+        client.stopread = true;
+    }
+    job.request = line;
+    queue(job);
+}
+
+// Extract a complete HTTP request from the input buffer, if any. 
+bool ScctlServer::httpRequest(int id, Client& client, NetconData *con)
+{
+    while (!client.inbody) {
+        const char *line;
+        int len;
+        if (!con->getlineview(&line, &len))
+            return false;
+        string header(line, len);
+        trimstring(header, "\r\n");
+        client.headerbytes += len;
+        if (client.headers.size() >= maxHeaders ||
+            client.headerbytes > maxLineSize) {
+            // Answer 400 and close: we don't want to look for the
+            // end of this.
+            LOGERR("scctl: server: HTTP request header too big\n");
+            client.headers.clear();
+            client.headerbytes = 0;
+            client.stopread = true;
+            Job job;
+            job.client = id;
+            job.proto = PROTO_HTTP;
+            job.seq = client.nextseq++;
+            job.close = true;
+            job.status = 400;
+            job.out = jsonError("", "request header too big");
+            done(job);
+            return false;
+        }
+        if (!header.empty()) {
+            client.headers.push_back(header);
+        } else if (!client.headers.empty()) {
+            client.inbody = true;
+        }
+    }
+
+    vector<string> reqline;
+    stringToTokens(client.headers[0], reqline);
+    bool keepalive = reqline.size() == 3 && reqline[2] == "HTTP/1.1";
+    int bodysize = 0;
+    for (unsigned int i = 1; i < client.headers.size(); i++) {
+        string::size_type colon = client.headers[i].find(':');
+        if (colon == string::npos)
+            continue;
+        string nm = client.headers[i].substr(0, colon);
+        string value = client.headers[i].substr(colon + 1);
+        trimstring(value, " \t");
+        transform(nm.begin(), nm.end(), nm.begin(), ::tolower);
+        transform(value.begin(), value.end(), value.begin(), ::tolower);
+        if (nm == "content-length") {
+            bodysize = atoi(value.c_str());
+        } else if (nm == "connection") {
+            keepalive = value == "keep-alive";
+        }
+    }
+
+    Job job;
+    job.client = id;
+    job.proto = PROTO_HTTP;
+    string body;
+    if (bodysize < 0 || bodysize > int(maxLineSize)) {
+        reqline.clear();
+        keepalive = false;
+    } else {
+        const char *data = 0;
+        if (bodysize > 0 && !con->getdataview(bodysize, &data)) {
+            // Body not complete yet
+            return false;
+        }
+        body.assign(data ? data : "", bodysize);
+    }
+    client.headers.clear();
+    client.headerbytes = 0;
+    client.inbody = false;
+    job.seq = client.nextseq++;
+    job.close = !keepalive;
+    client.stopread = job.close;
+
+    if (reqline.size() < 2) {
+        job.status = 400;
+        job.out = jsonError("", "bad request");
+        done(job);
+    } else if (reqline[0] == "POST" && reqline[1] == "/api") {
+        job.request = body;
+        queue(job);
+    } else if (reqline[0] == "GET" && (reqline[1] == "/receivers" ||
+                                       reqline[1] == "/senders" ||
+                                       reqline[1] == "/ping")) {
+        job.request = "{\"op\":\"" + reqline[1].substr(1) + "\"}";
+        queue(job);
+    } else {
+        job.status = 404;
+        job.out = jsonError("", "not found");
+        done(job);
+    }
+    return true;
+}
+
+static bool isJsonPing(const string& request)
+{
+    JsonReq req;
+    JsonParser parser(request);
+    return parser.parseObject(req) && req["op"].s == "ping";
+}
+
+// Hand a request to the workers, except for pings which we answer at
+// once.
+void ScctlServer::queue(const Job& job)
+{
+    if (job.proto == PROTO_TEXT || job.proto == PROTO_FRAMED) {
+        vector<string> toks;
+        stringToTokens(job.request, toks);
+        if (!toks.empty() && (strtoul(toks[0].c_str(), 0, 0) & OPT_p)) {
+            Job pjob(job);
+            runCommand(toks, pjob.out);
+            done(pjob);
+            return;
+        }
+    } else if (isJsonPing(job.request)) {
+        Job pjob(job);
+        pjob.out = runJson(job.request);
+        done(pjob);
+        return;
+    }
+    {
+        unique_lock<mutex> lock(mmutex);
+        jobs.push_back(job);
+    }
+    cond.notify_one();
+}
+
+void ScctlServer::worker()
+{
+    for (;;) {
+        Job job;
+        {
+            unique_lock<mutex> lock(mmutex);
+            while (jobs.empty())
+                cond.wait(lock);
+            job = jobs.front();
+            jobs.pop_front();
+        }
+        if (job.proto == PROTO_JSON || job.proto == PROTO_HTTP) {
+            job.out = runJson(job.request);
+        } else {
+            vector<string> toks;
+            stringToTokens(job.request, toks);
+            if (toks.empty() || !runCommand(toks, job.out)) {
+                LOGERR("scctl: server: bad cmd:" << job.request << endl);
+                job.out.clear();
+                if (job.proto == PROTO_FRAMED)
+                    job.out = "Error bad command\n";
+            }
+        }
+        done(job);
+    }
+}
+
+// Queue a completed job for the loop. This always goes through the
+// pipe, even from the loop thread, because sending the response may
+// close the connection, which we can't do from its own callback.
+void ScctlServer::done(const Job& job)
+{
+    {
+        unique_lock<mutex> lock(mmutex);
+        results.push_back(job);
+    }
+    // Wake up the loop. If the pipe is full, it is awake anyway.
+    if (write(pipefds[1], "x", 1) < 0) {
+        LOGDEB1("scctl: server: pipe write failed\n");
+    }
+}
+
+void ScctlServer::collect()
+{
+    deque<Job> todo;
+    {
+        unique_lock<mutex> lock(mmutex);
+        todo.swap(results);
+    }
+    for (auto& job : todo) {
+        finished(job);
+    }
+}
+
+// Store the response for a request, and send what we can, in request
+// order. Called from the pipe callback.
+void ScctlServer::finished(const Job& job)
+{
+    auto it = clients.find(job.client);
+    if (it == clients.end())
+        return;
+    Client& client = it->second;
+    client.done[job.seq] = job;
+    if (!output(client)) {
+        loop.remselcon(client.con);
+        clients.erase(it);
+    }
+}
+
+static const char *httpStatus(int status)
+{
+    switch (status) {
+    case 200: return "200 OK";
+    case 400: return "400 Bad Request";
+    case 404: return "404 Not Found";
+    default: return "500 Internal Server Error";
+    }
+}
+
+// Queue the ready responses and write as much as possible: the
+// connection does the rest. Returns false if the connection should be
+// closed now.
+bool ScctlServer::output(Client& client)
+{
+    NetconData *con = static_cast<NetconData*>(client.con.get());
+    while (!client.closing) {
+        auto dit = client.done.find(client.nextsend);
+        if (dit == client.done.end())
+            break;
+        Job& job = dit->second;
+        switch (job.proto) {
+        case PROTO_TEXT:
+            client.closing = true;
+            break;
+        case PROTO_FRAMED:
+            con->queuesend(to_string(job.out.size()) + "\n", false);
+            break;
+        case PROTO_JSON:
+            job.out += "\n";
+            break;
+        case PROTO_HTTP:
+            job.out += "\n";
+            con->queuesend(string("HTTP/1.1 ") + httpStatus(job.status) +
+                           "\r\nContent-Type: application/json\r\n"
+                           "Content-Length: " + to_string(job.out.size()) +
+                           "\r\n" + (job.close ? "Connection: close\r\n" : "")
+                           + "\r\n", false);
+            client.closing = job.close;
+            break;
+        }
+        con->queuesend(std::move(job.out), false);
+        client.done.erase(dit);
+        client.nextsend++;
+    }
+
+    if (con->flushsend() < 0) {
+        LOGERR("scctl: server: send failed\n");
+        return false;
+    }
+    return !(client.closing && !con->sendqueued());
+}
+
 // Server init routine
 
-int runserver()
+int runserver(int httpport, const string& httpaddr)
 {
     string snm;
     if (!sockname(snm)) {
@@ -451,8 +1858,11 @@ int runserver()
     signal(SIGCHLD, SIG_IGN);
     signal(SIGPIPE, SIG_IGN);
 
-    // Initialize lib at once, will be ready when we need it
-    showReceivers();
+    // Initialize lib at once, and start the state cache, which will
+    // be ready when we need it
+    if (!stateCache.start()) {
+        return 1;
+    }
 
     MyNetconServLis *servlis = new MyNetconServLis();
     if (servlis == 0) {
@@ -464,12 +1874,26 @@ int runserver()
         return 1;
     }
 
-    SelectLoop myloop;
-    myloop.addselcon(NetconP(servlis), Netcon::NETCONPOLL_READ);
+    if (!theServer.init()) {
+        return 1;
+    }
+    theServer.loop.addselcon(NetconP(servlis), Netcon::NETCONPOLL_READ);
 
     LOGDEB("scctl: server: openservice(" << snm << ") Ok\n");
 
-    if (myloop.doLoop() < 0) {
+    if (httpport > 0) {
+        MyNetconServLis *httplis = new MyNetconServLis(true);
+        if (httplis->openservice(httpport, 10, httpaddr.c_str()) < 0) {
+            LOGERR("scctl: server: openservice(" << httpaddr << ":" <<
+                   httpport << ") failed\n");
+            return 1;
+        }
+        theServer.loop.addselcon(NetconP(httplis), Netcon::NETCONPOLL_READ);
+        LOGDEB("scctl: server: HTTP on " << httpaddr << ":" << httpport <<
+               " Ok\n");
+    }
+
+    if (theServer.loop.doLoop() < 0) {
         LOGERR("scctl: server: selectloop failed\n");
         return 1;
     }
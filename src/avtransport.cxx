@@ -23,6 +23,7 @@
 #include <iostream>                     // for operator<<, etc
 #include <map>                          // for map, map<>::const_iterator
 #include <utility>                      // for pair
+#include <vector>                       // for vector
 
 #include "libupnpp/log.hxx"             // for LOGDEB, LOGDEB1, LOGERR
 #include "libupnpp/soaphelp.hxx"        // for SoapOutgoing, SoapIncoming, etc
@@ -43,7 +44,8 @@ static const string sIdTransport("urn:upnp-org:serviceId:AVTransport");
 static const string sTpTransport("urn:schemas-upnp-org:service:AVTransport:1");
 
 UpMpdAVTransport::UpMpdAVTransport(UpMpd *dev, bool noev)
-    : UpnpService(sTpTransport, sIdTransport, dev, noev), m_dev(dev), m_ohp(0)
+    : UpnpService(sTpTransport, sIdTransport, dev, noev), m_dev(dev), m_ohp(0),
+      m_subscribed(false)
 {
     m_dev->addActionMapping(this,"SetAVTransportURI", 
                             bind(&UpMpdAVTransport::setAVTransportURI, 
@@ -147,6 +149,31 @@ static string mpdsToPlaymode(const MpdStatus& mpds)
 //
 // To be all bundled inside:    LastChange
 
+// Update our idea of the current track. The actions use it, so this
+// must be done on each pass, even if nobody is subscribed to our
+// events.
+void UpMpdAVTransport::trackUri(const MpdStatus& mpds)
+{
+    const string& uri = mpds.currentsong.uri;
+
+    // MPD may have switched to the next track, or may be playing
+    // something else altogether if some other client told it to
+    if (!uri.compare(m_nextUri)) {
+        m_uri = m_nextUri;
+        m_curMetadata = m_nextMetadata;
+        m_nextUri.clear();
+        m_nextMetadata.clear();
+    } else if (uri.compare(m_uri)) {
+        // Someone else is controlling mpd. Maybe our own ohplaylist.
+        m_nextMetadata.clear();
+        m_nextUri.clear();
+        m_uri = uri;
+        if (!m_ohp || !m_ohp->cacheFind(uri, m_curMetadata)) {
+            m_curMetadata = didlmake(mpds.currentsong);
+        }
+    }
+}
+
 // Translate MPD state to UPnP AVTransport state variables
 bool UpMpdAVTransport::tpstateMToU(unordered_map<string, string>& status)
 {
@@ -176,23 +203,7 @@ bool UpMpdAVTransport::tpstateMToU(unordered_map<string, string>& status)
     status["TransportPlaySpeed"] = "1";
 
     const string& uri = mpds.currentsong.uri;
-
-    // MPD may have switched to the next track, or may be playing
-    // something else altogether if some other client told it to
-    if (!uri.compare(m_nextUri)) {
-        m_uri = m_nextUri;
-        m_curMetadata = m_nextMetadata;
-        m_nextUri.clear();
-        m_nextMetadata.clear();
-    } else if (uri.compare(m_uri)) {
-        // Someone else is controlling mpd. Maybe our own ohplaylist.
-        m_nextMetadata.clear();
-        m_nextUri.clear();
-        m_uri = uri;
-        if (!m_ohp || !m_ohp->cacheFind(uri, m_curMetadata)) {
-            m_curMetadata = didlmake(mpds.currentsong);
-        }
-    }
+    trackUri(mpds);
 
     status["CurrentTrack"] = "1";
     status["CurrentTrackURI"] = uri;
@@ -256,6 +267,19 @@ bool UpMpdAVTransport::tpstateMToU(unordered_map<string, string>& status)
 bool UpMpdAVTransport::getEventData(bool all, std::vector<std::string>& names, 
                                     std::vector<std::string>& values)
 {
+    // We are the first service polled by the event loop: apply a
+    // configuration change before the others compute their state.
+    m_dev->checkConfig();
+
+    // Also update the mpd status for everybody. If nobody ever
+    // subscribed to our events, this is all we do.
+    if (m_dev->isSubscription(all))
+        m_subscribed = true;
+    if (!m_subscribed) {
+        trackUri(m_dev->getMpdStatus());
+        return true;
+    }
+
     unordered_map<string, string> newtpstate;
     tpstateMToU(newtpstate);
     if (all)
@@ -351,17 +375,12 @@ int UpMpdAVTransport::setAVTransportURI(const SoapIncoming& sc, SoapOutgoing& da
             LOGDEB("setNextAVTransportURI invoked but empty queue!" << endl);
             return UPNP_E_INVALID_PARAM;
         }
-        if ((m_dev->m_options & UpMpd::upmpdOwnQueue) && mpds.qlen > 1) {
+        if ((m_dev->m_options & UpMpd::upmpdOwnQueue) &&
+            mpds.qlen > curpos + 1) {
             // If we own the queue, make sure we only keep 2 songs in it:
-            // guard against multiple setnext calls.
-            int posend;
-            for (posend = curpos + 1;; posend++) {
-                UpSong nsong;
-                if (!m_dev->m_mpdcli->statSong(nsong, posend))
-                    break;
-            }
-            if (posend > curpos+1)
-                m_dev->m_mpdcli->deletePosRange(curpos + 1, posend);
+            // guard against multiple setnext calls. The status we just
+            // got tells us where the queue ends.
+            m_dev->m_mpdcli->deletePosRange(curpos + 1, mpds.qlen);
         }
     }
 
@@ -404,17 +423,13 @@ int UpMpdAVTransport::setAVTransportURI(const SoapIncoming& sc, SoapOutgoing& da
         default: break;
         }
 #endif
-        // Clean up old song ids
+        // Clean up old song ids, with one command list. Some may
+        // not exist any more: deleteIds() then clears the error
+        // state and goes on with the remaining ones one by one,
+        // checking that they exist.
         if (!(m_dev->m_options & UpMpd::upmpdOwnQueue)) {
-            for (set<int>::iterator it = m_songids.begin();
-                 it != m_songids.end(); it++) {
-                // Can't just delete here. If the id does not exist, MPD 
-                // gets into an apparently permanent error state, where even 
-                // get_status does not work
-                if (m_dev->m_mpdcli->statId(*it)) {
-                    m_dev->m_mpdcli->deleteId(*it);
-                }
-            }
+            vector<int> ids(m_songids.begin(), m_songids.end());
+            m_dev->m_mpdcli->deleteIds(ids);
             m_songids.clear();
         }
     }
@@ -25,6 +25,7 @@
 #include "libupnpp/device/device.hxx"   // for UpnpService
 #include "libupnpp/soaphelp.hxx"        // for SoapIncoming, SoapOutgoing
 
+class MpdStatus;
 class OHPlaylist;
 class UpMpd;
 
@@ -56,6 +57,7 @@ private:
     int seqcontrol(const SoapIncoming& sc, SoapOutgoing& data, int what);
     // Translate MPD state to AVTransport state variables.
     bool tpstateMToU(std::unordered_map<std::string, std::string>& state);
+    void trackUri(const MpdStatus& mpds);
 
     UpMpd *m_dev;
     OHPlaylist *m_ohp;
@@ -68,6 +70,9 @@ private:
     std::string m_nextMetadata;
     // My track identifiers (for cleaning up)
     std::set<int> m_songids;
+    // A control point subscribed to our events (never reset, see
+    // OHService)
+    bool m_subscribed;
 };
 
 #endif /* _AVTRANSPORT_H_X_INCLUDED_ */
@@ -0,0 +1,166 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "bgtask.hxx"
+
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "libupnpp/log.hxx"
+
+using namespace std;
+using namespace UPnPP;
+
+// The internal data is shared with the threads, which may outlive the
+// BgTask object if they were cancelled.
+class BgTask::Internal {
+public:
+    Internal(function<void ()> w)
+        : wakeup(w), generation(0), running(false), done(false), ok(false) {
+    }
+    mutex mmutex;
+    condition_variable mcond;
+    function<void ()> wakeup;
+    function<void ()> abort;
+    // Incremented for each start/cancel. A thread only stores its
+    // result if the generation did not change.
+    unsigned int generation;
+    bool running;
+    bool done;
+    bool ok;
+    string result;
+
+    // Store the result of the task, and wake up the loop
+    static void complete(shared_ptr<Internal> mm, unsigned int gen, bool ok,
+                         const string& result) {
+        {
+            unique_lock<mutex> lock(mm->mmutex);
+            if (gen != mm->generation) {
+                LOGDEB("BgTask: task was cancelled" << endl);
+                return;
+            }
+            if (mm->done)
+                return;
+            mm->done = true;
+            mm->ok = ok;
+            mm->result = result;
+            mm->abort = nullptr;
+        }
+        mm->mcond.notify_all();
+        if (mm->wakeup)
+            mm->wakeup();
+    }
+};
+
+BgTask::BgTask(function<void ()> wakeup)
+    : m(new Internal(wakeup))
+{
+}
+
+BgTask::~BgTask()
+{
+    cancel();
+}
+
+bool BgTask::start(Func func, function<void ()> abort)
+{
+    cancel();
+
+    unique_lock<mutex> lock(m->mmutex);
+    unsigned int gen = ++m->generation;
+    m->running = true;
+    m->done = false;
+    m->ok = false;
+    m->result.clear();
+    m->abort = abort;
+    shared_ptr<Internal> mm(m);
+    try {
+        thread thr([mm, gen, func] () {
+                string result;
+                bool ok = func(result);
+                Internal::complete(mm, gen, ok, result);
+            });
+        thr.detach();
+    } catch (const std::exception& ex) {
+        LOGERR("BgTask::start: could not start thread: " << ex.what() << endl);
+        m->running = false;
+        m->abort = nullptr;
+        return false;
+    }
+    return true;
+}
+
+BgTask::Done BgTask::startDone(function<void ()> abort)
+{
+    cancel();
+
+    unique_lock<mutex> lock(m->mmutex);
+    unsigned int gen = ++m->generation;
+    m->running = true;
+    m->done = false;
+    m->ok = false;
+    m->result.clear();
+    m->abort = abort;
+    shared_ptr<Internal> mm(m);
+    return [mm, gen] (bool ok, const string& result) {
+        Internal::complete(mm, gen, ok, result);
+    };
+}
+
+void BgTask::cancel()
+{
+    unique_lock<mutex> lock(m->mmutex);
+    if (m->running && !m->done && m->abort) {
+        m->abort();
+    }
+    m->generation++;
+    m->running = false;
+    m->done = false;
+    m->abort = nullptr;
+    m->mcond.notify_all();
+}
+
+bool BgTask::pending()
+{
+    unique_lock<mutex> lock(m->mmutex);
+    return m->running;
+}
+
+bool BgTask::collect(bool& ok, string& result)
+{
+    unique_lock<mutex> lock(m->mmutex);
+    if (!m->running || !m->done)
+        return false;
+    ok = m->ok;
+    result.swap(m->result);
+    m->running = false;
+    m->done = false;
+    return true;
+}
+
+bool BgTask::wait(int timeoutsecs)
+{
+    unique_lock<mutex> lock(m->mmutex);
+    m->mcond.wait_for(lock, chrono::seconds(timeoutsecs),
+                      [this] () {return !m->running || m->done;});
+    return m->running && m->done;
+}
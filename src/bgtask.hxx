@@ -0,0 +1,75 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _BGTASK_H_X_INCLUDED_
+#define _BGTASK_H_X_INCLUDED_
+
+#include <functional>
+#include <memory>
+#include <string>
+
+/**
+ * Run a possibly slow operation (network fetch, waiting for a helper
+ * process) out of the action thread.
+ *
+ * The function runs in a detached thread. When it returns, the
+ * wakeup callback is called (typically UpnpDevice::loopWakeup()), and
+ * the event loop code (makestate()) picks up the result with
+ * collect() and finishes the job. Nothing else is done in the
+ * thread, so that the MPD connection and the service state are only
+ * accessed under the device lock, as usual.
+ *
+ * Cancelling a task makes sure that its result will be ignored. The
+ * thread itself can't be interrupted, an abort function can be set
+ * to make it return quickly (e.g.: kill the process it's reading
+ * from). It is called with an internal lock held, but only if the
+ * function has not returned yet.
+ *
+ * startDone() is for work which is driven from elsewhere (e.g. the
+ * ExecWatch callbacks) and needs no thread of its own: the
+ * returned function is called to store the result.
+ */
+class BgTask {
+public:
+    typedef std::function<bool (std::string&)> Func;
+    typedef std::function<void (bool, const std::string&)> Done;
+
+    BgTask(std::function<void ()> wakeup);
+    ~BgTask();
+
+    /** Start the task. Any previous one is cancelled first. */
+    bool start(Func func, std::function<void ()> abort = nullptr);
+    /** Start a task without a thread. Only the first call to the
+     * returned function matters. */
+    Done startDone(std::function<void ()> abort = nullptr);
+    /** Cancel the current task if any. */
+    void cancel();
+    /** A task was started and its result was not collected yet */
+    bool pending();
+    /** Retrieve the result of a task which has completed.
+     * @return false if no task is pending or it is not done. */
+    bool collect(bool& ok, std::string& result);
+    /** Block until the current task completes or the timeout
+     * expires. For the rare callers which can't return to the loop.
+     * @return true if the result is ready for collect(). */
+    bool wait(int timeoutsecs);
+
+    class Internal;
+private:
+    std::shared_ptr<Internal> m;
+};
+
+#endif /* _BGTASK_H_X_INCLUDED_ */
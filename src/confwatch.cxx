@@ -0,0 +1,216 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "confwatch.hxx"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "libupnpp/log.hxx"
+
+#include "conftree.hxx"
+
+using namespace std;
+using namespace UPnPP;
+
+// Wait for things to settle after a change event: editors often
+// write a file in several steps.
+static const int settlems = 500;
+// Interval for checking the stop request, and the file modification
+// time when we have no inotify.
+static const int pollms = 2000;
+
+class ConfWatch::Internal {
+public:
+    Internal(const string& f, function<void ()> w)
+        : fn(f), wakeup(w), stopreq(false), havenew(false) {
+    }
+    void worker();
+    bool waitInotify(int ifd);
+    void reload();
+
+    string fn;
+    // Directory and file name, after resolving symbolic links.
+    string dir;
+    string base;
+    function<void ()> wakeup;
+    // Last version read, used to check the modification time when
+    // we have no inotify.
+    shared_ptr<ConfSimple> current;
+    mutex mmutex;
+    bool stopreq;
+    bool havenew;
+    thread wthread;
+};
+
+void ConfWatch::Internal::reload()
+{
+    shared_ptr<ConfSimple> conf(new ConfSimple(fn.c_str(), 1, true));
+    if (!conf->ok()) {
+        LOGERR("ConfWatch: can't parse " << fn << ", ignoring the change\n");
+        return;
+    }
+    LOGINF("ConfWatch: " << fn << " changed, reloading" << endl);
+    {
+        unique_lock<mutex> lock(mmutex);
+        current = conf;
+        havenew = true;
+    }
+    if (wakeup)
+        wakeup();
+}
+
+#ifdef __linux__
+// Wait for a change to our file. Returns false if we're asked to stop
+bool ConfWatch::Internal::waitInotify(int ifd)
+{
+    bool changed = false;
+    int timeo = pollms;
+    for (;;) {
+        {
+            unique_lock<mutex> lock(mmutex);
+            if (stopreq)
+                return false;
+        }
+        struct pollfd pfd;
+        pfd.fd = ifd;
+        pfd.events = POLLIN;
+        int ret = poll(&pfd, 1, timeo);
+        if (ret < 0 && errno != EINTR) {
+            LOGERR("ConfWatch: poll failed, errno " << errno << endl);
+            return false;
+        }
+        if (ret <= 0) {
+            if (changed)
+                return true;
+            continue;
+        }
+        char buf[4096]
+            __attribute__ ((aligned(__alignof__(struct inotify_event))));
+        int n = read(ifd, buf, sizeof(buf));
+        for (char *cp = buf; n > 0 && cp < buf + n; ) {
+            struct inotify_event *ev = (struct inotify_event *)cp;
+            if (ev->len > 0 && base == ev->name) {
+                changed = true;
+                timeo = settlems;
+            }
+            cp += sizeof(struct inotify_event) + ev->len;
+        }
+    }
+}
+#endif
+
+void ConfWatch::Internal::worker()
+{
+#ifdef __linux__
+    int ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ifd >= 0 &&
+        inotify_add_watch(ifd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO |
+                          IN_CREATE) >= 0) {
+        LOGDEB("ConfWatch: watching " << dir << " for " << base << endl);
+        while (waitInotify(ifd)) {
+            reload();
+        }
+        close(ifd);
+        return;
+    }
+    LOGERR("ConfWatch: inotify failed for " << dir << ", errno " << errno <<
+           ". Will check the file periodically" << endl);
+    if (ifd >= 0)
+        close(ifd);
+#endif
+    for (;;) {
+        this_thread::sleep_for(chrono::milliseconds(pollms));
+        shared_ptr<ConfSimple> cur;
+        {
+            unique_lock<mutex> lock(mmutex);
+            if (stopreq)
+                return;
+            cur = current;
+        }
+        if (cur && cur->sourceChanged()) {
+            // Let the writer finish
+            this_thread::sleep_for(chrono::milliseconds(settlems));
+            reload();
+        }
+    }
+}
+
+ConfWatch::ConfWatch(const string& fn, function<void ()> wakeup)
+{
+    m = new Internal(fn, wakeup);
+    char rpath[PATH_MAX];
+    string path = realpath(fn.c_str(), rpath) ? string(rpath) : fn;
+    string::size_type slash = path.find_last_of("/");
+    if (slash == string::npos) {
+        m->dir = ".";
+        m->base = path;
+    } else {
+        m->dir = slash == 0 ? "/" : path.substr(0, slash);
+        m->base = path.substr(slash + 1);
+    }
+    m->fn = path;
+    m->current = shared_ptr<ConfSimple>(new ConfSimple(path.c_str(), 1, true));
+}
+
+ConfWatch::~ConfWatch()
+{
+    if (m->wthread.joinable()) {
+        {
+            unique_lock<mutex> lock(m->mmutex);
+            m->stopreq = true;
+        }
+        m->wthread.join();
+    }
+    delete m;
+}
+
+bool ConfWatch::start()
+{
+    try {
+        m->wthread = thread(&ConfWatch::Internal::worker, m);
+    } catch (const std::exception& ex) {
+        LOGERR("ConfWatch::start: could not start thread: " << ex.what()
+               << endl);
+        return false;
+    }
+    return true;
+}
+
+bool ConfWatch::collect(shared_ptr<ConfSimple>& conf)
+{
+    unique_lock<mutex> lock(m->mmutex);
+    if (!m->havenew)
+        return false;
+    m->havenew = false;
+    conf = m->current;
+    return true;
+}
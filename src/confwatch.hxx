@@ -0,0 +1,54 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _CONFWATCH_H_X_INCLUDED_
+#define _CONFWATCH_H_X_INCLUDED_
+
+#include <functional>
+#include <memory>
+#include <string>
+
+class ConfSimple;
+
+/**
+ * Watch the configuration file and re-read it when it changes.
+ *
+ * A thread waits for changes (inotify on Linux, else a periodic
+ * check of the file modification time). It parses the new version
+ * and calls the wakeup function. The event loop then picks up the
+ * new configuration with collect() and applies it, as for a BgTask
+ * result. The file is watched through its directory, so that editors
+ * which replace the file instead of rewriting it are handled.
+ * A version which can't be parsed is ignored.
+ */
+class ConfWatch {
+public:
+    ConfWatch(const std::string& fn, std::function<void ()> wakeup);
+    ~ConfWatch();
+
+    /** Start the watcher thread */
+    bool start();
+
+    /** Retrieve the new configuration, if the file changed since the
+     * last call. */
+    bool collect(std::shared_ptr<ConfSimple>& conf);
+
+    class Internal;
+private:
+    Internal *m;
+};
+
+#endif /* _CONFWATCH_H_X_INCLUDED_ */
@@ -71,7 +71,8 @@ class ExecCmdProvide {
 class ExecCmd {
  public:
     // Use vfork instead of fork. This must not be called in a multithreaded 
-    // program.
+    // program. Ignored if posix_spawn() is available: it is then always
+    // used, and it is safe with threads.
     static void useVfork(bool on)
     {
 	o_useVfork  = on;
@@ -146,6 +147,9 @@ class ExecCmd {
     bool maybereap(int *status);
 
     pid_t getChildPid() {return m_pid;}
+    /** Descriptor for reading the command output after startExec()
+     * with has_output, for use by an external event loop. -1 if none. */
+    int getOutputFd() {return m_pipeout[0];}
 
     /** 
      * Cancel/kill command. This can be called from another thread or
@@ -216,6 +220,9 @@ class ExecCmd {
     // Child process code
     inline void dochild(const std::string &cmd, const char **argv, 
 			const char **envv, bool has_input, bool has_output);
+    // Start the child with posix_spawn() instead of fork()+dochild()
+    int dospawn(const std::string& exe, const char **argv, 
+		const char **envv, bool has_input, bool has_output);
     /* Copyconst and assignment private and forbidden */
     ExecCmd(const ExecCmd &) {}
     ExecCmd& operator=(const ExecCmd &) {return *this;};
@@ -0,0 +1,396 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "execwatch.hxx"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libupnpp/log.hxx"
+
+#include "execmd.h"
+#include "netcon.h"
+
+using namespace std;
+using namespace UPnPP;
+
+// Interval for polling the exit of the processes for which we have
+// no pidfd, and whose output is closed.
+static const int pollms = 500;
+
+// A watched command.
+struct WatchedCmd {
+    WatchedCmd(shared_ptr<ExecCmd> c, ExecWatch::LineCB l, ExecWatch::ExitCB e)
+        : cmd(c), online(l), onexit(e), pidfd(-1), outeof(false),
+          exited(false), removed(false) {
+    }
+    shared_ptr<ExecCmd> cmd;
+    ExecWatch::LineCB online;
+    ExecWatch::ExitCB onexit;
+    // Connections for the command output and the pidfd
+    NetconP outcon;
+    NetconP pidcon;
+    int pidfd;
+    // Output closed
+    bool outeof;
+    // The pidfd signaled the process exit
+    bool exited;
+    // remove() was called from a callback
+    bool removed;
+};
+
+class ExecWatch::Internal {
+public:
+    Internal() : opserial(0), donserial(0) {
+        pipefd[0] = pipefd[1] = -1;
+    }
+    bool init();
+    void run();
+
+    // Called from the loop callbacks
+    int outputData(WatchedCmd *wc, NetconData *con);
+    void pidfdReady(WatchedCmd *wc);
+
+    // Queued requests, performed by the loop thread between
+    // doLoop() calls, so that the loop is not modified while it is
+    // dispatching.
+    struct Op {
+        Op(shared_ptr<WatchedCmd> w, bool a, unsigned int s)
+            : wc(w), isadd(a), serial(s) {
+        }
+        shared_ptr<WatchedCmd> wc;
+        bool isadd;
+        unsigned int serial;
+    };
+    unsigned int queueOp(shared_ptr<WatchedCmd> wc, bool isadd);
+    void doOps();
+    void doAdd(shared_ptr<WatchedCmd> wc);
+    void doRemove(ExecCmd *cmd);
+    void reapExited();
+    void deliver(WatchedCmd *wc, const string& line);
+
+    SelectLoop loop;
+    thread::id tid;
+    int pipefd[2];
+    map<ExecCmd *, shared_ptr<WatchedCmd> > cmds;
+
+    mutex opmutex;
+    condition_variable opcond;
+    deque<Op> ops;
+    // Serial of the last queued op, and of the last one performed.
+    unsigned int opserial;
+    unsigned int donserial;
+};
+
+// Worker for the command output.
+class ExecWatchOutput : public NetconWorker {
+public:
+    ExecWatchOutput(ExecWatch::Internal *m, WatchedCmd *wc)
+        : m_m(m), m_wc(wc) {
+    }
+    virtual int data(NetconData *con, Netcon::Event reason) {
+        m_m->outputData(m_wc, con);
+        return m_wc->outeof ? 0 : 1;
+    }
+private:
+    ExecWatch::Internal *m_m;
+    WatchedCmd *m_wc;
+};
+
+// Worker for the pidfd, which becomes readable when the process exits.
+class ExecWatchPidfd : public NetconWorker {
+public:
+    ExecWatchPidfd(ExecWatch::Internal *m, WatchedCmd *wc)
+        : m_m(m), m_wc(wc) {
+    }
+    virtual int data(NetconData *con, Netcon::Event reason) {
+        m_m->pidfdReady(m_wc);
+        return 0;
+    }
+private:
+    ExecWatch::Internal *m_m;
+    WatchedCmd *m_wc;
+};
+
+// Self-pipe, written to when ops are queued.
+class ExecWatchPipe : public NetconWorker {
+public:
+    virtual int data(NetconData *con, Netcon::Event reason) {
+        char buf[100];
+        (void)con->receive(buf, sizeof(buf));
+        con->getloop()->loopReturn(1);
+        return 1;
+    }
+};
+
+bool ExecWatch::Internal::init()
+{
+    if (pipe(pipefd) < 0) {
+        LOGERR("ExecWatch: pipe() failed, errno " << errno << endl);
+        return false;
+    }
+    NetconCli *pcon = new NetconCli();
+    pcon->setconn(pipefd[0]);
+    pcon->setcallback(make_shared<ExecWatchPipe>());
+    loop.addselcon(NetconP(pcon), Netcon::NETCONPOLL_READ);
+    loop.setperiodichandler(0, 0, pollms);
+    return true;
+}
+
+void ExecWatch::Internal::run()
+{
+    for (;;) {
+        // EINTR happens when children exit
+        if (loop.doLoop() < 0 && errno != EINTR) {
+            LOGERR("ExecWatch: doLoop() failed, errno " << errno << endl);
+            // Avoid a busy loop if this is not transient
+            this_thread::sleep_for(chrono::milliseconds(pollms));
+        }
+        doOps();
+        reapExited();
+    }
+}
+
+void ExecWatch::Internal::deliver(WatchedCmd *wc, const string& line)
+{
+    if (!wc->removed && wc->online)
+        wc->online(line);
+}
+
+// Read what is available and deliver the complete lines. Returns the
+// readavail() value.
+int ExecWatch::Internal::outputData(WatchedCmd *wc, NetconData *con)
+{
+    int n = con->readavail();
+    const char *line;
+    int len;
+    while (con->getlineview(&line, &len)) {
+        deliver(wc, string(line, len));
+    }
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+        // EOF or error. Deliver any incomplete last line.
+        int cnt = con->bufferedbytes();
+        if (cnt > 0 && con->getdataview(cnt, &line)) {
+            deliver(wc, string(line, cnt));
+        }
+        wc->outeof = true;
+    }
+    return n;
+}
+
+void ExecWatch::Internal::pidfdReady(WatchedCmd *wc)
+{
+    // Whatever the process wrote is in the pipe now: read it before
+    // calling the exit callback. The pipe may still be open if the
+    // command left children behind, in which case we just stop reading.
+    NetconData *con = dynamic_cast<NetconData*>(wc->outcon.get());
+    while (con && !wc->outeof && outputData(wc, con) > 0)
+        continue;
+    wc->exited = true;
+    loop.loopReturn(1);
+}
+
+unsigned int ExecWatch::Internal::queueOp(shared_ptr<WatchedCmd> wc,
+                                          bool isadd)
+{
+    unique_lock<mutex> lock(opmutex);
+    ops.push_back(Op(wc, isadd, ++opserial));
+    if (this_thread::get_id() == tid) {
+        loop.loopReturn(1);
+    } else if (write(pipefd[1], "x", 1) != 1) {
+        LOGERR("ExecWatch: pipe write failed, errno " << errno << endl);
+    }
+    return opserial;
+}
+
+void ExecWatch::Internal::doOps()
+{
+    for (;;) {
+        unique_lock<mutex> lock(opmutex);
+        if (ops.empty())
+            break;
+        Op op = ops.front();
+        ops.pop_front();
+        lock.unlock();
+        if (op.isadd) {
+            doAdd(op.wc);
+        } else {
+            doRemove(op.wc->cmd.get());
+        }
+        lock.lock();
+        donserial = op.serial;
+        opcond.notify_all();
+    }
+}
+
+void ExecWatch::Internal::doAdd(shared_ptr<WatchedCmd> wc)
+{
+    if (wc->removed)
+        return;
+    ExecCmd *cmd = wc->cmd.get();
+    if (cmds.find(cmd) != cmds.end()) {
+        LOGERR("ExecWatch::add: command already watched" << endl);
+        return;
+    }
+    int fd = cmd->getOutputFd();
+    if (fd >= 0) {
+        NetconCli *ocon = new NetconCli();
+        ocon->setconn(fd);
+        ocon->setcallback(make_shared<ExecWatchOutput>(this, wc.get()));
+        wc->outcon = NetconP(ocon);
+        loop.addselcon(wc->outcon, Netcon::NETCONPOLL_READ);
+    } else {
+        wc->outeof = true;
+    }
+#ifdef SYS_pidfd_open
+    if (cmd->getChildPid() > 0) {
+        wc->pidfd = syscall(SYS_pidfd_open, cmd->getChildPid(), 0);
+    }
+    if (wc->pidfd >= 0) {
+        NetconCli *pcon = new NetconCli();
+        pcon->setconn(wc->pidfd);
+        pcon->setcallback(make_shared<ExecWatchPidfd>(this, wc.get()));
+        wc->pidcon = NetconP(pcon);
+        loop.addselcon(wc->pidcon, Netcon::NETCONPOLL_READ);
+    }
+#endif
+    cmds[cmd] = wc;
+}
+
+void ExecWatch::Internal::doRemove(ExecCmd *cmd)
+{
+    auto it = cmds.find(cmd);
+    if (it == cmds.end())
+        return;
+    shared_ptr<WatchedCmd> wc = it->second;
+    if (wc->outcon) {
+        loop.remselcon(wc->outcon);
+        // Our connection did set the fd non-blocking, reset it for
+        // the command's owner.
+        wc->outcon->set_nonblock(0);
+    }
+    if (wc->pidcon) {
+        loop.remselcon(wc->pidcon);
+        close(wc->pidfd);
+    }
+    cmds.erase(it);
+}
+
+// Reap the processes which are known to have exited (pidfd), or
+// which may have (output closed and no pidfd), and call the exit
+// callbacks.
+void ExecWatch::Internal::reapExited()
+{
+    vector<shared_ptr<WatchedCmd> > done;
+    for (auto& ent : cmds) {
+        shared_ptr<WatchedCmd>& wc = ent.second;
+        if (wc->exited || (wc->pidfd < 0 && wc->outeof)) {
+            done.push_back(wc);
+        }
+    }
+    for (auto& wc : done) {
+        int status;
+        // Remove the connections before maybereap() closes the fds.
+        doRemove(wc->cmd.get());
+        if (!wc->cmd->maybereap(&status)) {
+            // Still running (no pidfd): watch it again at the next round.
+            cmds[wc->cmd.get()] = wc;
+            wc->outcon.reset();
+            continue;
+        }
+        LOGDEB("ExecWatch: command exited, status 0x" << hex << status <<
+               dec << endl);
+        if (!wc->removed && wc->onexit)
+            wc->onexit(status);
+    }
+}
+
+ExecWatch *ExecWatch::getWatch()
+{
+    static ExecWatch *watch;
+    static mutex wmutex;
+    unique_lock<mutex> lock(wmutex);
+    if (watch == 0) {
+        watch = new ExecWatch();
+    }
+    return watch;
+}
+
+ExecWatch::ExecWatch()
+    : m(new Internal())
+{
+    if (!m->init())
+        return;
+    try {
+        thread thr([this] () {m->run();});
+        m->tid = thr.get_id();
+        thr.detach();
+    } catch (const std::exception& ex) {
+        LOGERR("ExecWatch: could not start thread: " << ex.what() << endl);
+    }
+}
+
+bool ExecWatch::add(shared_ptr<ExecCmd> cmd, LineCB online, ExitCB onexit)
+{
+    if (!cmd || m->pipefd[1] < 0 || m->tid == thread::id()) {
+        return false;
+    }
+    m->queueOp(make_shared<WatchedCmd>(cmd, online, onexit), true);
+    return true;
+}
+
+void ExecWatch::remove(shared_ptr<ExecCmd> cmd)
+{
+    if (!cmd || m->pipefd[1] < 0 || m->tid == thread::id()) {
+        return;
+    }
+    shared_ptr<WatchedCmd> wc = make_shared<WatchedCmd>(cmd, nullptr, nullptr);
+    if (this_thread::get_id() == m->tid) {
+        // Called from a callback: we can't wait, but no callbacks
+        // will be called once the flag is set.
+        auto it = m->cmds.find(cmd.get());
+        if (it != m->cmds.end()) {
+            it->second->removed = true;
+        }
+        {
+            unique_lock<mutex> lock(m->opmutex);
+            for (auto& op : m->ops) {
+                if (op.wc->cmd == cmd)
+                    op.wc->removed = true;
+            }
+        }
+        m->queueOp(wc, false);
+        return;
+    }
+    unsigned int serial = m->queueOp(wc, false);
+    unique_lock<mutex> lock(m->opmutex);
+    while (m->donserial < serial) {
+        m->opcond.wait(lock);
+    }
+}
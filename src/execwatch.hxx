@@ -0,0 +1,71 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _EXECWATCH_H_X_INCLUDED_
+#define _EXECWATCH_H_X_INCLUDED_
+
+#include <functional>
+#include <memory>
+#include <string>
+
+class ExecCmd;
+
+/**
+ * Watch helper processes (started with ExecCmd::startExec()) from a
+ * single event loop thread, instead of parking a thread in a blocking
+ * getline() or polling maybereap() for each of them.
+ *
+ * The command output is read as it arrives and passed to the line
+ * callback one line at a time. The process exit is detected through
+ * a pidfd where the system has them, else by polling after the
+ * output is closed. The process is then reaped and the exit callback
+ * is called.
+ *
+ * The callbacks are called from the watcher thread, so, as with
+ * BgTask, they should do little more than storing the data and waking
+ * up the device loop (UpnpDevice::loopWakeup()). They may call add()
+ * or remove().
+ *
+ * A command being watched must not be used by its owner (getline(),
+ * zapChild(), etc.) until remove() has returned, or the exit callback
+ * has been called.
+ */
+class ExecWatch {
+public:
+    /** Called for each line of output, \n included (the last one may
+     * have none). */
+    typedef std::function<void (const std::string&)> LineCB;
+    /** Called once when the command has exited, with the wait status. */
+    typedef std::function<void (int)> ExitCB;
+
+    static ExecWatch *getWatch();
+
+    /** Start watching a command. Its output is only read if it was
+     * started with has_output */
+    bool add(std::shared_ptr<ExecCmd> cmd, LineCB online, ExitCB onexit);
+
+    /** Stop watching a command. When this returns, the callbacks won't
+     * be called any more for it. Does nothing if the command is not
+     * watched (e.g. it already exited). */
+    void remove(std::shared_ptr<ExecCmd> cmd);
+
+    class Internal;
+private:
+    ExecWatch();
+    Internal *m;
+};
+
+#endif /* _EXECWATCH_H_X_INCLUDED_ */
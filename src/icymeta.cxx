@@ -0,0 +1,480 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef ICYMETA_TEST
+
+#include "icymeta.hxx"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "libupnpp/log.hxx"
+
+#include "netcon.h"
+#include "upmpdutils.hxx"
+
+using namespace std;
+using namespace UPnPP;
+
+#ifndef UPMPDCLI_PACKAGE_VERSION
+#define UPMPDCLI_PACKAGE_VERSION "0"
+#endif
+static const string userAgent("Upmpdcli/" UPMPDCLI_PACKAGE_VERSION);
+
+// Network timeout
+static const int timeoSecs = 10;
+// Wait before reconnecting after the connection was lost
+static const int retrySecs = 30;
+// Max count of redirects followed
+static const int maxRedirects = 5;
+
+bool icyStreamTitle(const string& block, string& title)
+{
+    static const string tag("StreamTitle='");
+    string::size_type pos = block.find(tag);
+    if (pos == string::npos)
+        return false;
+    pos += tag.size();
+    // The title may contain quotes, look for the field separator
+    string::size_type end = block.find("';", pos);
+    if (end == string::npos) {
+        end = block.rfind('\'');
+        if (end == string::npos || end < pos)
+            return false;
+    }
+    title = block.substr(pos, end - pos);
+    return true;
+}
+
+// State for one reader thread. This is shared with the thread, which
+// is detached: stop() does not wait for it, as it may be stuck for a
+// while in a name lookup or connect, and it is called from the event
+// loop. An old reader just goes away on its own when it gets to
+// check its stop flag, and it does not touch anything else meanwhile.
+// Make an absolute URL from a redirect Location value
+static string resolveLocation(const string& hostport, const string& path,
+                              const string& loc)
+{
+    if (loc.find("://") != string::npos) {
+        return loc;
+    } else if (loc.find("//") == 0) {
+        return "http:" + loc;
+    } else if (loc.find("/") == 0) {
+        return "http://" + hostport + loc;
+    } else {
+        string dir = path.substr(0, path.find('?'));
+        dir = dir.substr(0, dir.rfind('/') + 1);
+        return "http://" + hostport + dir + loc;
+    }
+}
+
+class IcyReader {
+public:
+    IcyReader(function<void ()> w)
+        : wakeup(w), stopreq(false), fd(-1), changed(false) {
+    }
+    static void worker(shared_ptr<IcyReader> rdr, string url);
+    bool readStream(const string& url, string& location);
+    bool readn(NetconCli& con, char *buf, int cnt);
+    bool stopping() {
+        unique_lock<mutex> lock(mmutex);
+        return stopreq;
+    }
+    void stop() {
+        {
+            unique_lock<mutex> lock(mmutex);
+            stopreq = true;
+            // Wake up a blocked read
+            if (fd >= 0)
+                shutdown(fd, SHUT_RDWR);
+        }
+        cond.notify_all();
+    }
+
+    // Register the connection socket, so that stop() can interrupt a
+    // blocked read.
+    struct FdReg {
+        FdReg(IcyReader *m, int fd) : m(m) {
+            unique_lock<mutex> lock(m->mmutex);
+            m->fd = fd;
+        }
+        ~FdReg() {
+            unique_lock<mutex> lock(m->mmutex);
+            m->fd = -1;
+        }
+        IcyReader *m;
+    };
+
+    function<void ()> wakeup;
+    mutex mmutex;
+    condition_variable cond;
+    bool stopreq;
+    int fd;
+    string title;
+    bool changed;
+};
+
+class IcyMeta::Internal {
+public:
+    Internal(function<void ()> w)
+        : wakeup(w) {
+    }
+    function<void ()> wakeup;
+    // Current reader, if any
+    shared_ptr<IcyReader> reader;
+};
+
+bool IcyReader::readn(NetconCli& con, char *buf, int cnt)
+{
+    while (cnt > 0) {
+        int n = con.receive(buf, cnt, timeoSecs);
+        if (n <= 0)
+            return false;
+        buf += n;
+        cnt -= n;
+    }
+    return true;
+}
+
+// Connect and read the metadata until the connection is closed or we
+// are stopped. Returns true if we should try again later.
+bool IcyReader::readStream(const string& url, string& location)
+{
+    location.clear();
+    if (url.find("http://") != 0) {
+        LOGDEB("IcyMeta: not an http url: " << url << endl);
+        return false;
+    }
+    string::size_type slash = url.find('/', 7);
+    string hostport = url.substr(7, slash == string::npos ? string::npos :
+                                 slash - 7);
+    string path = slash == string::npos ? "/" : url.substr(slash);
+    string::size_type colon = hostport.find(':');
+    string host = hostport.substr(0, colon);
+    unsigned int port = colon == string::npos ? 80 :
+        atoi(hostport.c_str() + colon + 1);
+
+    NetconCli con;
+    if (con.openconn(host.c_str(), port, timeoSecs) < 0) {
+        LOGERR("IcyMeta: connection failed for " << url << endl);
+        return true;
+    }
+    FdReg reg(this, con.getfd());
+    if (stopping())
+        return false;
+
+    string req = "GET " + path + " HTTP/1.0\r\n" +
+        "Host: " + hostport + "\r\n" +
+        "User-Agent: " + userAgent + "\r\n" +
+        "Icy-MetaData: 1\r\n" +
+        "Connection: close\r\n\r\n";
+    if (con.send(req.c_str(), int(req.size())) != int(req.size())) {
+        LOGERR("IcyMeta: send failed for " << url << endl);
+        return true;
+    }
+
+    // Status line ("ICY 200 OK" or "HTTP/1.x 200 OK") and headers
+    char buf[4096];
+    int status = 0;
+    int metaint = 0;
+    for (int i = 0; ; i++) {
+        int n = con.getline(buf, sizeof(buf), timeoSecs);
+        if (n <= 0) {
+            LOGERR("IcyMeta: error reading headers for " << url << endl);
+            return true;
+        }
+        string line(buf, n);
+        trimstring(line, " \t\r\n");
+        if (i == 0) {
+            string::size_type sp = line.find(' ');
+            status = sp == string::npos ? 0 : atoi(line.c_str() + sp + 1);
+            continue;
+        }
+        if (line.empty())
+            break;
+        string::size_type colon = line.find(':');
+        if (colon == string::npos)
+            continue;
+        string name = line.substr(0, colon);
+        string value = line.substr(colon + 1);
+        trimstring(value, " \t");
+        if (!strcasecmp(name.c_str(), "icy-metaint")) {
+            metaint = atoi(value.c_str());
+        } else if (!strcasecmp(name.c_str(), "location")) {
+            location = value;
+        }
+    }
+    if (status >= 300 && status < 400 && !location.empty()) {
+        location = resolveLocation(hostport, path, location);
+        return false;
+    }
+    location.clear();
+    if (status != 200 || metaint <= 0) {
+        LOGINF("IcyMeta: no metadata from " << url << " (status " << status
+               << ")" << endl);
+        return false;
+    }
+    LOGDEB("IcyMeta: reading metadata from " << url << ", interval " <<
+           metaint << endl);
+
+    while (!stopping()) {
+        // Skip the audio data
+        int skip = metaint;
+        while (skip > 0) {
+            int n = con.receive(buf, min(skip, int(sizeof(buf))), timeoSecs);
+            if (n <= 0)
+                return !stopping();
+            skip -= n;
+        }
+        // Metadata block: length byte (16 bytes units), then data.
+        unsigned char c;
+        if (!readn(con, (char *)&c, 1))
+            return !stopping();
+        int len = c * 16;
+        if (len == 0)
+            continue;
+        if (!readn(con, buf, len))
+            return !stopping();
+        string ntitle;
+        if (!icyStreamTitle(string(buf, len), ntitle))
+            continue;
+        bool wake = false;
+        {
+            unique_lock<mutex> lock(mmutex);
+            if (!stopreq && ntitle != title) {
+                LOGDEB("IcyMeta: title: " << ntitle << endl);
+                title = ntitle;
+                changed = wake = true;
+            }
+        }
+        if (wake && wakeup)
+            wakeup();
+    }
+    return false;
+}
+
+void IcyReader::worker(shared_ptr<IcyReader> rdr, string url)
+{
+    int redirects = 0;
+    for (;;) {
+        string location;
+        bool retry = rdr->readStream(url, location);
+        if (!location.empty() && ++redirects <= maxRedirects &&
+            !rdr->stopping()) {
+            url = location;
+            continue;
+        }
+        if (!retry)
+            break;
+        unique_lock<mutex> lock(rdr->mmutex);
+        if (rdr->cond.wait_for(lock, chrono::seconds(retrySecs),
+                               [rdr] {return rdr->stopreq;}))
+            break;
+    }
+    LOGDEB1("IcyMeta::worker: exiting" << endl);
+}
+
+IcyMeta::IcyMeta(function<void ()> wakeup)
+{
+    m = new Internal(wakeup);
+}
+
+IcyMeta::~IcyMeta()
+{
+    stop();
+    delete m;
+}
+
+bool IcyMeta::start(const string& url)
+{
+    stop();
+    shared_ptr<IcyReader> rdr(new IcyReader(m->wakeup));
+    try {
+        thread(&IcyReader::worker, rdr, url).detach();
+    } catch (const std::exception& ex) {
+        LOGERR("IcyMeta::start: could not start thread: " << ex.what()
+               << endl);
+        return false;
+    }
+    m->reader = rdr;
+    return true;
+}
+
+void IcyMeta::stop()
+{
+    if (m->reader) {
+        m->reader->stop();
+        m->reader = shared_ptr<IcyReader>();
+    }
+}
+
+bool IcyMeta::collect(string& title)
+{
+    if (!m->reader)
+        return false;
+    unique_lock<mutex> lock(m->reader->mmutex);
+    if (!m->reader->changed)
+        return false;
+    m->reader->changed = false;
+    title = m->reader->title;
+    return true;
+}
+
+#else // ICYMETA_TEST ->
+
+// Test driver: run a local ICY stand-in server sending a redirect,
+// then a few title changes, and check that we see them, once each.
+
+#include <signal.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "icymeta.hxx"
+#include "netcon.h"
+
+using namespace std;
+
+static const int port = 8766;
+static const int metaint = 1000;
+static const char *titles[] = {"Artist - Song one", "It's a 'quoted' song",
+                               "Last song"};
+
+// ICY stand-in: audio data with a metadata block every metaint
+// bytes, the title changes every few blocks.
+static void server()
+{
+    NetconServLis lis;
+    if (lis.openservice(port) < 0) {
+        cerr << "openservice failed" << endl;
+        _exit(1);
+    }
+    // The first request gets a relative redirect
+    NetconServCon *con = lis.accept();
+    if (con == 0)
+        _exit(1);
+    char buf[1024];
+    while (con->getline(buf, sizeof(buf), 2) > 2)
+        ;
+    string redir = "HTTP/1.0 302 Found\r\nLocation: /real/stream\r\n\r\n";
+    con->send(redir.c_str(), redir.size());
+    delete con;
+
+    con = lis.accept();
+    if (con == 0)
+        _exit(1);
+    string path;
+    for (int i = 0; con->getline(buf, sizeof(buf), 2) > 2; i++) {
+        if (i == 0)
+            path = buf;
+    }
+    if (path.find("GET /real/stream ") != 0) {
+        cerr << "Redirect not followed: " << path << endl;
+        _exit(1);
+    }
+    string resp = "ICY 200 OK\r\nContent-Type: audio/mpeg\r\n"
+        "icy-metaint: 1000\r\n\r\n";
+    con->send(resp.c_str(), resp.size());
+    string audio(metaint, '\xff');
+    for (int i = 0; i < 30; i++) {
+        if (con->send(audio.c_str(), audio.size()) < 0)
+            break;
+        string meta = string("StreamTitle='") + titles[(i / 10) % 3] +
+            "';StreamUrl='';";
+        meta.append((16 - meta.size() % 16) % 16, '\0');
+        char len = char(meta.size() / 16);
+        con->send(&len, 1);
+        con->send(meta.c_str(), meta.size());
+        usleep(20000);
+    }
+    // Keep the connection open, so that we test stop()
+    sleep(20);
+    delete con;
+}
+
+int main(int argc, char **argv)
+{
+    signal(SIGPIPE, SIG_IGN);
+    pid_t pid = fork();
+    if (pid == 0) {
+        server();
+        _exit(0);
+    }
+    sleep(1);
+
+    atomic<int> wakeups(0);
+    IcyMeta icy([&wakeups] () {wakeups++;});
+    char url[100];
+    sprintf(url, "http://127.0.0.1:%d/stream", port);
+    icy.start(url);
+    sleep(2);
+
+    int errors = 0;
+    string title;
+    if (!icy.collect(title) || title != titles[2]) {
+        cerr << "Bad last title [" << title << "]" << endl;
+        errors++;
+    }
+    if (wakeups != 3) {
+        cerr << "Expected 3 title changes, got " << wakeups << endl;
+        errors++;
+    }
+    if (icy.collect(title)) {
+        cerr << "Title reported twice" << endl;
+        errors++;
+    }
+    auto t0 = chrono::steady_clock::now();
+    icy.stop();
+    int ms = chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now() - t0).count();
+    cout << "Title [" << title << "], " << wakeups << " changes, stop took "
+         << ms << " ms" << endl;
+    if (ms > 1000)
+        errors++;
+
+    // Stopping must not wait for a reader still trying to connect
+    // (non-routable address, if the network lets us try at all).
+    icy.start("http://10.255.255.1:8000/stream");
+    t0 = chrono::steady_clock::now();
+    icy.stop();
+    ms = chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now() - t0).count();
+    cout << "Stop while connecting took " << ms << " ms" << endl;
+    if (ms > 1000)
+        errors++;
+
+    kill(pid, SIGTERM);
+    waitpid(pid, 0, 0);
+    cout << (errors ? "FAILED" : "OK") << endl;
+    return errors ? 1 : 0;
+}
+
+#endif // ICYMETA_TEST
@@ -0,0 +1,62 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _ICYMETA_H_X_INCLUDED_
+#define _ICYMETA_H_X_INCLUDED_
+
+#include <functional>
+#include <string>
+
+/**
+ * Reader for the ICY (Shoutcast/Icecast) in-band stream metadata.
+ *
+ * A thread opens its own connection to the audio stream, asking for
+ * the metadata, skips the audio data, and extracts the StreamTitle
+ * value from the metadata blocks. When the title changes, the wakeup
+ * function is called, and the event loop gets the new value with
+ * collect() (same model as BgTask). This gets the title changes to
+ * the control points as soon as the server sends them, instead of
+ * waiting for the next mpd status poll showing a change.
+ *
+ * Only plain http streams are handled. Nothing happens for servers
+ * which send no metadata.
+ */
+class IcyMeta {
+public:
+    IcyMeta(std::function<void ()> wakeup);
+    ~IcyMeta();
+
+    /** Start reading the metadata for the stream at url. Stops the
+     * current reader if any. */
+    bool start(const std::string& url);
+
+    /** Stop reading. This does not wait for the reader thread, which
+     * exits by itself, but nothing more will be reported from it. */
+    void stop();
+
+    /** Get the current title, if it changed since the last call. */
+    bool collect(std::string& title);
+
+    class Internal;
+private:
+    Internal *m;
+};
+
+/** Extract the StreamTitle value from an ICY metadata block. Exposed
+ * for testing. */
+extern bool icyStreamTitle(const std::string& block, std::string& title);
+
+#endif /* _ICYMETA_H_X_INCLUDED_ */
@@ -149,6 +149,8 @@ static void setupsigs()
                 perror("Sigaction failed");
             }
         }
+    // We talk to helper processes through pipes, don't die if one exits
+    signal(SIGPIPE, SIG_IGN);
 }
 
 int main(int argc, char *argv[])
@@ -160,6 +162,8 @@ int main(int argc, char *argv[])
     // processes, and port for the auxiliary mpd.
     string senderpath;
     int sendermpdport = 6700;
+    // Start the sender and auxiliary mpd in advance
+    bool senderprestart = false;
 
     // Main MPD parameters
     string mpdhost("localhost");
@@ -174,6 +178,8 @@ int main(int argc, char *argv[])
     bool enableOH = true;
     bool ohmetapersist = true;
     bool externalvolumecontrol =false;
+    bool externalvolumehelper = false;
+    int externalvolumettl = 1;
     string upmpdcliuser("upmpdcli");
     string pidfilename("/var/run/upmpdcli.pid");
     string iconpath(DATADIR "/icon.png");
@@ -284,6 +290,12 @@ int main(int argc, char *argv[])
 	if (g_config->get("externalvolumecontrol", value)) {
             externalvolumecontrol = atoi(value.c_str()) != 0;
         }
+        if (g_config->get("externalvolumehelper", value)) {
+            externalvolumehelper = atoi(value.c_str()) != 0;
+        }
+        if (g_config->get("externalvolumettl", value)) {
+            externalvolumettl = atoi(value.c_str());
+        }
         g_config->get("iconpath", iconpath);
         g_config->get("presentationhtml", presentationhtml);
         g_config->get("cachedir", cachedir);
@@ -332,6 +344,8 @@ int main(int argc, char *argv[])
         g_config->get("scsenderpath", senderpath);
         if (g_config->get("scsendermpdport", value))
             sendermpdport = atoi(value.c_str());
+        if (g_config->get("scsenderprestart", value))
+            senderprestart = atoi(value.c_str()) != 0;
     }
     if (Logger::getTheLog(logfilename) == 0) {
         cerr << "Can't initialize log" << endl;
@@ -487,6 +501,8 @@ int main(int argc, char *argv[])
             sleep(mpdretrysecs);
             mpdretrysecs = MIN(2*mpdretrysecs, 120);
         } else {
+            mpdclip->setExternalVolumeOpts(externalvolumehelper,
+                                           externalvolumettl);
             break;
         }
     }
@@ -548,15 +564,21 @@ int main(int argc, char *argv[])
     if (!sc2mpdpath.empty()) {
         opts.sc2mpdpath = sc2mpdpath;
         opts.options |= UpMpd::upmpdOhReceiver;
+    } else if (!opts.scplaymethod.compare("internal")) {
+        // The internal Songcast receiver does not need sc2mpd
+        opts.options |= UpMpd::upmpdOhReceiver;
     }
     if (!senderpath.empty()) {
         opts.options |= UpMpd::upmpdOhSenderReceiver;
         opts.senderpath = senderpath;
         opts.sendermpdport = sendermpdport;
+        opts.senderprestart = senderprestart;
     }
 
     if (!enableAV)
         opts.options |= UpMpd::upmpdNoAV;
+    if ((op_flags & OPT_l))
+        opts.options |= UpMpd::upmpdCmdLineLogLevel;
     // Initialize the UPnP device object.
     UpMpd device(string("uuid:") + UUID, friendlyname, ohProductDesc,
                  files, mpdclip, opts);
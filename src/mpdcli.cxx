@@ -21,11 +21,18 @@
 #include <stddef.h>                     // for NULL
 #include <unistd.h>
 #include <iostream>                     // for endl, etc
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <string>
 #include <memory>
+#include <utility>
+#include <vector>
 #include "libupnpp/log.hxx"             // for LOGDEB, LOGERR, LOGINF
 
+#include "execmd.h"
+
 struct mpd_status;
 
 //bool volume_control_is_external = true;
@@ -35,6 +42,9 @@ using namespace UPnPP;
 
 #define M_CONN ((struct mpd_connection *)m_conn)
 
+// Wait before restarting a getexternalvolume helper which failed
+static const int extVolHelperRetrySecs = 30;
+
 MPDCli::MPDCli(const string& host, int port, const string& pass,
                const string& onstart, const string& onplay,
                const string& onstop, const string& onvolumechange,
@@ -43,9 +53,14 @@ MPDCli::MPDCli(const string& host, int port, const string& pass,
       m_host(host), m_port(port), m_password(pass), m_onstart(onstart),
       m_onplay(onplay), m_onstop(onstop), m_onvolumechange(onvolumechange),
       m_getexternalvolume(getexternalvolume), m_externalvolumecontrol(externalvolumecontrol),
+      m_extvolume(-1), m_extvoltime(0), m_extvolttl(1),
+      m_extvolusehelper(false), m_extvolhelperfail(0),
       m_lastinsertid(-1), m_lastinsertpos(-1), m_lastinsertqvers(-1)
 {
     regcomp(&m_tpuexpr, "^[[:alpha:]]+://.+", REG_EXTENDED|REG_NOSUB);
+    m_stat.externalvolumecontrol = m_externalvolumecontrol;
+    m_stat.onvolumechange = m_onvolumechange;
+    m_stat.getexternalvolume = m_getexternalvolume;
     if (!openconn()) {
         return;
     }
@@ -53,18 +68,51 @@ MPDCli::MPDCli(const string& host, int port, const string& pass,
 
     m_ok = true;
     m_ok = updStatus();
-    m_stat.externalvolumecontrol = m_externalvolumecontrol;
-    m_stat.onvolumechange = m_onvolumechange;
-    m_stat.getexternalvolume = m_getexternalvolume;
 }
 
 MPDCli::~MPDCli()
 {
+    if (m_extvolhelper)
+        m_extvolhelper->zapChild();
     if (m_conn) 
         mpd_connection_free(M_CONN);
     regfree(&m_tpuexpr);
 }
 
+void MPDCli::setExternalVolumeOpts(bool usehelper, int ttlsecs)
+{
+    m_extvolusehelper = usehelper;
+    m_extvolttl = ttlsecs >= 0 ? ttlsecs : 0;
+    m_extvoltime = 0;
+    m_extvolhelperfail = 0;
+    if (!m_extvolusehelper && m_extvolhelper) {
+        m_extvolhelper->zapChild();
+        m_extvolhelper = shared_ptr<ExecCmd>();
+    }
+}
+
+void MPDCli::setHooks(const string& onstart, const string& onplay,
+                      const string& onstop, const string& onvolumechange,
+                      const string& getexternalvolume)
+{
+    m_onstart = onstart;
+    m_onplay = onplay;
+    m_onstop = onstop;
+    m_onvolumechange = onvolumechange;
+    m_stat.onvolumechange = m_onvolumechange;
+    if (getexternalvolume != m_getexternalvolume) {
+        // The helper runs the old command
+        if (m_extvolhelper) {
+            m_extvolhelper->zapChild();
+            m_extvolhelper = shared_ptr<ExecCmd>();
+        }
+        m_extvoltime = 0;
+        m_extvolhelperfail = 0;
+    }
+    m_getexternalvolume = getexternalvolume;
+    m_stat.getexternalvolume = m_getexternalvolume;
+}
+
 bool MPDCli::looksLikeTransportURI(const string& path)
 {
     return (regexec(&m_tpuexpr, path.c_str(), 0, 0, 0) == 0);
@@ -121,7 +169,9 @@ bool MPDCli::showError(const string& who)
     return false;
 }
 
+// The deferred tag commands are sent before anything else.
 #define RETRY_CMD(CMD) {                                \
+    flushTags();                                        \
     for (int i = 0; i < 2; i++) {                       \
         if ((CMD))                                      \
             break;                                      \
@@ -131,6 +181,7 @@ bool MPDCli::showError(const string& who)
     }
 
 #define RETRY_CMD_WITH_SLEEP(CMD) {                     \
+    flushTags();                                        \
     for (int i = 0; i < 2; i++) {                       \
         if ((CMD))                                      \
             break;                                      \
@@ -147,6 +198,7 @@ bool MPDCli::updStatus()
         return false;
     }
 
+    flushTags();
     mpd_status *mpds = 0;
     mpds = mpd_run_status(M_CONN);
     if (mpds == 0) {
@@ -160,19 +212,8 @@ bool MPDCli::updStatus()
     }
 
     if (m_stat.externalvolumecontrol) {
-	//LOGDEB("MPDCli::fetching volume: " << m_getexternalvolume << endl);
-	std::shared_ptr<FILE> pipe(popen(m_stat.getexternalvolume.c_str(), "r"), pclose);
-    	if (!pipe) return "ERROR";
-    	char buffer[128];
-    	std::string result = "";
-    	while (!feof(pipe.get())) {
-        	if (fgets(buffer, 128, pipe.get()) != NULL)
-            	result += buffer;
-    	}
-	//LOGDEB("MPDCli::volume retrieved: " << result << endl);
-	m_stat.volume = atoi(result.c_str());
-    }
-    else {
+        m_stat.volume = getExternalVolume();
+    } else {
 	m_stat.volume = mpd_status_get_volume(mpds);
     }
     if (m_stat.volume >= 0) {
@@ -251,6 +292,98 @@ bool MPDCli::updStatus()
     return true;
 }
 
+// Run the getexternalvolume command through popen(). This is the
+// original method, used when the helper is not configured.
+bool MPDCli::extVolPopen(string& result)
+{
+    std::shared_ptr<FILE> pipe(popen(m_stat.getexternalvolume.c_str(), "r"),
+                               pclose);
+    if (!pipe) {
+        LOGERR("MPDCli::extVolPopen: popen failed for " <<
+               m_stat.getexternalvolume << endl);
+        return false;
+    }
+    char buffer[128];
+    while (!feof(pipe.get())) {
+        if (fgets(buffer, 128, pipe.get()) != NULL)
+            result += buffer;
+    }
+    return true;
+}
+
+// Query the persistent helper, (re)starting it if needed. Any
+// failure gets rid of the process, and it will only be restarted
+// after extVolHelperRetrySecs: we're called with the device locked,
+// and a broken helper must not hold it at every status update.
+bool MPDCli::extVolHelperQuery(string& result)
+{
+    int status;
+    if (m_extvolhelper && m_extvolhelper->maybereap(&status)) {
+        LOGERR("MPDCli::extVolHelperQuery: helper exited with status " <<
+               status << endl);
+        m_extvolhelper = shared_ptr<ExecCmd>();
+        m_extvolhelperfail = time(0);
+    }
+    if (!m_extvolhelper) {
+        if (m_extvolhelperfail != 0 &&
+            time(0) - m_extvolhelperfail < extVolHelperRetrySecs) {
+            return false;
+        }
+        m_extvolhelper = shared_ptr<ExecCmd>(new ExecCmd());
+        vector<string> args;
+        args.push_back("-c");
+        args.push_back(m_stat.getexternalvolume);
+        if (m_extvolhelper->startExec("/bin/sh", args, true, true) < 0) {
+            LOGERR("MPDCli::extVolHelperQuery: could not start " <<
+                   m_stat.getexternalvolume << endl);
+            m_extvolhelper = shared_ptr<ExecCmd>();
+            m_extvolhelperfail = time(0);
+            return false;
+        }
+    }
+    if (m_extvolhelper->send("volume\n") < 0 ||
+        m_extvolhelper->getline(result, 2) <= 0) {
+        LOGERR("MPDCli::extVolHelperQuery: no answer from helper" << endl);
+        m_extvolhelper->zapChild();
+        m_extvolhelper = shared_ptr<ExecCmd>();
+        m_extvolhelperfail = time(0);
+        return false;
+    }
+    return true;
+}
+
+// Return the external volume, from the cache if it is recent enough.
+int MPDCli::getExternalVolume()
+{
+    time_t now = time(0);
+    if (m_extvoltime != 0 && now - m_extvoltime < m_extvolttl) {
+        return m_extvolume;
+    }
+
+    // The helper command speaks the helper protocol, so it can't
+    // be run through popen() if the helper fails.
+    string result;
+    bool ok = m_extvolusehelper ? extVolHelperQuery(result) :
+        extVolPopen(result);
+    // Don't retry before the TTL, whatever happened. On failure,
+    // keep the previous value.
+    m_extvoltime = now;
+    if (!ok)
+        return m_extvolume;
+    const char *cp = result.c_str();
+    char *endp;
+    long vol = strtol(cp, &endp, 10);
+    if (endp == cp || endp[strspn(endp, " \t\r\n")] != 0 ||
+        vol < 0 || vol > 100) {
+        LOGERR("MPDCli::getExternalVolume: no valid value from " <<
+               m_stat.getexternalvolume << ": [" << result << "]" << endl);
+        return m_extvolume;
+    }
+    //LOGDEB("MPDCli::volume retrieved: " << result << endl);
+    m_extvolume = int(vol);
+    return m_extvolume;
+}
+
 bool MPDCli::checkForCommand(const string& cmdname)
 {
     LOGDEB1("MPDCli::checkForCommand: " << cmdname << endl);
@@ -300,34 +433,98 @@ bool MPDCli::restoreState(const MpdState& st)
 {
     LOGDEB("MPDCli::restoreState: seekms " << st.status.songelapsedms << endl);
     clearQueue();
-    for (unsigned int i = 0; i < st.queue.size(); i++) {
-        if (insert(st.queue[i].uri, i, st.queue[i]) < 0) {
-            LOGERR("MPDCli::restoreState: insert failed\n");
-            return false;
-        }
+    if (!appendSongs(st.queue)) {
+        LOGERR("MPDCli::restoreState: appendSongs failed\n");
+        return false;
     }
-    repeat(st.status.rept);
-    random(st.status.random);
-    single(st.status.single);
-    consume(st.status.consume);
-    m_cachedvolume = st.status.volume;
+    return restoreStatus(st.status);
+}
+
+bool MPDCli::restoreStatus(const MpdStatus& status)
+{
+    repeat(status.rept);
+    random(status.random);
+    single(status.single);
+    consume(status.consume);
+    m_cachedvolume = status.volume;
     //set parameters for external volume control
-    m_stat.externalvolumecontrol = st.status.externalvolumecontrol;
-    m_stat.onvolumechange = st.status.onvolumechange;
-    m_stat.getexternalvolume = st.status.getexternalvolume;
+    m_stat.externalvolumecontrol = status.externalvolumecontrol;
+    m_stat.onvolumechange = status.onvolumechange;
+    m_stat.getexternalvolume = status.getexternalvolume;
     //no need to set volume if it is controlled external
-    if (!(m_stat.externalvolumecontrol)) mpd_run_set_volume(M_CONN, st.status.volume);
+    if (!(m_stat.externalvolumecontrol)) mpd_run_set_volume(M_CONN, status.volume);
     // If songelapsedms is set, we have to start playing to restore it
-    if (st.status.songelapsedms > 0 ||
-        st.status.state == MpdStatus::MPDS_PLAY) {
-        play(st.status.songpos);
-  	if (!(m_stat.externalvolumecontrol)) mpd_run_set_volume(M_CONN, st.status.volume);
-        if (st.status.songelapsedms > 0)
-            seek(st.status.songelapsedms/1000);
+    if (status.songelapsedms > 0 ||
+        status.state == MpdStatus::MPDS_PLAY) {
+        play(status.songpos);
+  	if (!(m_stat.externalvolumecontrol)) mpd_run_set_volume(M_CONN, status.volume);
+        if (status.songelapsedms > 0)
+            seek(status.songelapsedms/1000);
     }
     return true;
 }
 
+// Delete stored playlist. Not finding it is not an error
+bool MPDCli::rmStoredPlaylist(const string& name)
+{
+    if (!ok())
+        return false;
+    if (!mpd_run_rm(M_CONN, name.c_str())) {
+        if (mpd_connection_get_error(M_CONN) == MPD_ERROR_SERVER &&
+            mpd_connection_get_server_error(M_CONN) == MPD_SERVER_ERROR_NO_EXIST) {
+            mpd_connection_clear_error(M_CONN);
+            return true;
+        }
+        showError("MPDCli::rmStoredPlaylist");
+        mpd_connection_clear_error(M_CONN);
+        return false;
+    }
+    return true;
+}
+
+bool MPDCli::parkState(const string& name, MpdState& st)
+{
+    LOGDEB("MPDCli::parkState: " << name << endl);
+    if (!updStatus()) {
+        LOGERR("MPDCli::parkState: can't retrieve current status\n");
+        return false;
+    }
+    st.status = m_stat;
+    st.queue.clear();
+    // A stale copy may exist if we were interrupted while parked.
+    if (!rmStoredPlaylist(name))
+        return false;
+    if (!mpd_run_save(M_CONN, name.c_str())) {
+        showError("MPDCli::parkState");
+        mpd_connection_clear_error(M_CONN);
+        return false;
+    }
+    return true;
+}
+
+bool MPDCli::unparkState(const string& name, const MpdState& st)
+{
+    LOGDEB("MPDCli::unparkState: " << name << endl);
+    if (!ok())
+        return false;
+    clearQueue();
+    if (!mpd_run_load(M_CONN, name.c_str())) {
+        showError("MPDCli::unparkState");
+        bool gone = mpd_connection_get_error(M_CONN) == MPD_ERROR_SERVER &&
+            mpd_connection_get_server_error(M_CONN) ==
+            MPD_SERVER_ERROR_NO_EXIST;
+        mpd_connection_clear_error(M_CONN);
+        if (!gone)
+            return false;
+        // Someone deleted it, nothing we can do about the queue.
+        LOGERR("MPDCli::unparkState: stored playlist " << name <<
+               " was lost\n");
+    } else {
+        rmStoredPlaylist(name);
+    }
+    return restoreStatus(st.status);
+}
+
 
 bool MPDCli::statSong(UpSong& upsong, int pos, bool isid)
 {
@@ -474,6 +671,11 @@ bool MPDCli::setVolume(int volume, bool isMute)
     }
     m_stat.volume = volume;
     m_cachedvolume = volume;
+    if (m_stat.externalvolumecontrol) {
+        // We know the value, no need to ask for it before the ttl expires
+        m_extvolume = volume;
+        m_extvoltime = time(0);
+    }
     return true;
 }
 
@@ -600,86 +802,294 @@ bool MPDCli::single(bool on)
     return true;
 }
 
-bool MPDCli::send_tag(const char *cid, int tag, const string& data)
-{
-    if (!mpd_send_command(M_CONN, "addtagid", cid, 
-                          mpd_tag_name(mpd_tag_type(tag)),
-                          data.c_str(), NULL)) {
-        LOGERR("MPDCli::send_tag: mpd_send_command failed" << endl);
-        return false;
-    }
+static const string upmpdcli_comment("client=upmpdcli;");
+static const int tagtypes[] = {MPD_TAG_ARTIST, MPD_TAG_ALBUM, MPD_TAG_TITLE,
+                               MPD_TAG_TRACK, MPD_TAG_COMMENT};
+static const unsigned int ntagtypes = sizeof(tagtypes) / sizeof(int);
 
-    if (!mpd_response_finish(M_CONN)) {
-        LOGERR("MPDCli::send_tag: mpd_response_finish failed\n");
-        showError("MPDCli::send_tag");
-        return false;
+// Send the addtagid commands for a song, inside a command list. MPD
+// only lets us set tags on remote songs, the caller checks this.
+bool MPDCli::sendTagCommands(int id, const UpSong& meta)
+{
+    char cid[30];
+    sprintf(cid, "%d", id);
+    const string *values[] = {&meta.artist, &meta.album, &meta.title,
+                              &meta.tracknum, &upmpdcli_comment};
+    for (unsigned int j = 0; j < ntagtypes; j++) {
+        if (!mpd_send_command(M_CONN, "addtagid", cid, 
+                              mpd_tag_name(mpd_tag_type(tagtypes[j])),
+                              values[j]->c_str(), NULL)) {
+            return false;
+        }
     }
     return true;
 }
 
-static const string upmpdcli_comment("client=upmpdcli;");
-
-bool MPDCli::send_tag_data(int id, const UpSong& meta)
+// Send the deferred tags for the last inserted song, in one command
+// list. The list begins and ends with a status command, so that we
+// can check that the queue did not change since the insert, and
+// keep the insertAfterId() shortcut valid (m_lastinsertqvers is
+// reset otherwise).
+bool MPDCli::flushTags()
 {
-    LOGDEB1("MPDCli::send_tag_data" << endl);
-    if (!m_have_addtagid)
+    if (m_pendingtags.empty() || !ok())
+        return true;
+    vector<pair<int, UpSong> > pending;
+    pending.swap(m_pendingtags);
+    int qvers = m_lastinsertqvers;
+    m_lastinsertqvers = -1;
+
+    bool sent = mpd_command_list_begin(M_CONN, true) &&
+        mpd_send_status(M_CONN);
+    for (auto it = pending.begin(); sent && it != pending.end(); it++) {
+        sent = sendTagCommands(it->first, it->second);
+    }
+    sent = sent && mpd_send_status(M_CONN) && mpd_command_list_end(M_CONN);
+    if (!sent) {
+        showError("MPDCli::flushTags");
         return false;
+    }
 
-    char cid[30];
-    sprintf(cid, "%d", id);
-
-    if (!send_tag(cid, MPD_TAG_ARTIST, meta.artist))
-        return false;
-    if (!send_tag(cid, MPD_TAG_ALBUM, meta.album))
-        return false;
-    if (!send_tag(cid, MPD_TAG_TITLE, meta.title))
-        return false;
-    if (!send_tag(cid, MPD_TAG_TRACK, meta.tracknum))
-        return false;
-    if (!send_tag(cid, MPD_TAG_COMMENT, upmpdcli_comment))
+    mpd_status *st = mpd_recv_status(M_CONN);
+    bool unchanged = st != 0 && int(mpd_status_get_queue_version(st)) == qvers;
+    if (st)
+        mpd_status_free(st);
+    bool good = st != 0 && mpd_response_next(M_CONN);
+    for (unsigned int i = 0; good && i < pending.size() * ntagtypes; i++) {
+        good = mpd_response_next(M_CONN);
+    }
+    st = good ? mpd_recv_status(M_CONN) : 0;
+    if (st) {
+        if (unchanged)
+            m_lastinsertqvers = mpd_status_get_queue_version(st);
+        mpd_status_free(st);
+    }
+    if (!mpd_response_finish(M_CONN) || st == 0) {
+        // e.g. the song was deleted in the meantime
+        LOGERR("MPDCli::flushTags: failed" << endl);
+        showError("MPDCli::flushTags");
+        mpd_connection_clear_error(M_CONN);
         return false;
+    }
     return true;
 }
 
+// Insert a song, and return its id. We don't wait for the tags to be
+// set: they are queued, and sent (in one command list) before the
+// next command, which saves several round trips when a control point
+// inserts songs one by one. The queue version for the
+// insertAfterId() shortcut is retrieved in the same command list as
+// the add.
 int MPDCli::insert(const string& uri, int pos, const UpSong& meta)
 {
     LOGDEB("MPDCli::insert at :" << pos << " uri " << uri << endl);
     if (!ok())
         return -1;
-
-    RETRY_CMD((m_lastinsertid = 
-               mpd_run_add_id_to(M_CONN, uri.c_str(), (unsigned)pos)) != -1);
+    flushTags();
+
+    int qvers = -1;
+    for (int i = 0; i < 2; i++) {
+        m_lastinsertid = -1;
+        if (mpd_command_list_begin(M_CONN, true) &&
+            mpd_send_add_id_to(M_CONN, uri.c_str(), (unsigned)pos) &&
+            mpd_send_status(M_CONN) && mpd_command_list_end(M_CONN)) {
+            int id = mpd_recv_song_id(M_CONN);
+            if (id >= 0 && mpd_response_next(M_CONN)) {
+                mpd_status *st = mpd_recv_status(M_CONN);
+                if (st) {
+                    qvers = mpd_status_get_queue_version(st);
+                    mpd_status_free(st);
+                }
+            }
+            if (mpd_response_finish(M_CONN) && id >= 0) {
+                m_lastinsertid = id;
+                break;
+            }
+        }
+        if (i == 1 || !showError("MPDCli::insert"))
+            return -1;
+    }
     
-    if (m_have_addtagid)
-        send_tag_data(m_lastinsertid, meta);
+    if (m_have_addtagid && uri.find("://") != string::npos)
+        m_pendingtags.push_back(pair<int, UpSong>(m_lastinsertid, meta));
 
     m_lastinsertpos = pos;
-    updStatus();
-    m_lastinsertqvers = m_stat.qvers;
+    m_lastinsertqvers = qvers;
     return m_lastinsertid;
 }
 
+// Number of commands we send in one command list
+static const unsigned int appendBatchSize = 256;
+
+bool MPDCli::appendSongs(const vector<UpSong>& songs)
+{
+    return insertSongs(songs, -1, 0);
+}
+
+bool MPDCli::insertSongs(const vector<UpSong>& songs, int pos,
+                         vector<int> *ids)
+{
+    LOGDEB("MPDCli::insertSongs: " << songs.size() << " songs at " << pos <<
+           endl);
+    if (ids)
+        ids->assign(songs.size(), -1);
+    if (!ok())
+        return false;
+    flushTags();
+
+    // Add the songs, retrieving the ids, which we need for setting the
+    // tags. If an add fails (e.g. the file is gone), MPD skips the
+    // rest of the list: we go on after the bad entry.
+    // (id, index in songs) pairs
+    vector<pair<int, unsigned int> > added;
+    // Insert position for the next song
+    unsigned int inspos = pos < 0 ? 0 : pos;
+    unsigned int next = 0;
+    while (next < songs.size()) {
+        unsigned int end = min(next + appendBatchSize,
+                               (unsigned int)songs.size());
+        if (!mpd_command_list_begin(M_CONN, true)) {
+            showError("MPDCli::insertSongs");
+            return false;
+        }
+        for (unsigned int i = next; i < end; i++) {
+            bool sent = pos < 0 ?
+                mpd_send_add_id(M_CONN, songs[i].uri.c_str()) :
+                mpd_send_add_id_to(M_CONN, songs[i].uri.c_str(),
+                                   inspos + i - next);
+            if (!sent) {
+                showError("MPDCli::insertSongs");
+                return false;
+            }
+        }
+        if (!mpd_command_list_end(M_CONN)) {
+            showError("MPDCli::insertSongs");
+            return false;
+        }
+        unsigned int i = next;
+        for (; i < end; i++) {
+            int id = mpd_recv_song_id(M_CONN);
+            if (id < 0)
+                break;
+            added.push_back(pair<int, unsigned int>(id, i));
+            if (ids)
+                (*ids)[i] = id;
+            if (!mpd_response_next(M_CONN))
+                break;
+        }
+        if (i == end && mpd_response_finish(M_CONN)) {
+            inspos += end - next;
+            next = end;
+            continue;
+        }
+        if (mpd_connection_get_error(M_CONN) != MPD_ERROR_SERVER) {
+            showError("MPDCli::insertSongs");
+            return false;
+        }
+        LOGERR("MPDCli::insertSongs: add failed for " << songs[i].uri <<
+               " : " << mpd_connection_get_error_message(M_CONN) << endl);
+        mpd_connection_clear_error(M_CONN);
+        inspos += i - next;
+        next = i + 1;
+    }
+
+    // Set the tags for the remote songs (MPD does not let us modify
+    // the others). No need for an answer for each, errors only
+    // cause the rest of the batch to be skipped.
+    if (m_have_addtagid) {
+        unsigned int cnt = 0;
+        for (auto it = added.begin(); it != added.end(); it++) {
+            const UpSong& meta = songs[it->second];
+            if (meta.uri.find("://") == string::npos)
+                continue;
+            if (cnt == 0 && !mpd_command_list_begin(M_CONN, false)) {
+                showError("MPDCli::insertSongs");
+                return false;
+            }
+            if (!sendTagCommands(it->first, meta)) {
+                showError("MPDCli::insertSongs");
+                return false;
+            }
+            if (++cnt * ntagtypes >= appendBatchSize) {
+                cnt = 0;
+                if (!mpd_command_list_end(M_CONN) ||
+                    !mpd_response_finish(M_CONN)) {
+                    showError("MPDCli::insertSongs: addtagid");
+                    mpd_connection_clear_error(M_CONN);
+                }
+            }
+        }
+        if (cnt != 0) {
+            if (!mpd_command_list_end(M_CONN) ||
+                !mpd_response_finish(M_CONN)) {
+                showError("MPDCli::insertSongs: addtagid");
+                mpd_connection_clear_error(M_CONN);
+            }
+        }
+    }
+
+    updStatus();
+    // Let a following insertAfterId() for the last song skip the
+    // position lookup.
+    if (!added.empty()) {
+        m_lastinsertid = added.back().first;
+        m_lastinsertpos = pos < 0 ? m_stat.qlen - 1 : int(inspos) - 1;
+        m_lastinsertqvers = m_stat.qvers;
+    }
+    return true;
+}
+
 int MPDCli::insertAfterId(const string& uri, int id, const UpSong& meta)
 {
     LOGDEB("MPDCli::insertAfterId: id " << id << " uri " << uri << endl);
     if (!ok())
         return -1;
+    int pos = insertPosAfterId(id);
+    if (pos < 0)
+        return -1;
+    return insert(uri, pos, meta);
+}
 
-    // id == 0 means insert at start
+bool MPDCli::insertSongsAfterId(const vector<UpSong>& songs, int id,
+                                vector<int> *ids)
+{
+    LOGDEB("MPDCli::insertSongsAfterId: id " << id << " " << songs.size() <<
+           " songs" << endl);
+    if (ids)
+        ids->assign(songs.size(), -1);
+    if (!ok())
+        return false;
+    int pos = insertPosAfterId(id);
+    if (pos < 0)
+        return false;
+    return insertSongs(songs, pos, ids);
+}
+
+// Compute the queue position for inserting after song id (0: at
+// start). An unknown id means the end of the queue.
+int MPDCli::insertPosAfterId(int id)
+{
     if (id == 0) {
-        return insert(uri, 0, meta);
+        return 0;
+    }
+    bool unchanged;
+    if (!m_pendingtags.empty()) {
+        // Sending the tags checks the queue version
+        flushTags();
+        unchanged = m_lastinsertqvers != -1;
+    } else {
+        updStatus();
+        unchanged = m_lastinsertqvers == m_stat.qvers;
     }
-    updStatus();
 
     int newpos = 0;
-    if (m_lastinsertid == id && m_lastinsertpos >= 0 &&
-        m_lastinsertqvers == m_stat.qvers) {
+    if (m_lastinsertid == id && m_lastinsertpos >= 0 && unchanged) {
         newpos = m_lastinsertpos + 1;
     } else {
         // Translate input id to insert position
         vector<mpd_song*> songs;
         if (!getQueueSongs(songs)) {
-            return false;
+            return -1;
         }
         for (unsigned int pos = 0; pos < songs.size(); pos++) {
             unsigned int qid = mpd_song_get_id(songs[pos]);
@@ -690,7 +1100,7 @@ int MPDCli::insertAfterId(const string& uri, int id, const UpSong& meta)
         }
         freeSongs(songs);
     }
-    return insert(uri, newpos, meta);
+    return newpos;
 }
 
 bool MPDCli::clearQueue()
@@ -727,12 +1137,58 @@ bool MPDCli::deletePosRange(unsigned int start, unsigned int end)
     return true;
 }
 
+bool MPDCli::deleteIds(const vector<int>& ids)
+{
+    LOGDEB("MPDCli::deleteIds: " << ids.size() << " ids" << endl);
+    if (!ok())
+        return false;
+    if (ids.empty())
+        return true;
+    flushTags();
+    bool sent = mpd_command_list_begin(M_CONN, false);
+    for (auto it = ids.begin(); sent && it != ids.end(); it++) {
+        sent = mpd_send_delete_id(M_CONN, (unsigned)*it);
+    }
+    if (sent && mpd_command_list_end(M_CONN) && mpd_response_finish(M_CONN))
+        return true;
+    // A bad id stops the list. Do the rest one by one.
+    showError("MPDCli::deleteIds");
+    mpd_connection_clear_error(M_CONN);
+    bool good = true;
+    for (auto it = ids.begin(); it != ids.end(); it++) {
+        if (statId(*it))
+            good = deleteId(*it) && good;
+    }
+    return good;
+}
+
+bool MPDCli::deletePosRanges(const vector<pair<unsigned int,
+                             unsigned int> >& ranges)
+{
+    LOGDEB("MPDCli::deletePosRanges: " << ranges.size() << " ranges" << endl);
+    if (!ok())
+        return false;
+    if (ranges.empty())
+        return true;
+    flushTags();
+    bool sent = mpd_command_list_begin(M_CONN, false);
+    for (auto it = ranges.begin(); sent && it != ranges.end(); it++) {
+        sent = mpd_send_delete_range(M_CONN, it->first, it->second);
+    }
+    if (sent && mpd_command_list_end(M_CONN) && mpd_response_finish(M_CONN))
+        return true;
+    showError("MPDCli::deletePosRanges");
+    mpd_connection_clear_error(M_CONN);
+    return false;
+}
+
 
 bool MPDCli::statId(int id)
 {
     LOGDEB("MPDCli::statId " << id << endl);
     if (!ok())
         return -1;
+    flushTags();
 
     mpd_song *song = mpd_run_get_queue_song_id(M_CONN, (unsigned)id);
     if (song) {
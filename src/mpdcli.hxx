@@ -19,11 +19,14 @@
 
 #include <regex.h>                      // for regex_t
 #include <string>                       // for string
+#include <utility>                      // for pair
 #include <cstdio>
 #include <vector>                       // for vector
 #include <memory>
+#include <time.h>
 
 struct mpd_song;
+class ExecCmd;
 
 class UpSong {
 public:
@@ -55,7 +58,8 @@ public:
 
 class MpdStatus {
 public:
-    MpdStatus() : trackcounter(0), detailscounter(0) {}
+    MpdStatus() : trackcounter(0), detailscounter(0),
+                  externalvolumecontrol(false) {}
 
     enum State {MPDS_UNK, MPDS_STOP, MPDS_PLAY, MPDS_PAUSE};
 
@@ -106,6 +110,16 @@ public:
 	   bool externalvolumecontrol = false);
     ~MPDCli();
     bool ok() {return m_ok && m_conn;}
+    // Set the external volume fetching parameters. If usehelper is
+    // set, the getexternalvolume command is started once and kept
+    // running: we write a "volume" line to its input for each query,
+    // and it answers with a line holding the current value. The
+    // value is cached for ttlsecs (0: query on every status update).
+    void setExternalVolumeOpts(bool usehelper, int ttlsecs);
+    // Change the hook commands, after a configuration change.
+    void setHooks(const std::string& onstart, const std::string& onplay,
+                  const std::string& onstop, const std::string& onvolumechange,
+                  const std::string& getexternalvolume);
     bool setVolume(int ivol, bool isMute = false);
     int  getVolume();
     bool togglePause();
@@ -122,11 +136,29 @@ public:
     bool seek(int seconds);
     bool clearQueue();
     int insert(const std::string& uri, int pos, const UpSong& meta);
+    // Append songs at the end of the queue. This uses command lists
+    // and is much faster than calling insert() for each song.
+    bool appendSongs(const std::vector<UpSong>& songs);
+    // Insert songs at pos (append if pos < 0), with the same command
+    // lists. If ids is set, it gets the new id for each song, or -1
+    // if the add failed (e.g. bad uri). Such failures don't make the
+    // call fail.
+    bool insertSongs(const std::vector<UpSong>& songs, int pos,
+                     std::vector<int> *ids = 0);
     // Insert after given id. Returns new id or -1
     int insertAfterId(const std::string& uri, int id, const UpSong& meta);
+    // Same for a list of songs, see insertSongs()
+    bool insertSongsAfterId(const std::vector<UpSong>& songs, int id,
+                            std::vector<int> *ids = 0);
     bool deleteId(int id);
     // start included, end excluded
     bool deletePosRange(unsigned int start, unsigned int end);
+    // Delete songs with one command list
+    bool deleteIds(const std::vector<int>& ids);
+    // Same for position ranges [first, second[. They are deleted in
+    // order, so they should be sorted from the end of the queue.
+    bool deletePosRanges(const std::vector<std::pair<unsigned int,
+                         unsigned int> >& ranges);
     bool statId(int id);
     int curpos();
     bool getQueueData(std::vector<UpSong>& vdata);
@@ -143,6 +175,17 @@ public:
     // save (sometimes useful if mpd was stopped)
     bool saveState(MpdState& st, int seekms);
     bool restoreState(const MpdState& st);
+
+    // Same as saveState/restoreState, but the queue is kept in an MPD
+    // stored playlist instead of being read and re-inserted. This
+    // takes a constant number of commands whatever the queue
+    // size. The stored playlist is deleted when the state is
+    // restored. parkState() fails if MPD has no playlist directory:
+    // use saveState() then. If unparkState() fails, the stored
+    // playlist is kept and the call can be retried. A missing stored
+    // playlist is not retryable, only the status is restored then.
+    bool parkState(const std::string& name, MpdState& st);
+    bool unparkState(const std::string& name, const MpdState& st);
     
 private:
     void *m_conn;
@@ -162,6 +205,14 @@ private:
     std::string m_onvolumechange;
     std::string m_getexternalvolume;
     bool m_externalvolumecontrol;
+    // External volume cache and persistent helper process
+    int m_extvolume;
+    time_t m_extvoltime;
+    int m_extvolttl;
+    bool m_extvolusehelper;
+    std::shared_ptr<ExecCmd> m_extvolhelper;
+    // Last time the helper failed, for backing off restarts
+    time_t m_extvolhelperfail;
     regex_t m_tpuexpr;
     // addtagid command only exists for mpd 0.19 and later.
     bool m_have_addtagid; 
@@ -173,16 +224,24 @@ private:
     int m_lastinsertid;
     int m_lastinsertpos;
     int m_lastinsertqvers;
+    // Tags for the last inserted song, not sent yet (see insert())
+    std::vector<std::pair<int, UpSong> > m_pendingtags;
 
     bool openconn();
     bool updStatus();
+    int getExternalVolume();
+    bool extVolHelperQuery(std::string& result);
+    bool extVolPopen(std::string& result);
     bool getQueueSongs(std::vector<mpd_song*>& songs);
     void freeSongs(std::vector<mpd_song*>& songs);
     bool showError(const std::string& who);
+    bool restoreStatus(const MpdStatus& status);
+    bool rmStoredPlaylist(const std::string& name);
     bool looksLikeTransportURI(const std::string& path);
     bool checkForCommand(const std::string& cmdname);
-    bool send_tag(const char *cid, int tag, const std::string& data);
-    bool send_tag_data(int id, const UpSong& meta);
+    int insertPosAfterId(int id);
+    bool sendTagCommands(int id, const UpSong& meta);
+    bool flushTags();
 };
 
 
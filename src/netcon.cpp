@@ -30,7 +30,9 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h>
@@ -39,7 +41,12 @@
 #include <netdb.h>
 
 #include <map>
+#include <vector>
 
+#if defined(__linux__) && !defined(NETCON_NO_EPOLL)
+#define NETCON_EPOLL
+#include <sys/epoll.h>
+#endif
 
 #ifdef HAVE_DEBUGLOG
 #include "debuglog.h"
@@ -94,29 +101,62 @@ static const int zero = 0;
                   ((NEW).tv_usec - (OLD).tv_usec) / 1000))
 
 // Static method
-// Simplified interface to 'select()'. Only use one fd, for either
+// Simplified interface to 'select()', implemented with poll(), which
+// has no limit on the fd value. Only use one fd, for either
 // reading or writing. This is only used when not using the
 // selectloop() style of network i/o.
 // Note that timeo == 0 does NOT mean wait forever but no wait at all.
+// Returns 1 if the fd is ready, 0 for a timeout, -1 for an error.
 int Netcon::select1(int fd, int timeo, int write)
 {
-    int ret;
-    struct timeval tv;
-    fd_set rd;
-    tv.tv_sec = timeo;
-    tv.tv_usec =  0;
-    FD_ZERO(&rd);
-    FD_SET(fd, &rd);
-    if (write) {
-        ret = select(fd + 1, 0, &rd, 0, &tv);
-    } else {
-        ret = select(fd + 1, &rd, 0, 0, &tv);
-    }
-    if (!FD_ISSET(fd, &rd)) {
-        LOGERR(("Netcon::select1: fd not ready after select ??\n"));
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = write ? POLLOUT : POLLIN;
+    pfd.revents = 0;
+    int ret = poll(&pfd, 1, timeo * 1000);
+    if (ret < 0) {
+        LOGSYSERR("Netcon::select1", "poll", "");
         return -1;
     }
-    return ret;
+    return ret > 0 ? 1 : 0;
+}
+
+SelectLoop::SelectLoop()
+    : m_selectloopDoReturn(false), m_selectloopReturnValue(0),
+      m_placetostart(0),
+      m_periodichandler(0), m_periodicparam(0), m_periodicmillis(0),
+      m_epfd(-1)
+{
+#ifdef NETCON_EPOLL
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epfd < 0) {
+        LOGSYSERR("SelectLoop", "epoll_create1", "");
+    }
+#endif
+}
+
+SelectLoop::~SelectLoop()
+{
+    if (m_epfd >= 0) {
+        close(m_epfd);
+    }
+}
+
+// Called when a connection changes its set of wanted events.
+int Netcon::setselevents(int evs)
+{
+    m_wantedEvents = evs;
+    if (m_loop) {
+        m_loop->setdirty(m_fd);
+    }
+    return m_wantedEvents;
+}
+
+void SelectLoop::setdirty(int fd)
+{
+    if (m_epfd >= 0 && fd >= 0) {
+        m_dirty.insert(fd);
+    }
 }
 
 void SelectLoop::setperiodichandler(int (*handler)(void *), void *p, int ms)
@@ -177,6 +217,171 @@ int SelectLoop::maybecallperiodic()
 }
 
 int SelectLoop::doLoop()
+{
+    if (m_epfd >= 0) {
+        return doLoopEpoll();
+    }
+    return doLoopSelect();
+}
+
+void SelectLoop::dispatch(std::map<int, NetconP>::iterator it, bool canread,
+                          bool canwrite)
+{
+    NetconP& pll = it->second;
+    if (canread && pll->cando(Netcon::NETCONPOLL_READ) <= 0) {
+        pll->m_wantedEvents &= ~Netcon::NETCONPOLL_READ;
+    }
+    if (canwrite && pll->cando(Netcon::NETCONPOLL_WRITE) <= 0) {
+        pll->m_wantedEvents &= ~Netcon::NETCONPOLL_WRITE;
+    }
+    if (!(pll->m_wantedEvents & (Netcon::NETCONPOLL_WRITE | Netcon::NETCONPOLL_READ))) {
+        LOGDEB0(("Netcon::selectloop: fd %d has 0x%x mask, erasing\n",
+                 it->first, it->second->m_wantedEvents));
+        // Unregister while the fd is still open (erasing may close it)
+        unregister(it->first);
+        m_polldata.erase(it);
+    }
+}
+
+#ifdef NETCON_EPOLL
+static unsigned int epollEvents(int wanted)
+{
+    return ((wanted & Netcon::NETCONPOLL_READ) ? EPOLLIN : 0) |
+        ((wanted & Netcon::NETCONPOLL_WRITE) ? EPOLLOUT : 0);
+}
+#endif
+
+void SelectLoop::unregister(int fd)
+{
+#ifdef NETCON_EPOLL
+    std::map<int, int>::iterator rit = m_registered.find(fd);
+    if (rit != m_registered.end()) {
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        // May fail if the fd was already closed, no matter.
+        epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, &ev);
+        m_registered.erase(rit);
+    }
+#endif
+}
+
+// Update the epoll registrations for the connections which changed
+// their wanted events since the last wait.
+bool SelectLoop::syncepoll()
+{
+#ifdef NETCON_EPOLL
+    for (std::set<int>::iterator dit = m_dirty.begin();
+         dit != m_dirty.end(); dit++) {
+        int fd = *dit;
+        int wanted = 0;
+        std::map<int, NetconP>::iterator it = m_polldata.find(fd);
+        if (it != m_polldata.end()) {
+            wanted = it->second->m_wantedEvents &
+                (Netcon::NETCONPOLL_READ | Netcon::NETCONPOLL_WRITE);
+        }
+        if (wanted == 0) {
+            unregister(fd);
+            continue;
+        }
+        std::map<int, int>::iterator rit = m_registered.find(fd);
+        if (rit != m_registered.end() && rit->second == wanted) {
+            continue;
+        }
+        struct epoll_event ev;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = epollEvents(wanted);
+        ev.data.fd = fd;
+        int ret = epoll_ctl(m_epfd, rit == m_registered.end() ?
+                            EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ev);
+        // Our idea of the registration may be stale if an fd was
+        // closed and reused behind our back.
+        if (ret < 0 && errno == EEXIST) {
+            ret = epoll_ctl(m_epfd, EPOLL_CTL_MOD, fd, &ev);
+        } else if (ret < 0 && errno == ENOENT) {
+            ret = epoll_ctl(m_epfd, EPOLL_CTL_ADD, fd, &ev);
+        }
+        if (ret < 0) {
+            char fdcbuf[20];
+            sprintf(fdcbuf, "%d", fd);
+            LOGSYSERR("SelectLoop::syncepoll", "epoll_ctl", fdcbuf);
+            m_dirty.clear();
+            return false;
+        }
+        m_registered[fd] = wanted;
+    }
+    m_dirty.clear();
+#endif
+    return true;
+}
+
+// The epoll version of the loop. Contrary to the select() one, the
+// cost of an iteration only depends on the number of active
+// connections.
+int SelectLoop::doLoopEpoll()
+{
+#ifdef NETCON_EPOLL
+    std::vector<struct epoll_event> events;
+    for (;;) {
+        if (m_selectloopDoReturn) {
+            m_selectloopDoReturn = false;
+            LOGDEB(("Netcon::selectloop: returning on request\n"));
+            return m_selectloopReturnValue;
+        }
+        if (!syncepoll()) {
+            return -1;
+        }
+        if (m_registered.empty()) {
+            // See the comments in doLoopSelect()
+            m_polldata.clear();
+            LOGDEB1(("Netcon::selectloop: no fds\n"));
+            return 0;
+        }
+
+        int timeoms = -1;
+        if (m_periodicmillis > 0) {
+            struct timeval tv;
+            periodictimeout(&tv);
+            timeoms = tv.tv_sec * 1000 + tv.tv_usec / 1000;
+        }
+        events.resize(MIN(m_registered.size(), 256));
+        int ret = epoll_wait(m_epfd, &events[0], events.size(), timeoms);
+        LOGDEB2(("Netcon::selectloop: epoll_wait returns %d\n", ret));
+        if (ret < 0) {
+            LOGSYSERR("Netcon::selectloop", "epoll_wait", "");
+            return -1;
+        }
+        if (m_periodicmillis > 0)
+            if (maybecallperiodic() <= 0) {
+                return 1;
+            }
+
+        for (int i = 0; i < ret; i++) {
+            int fd = events[i].data.fd;
+            // The connection may have been removed by a previous callback
+            std::map<int, NetconP>::iterator it = m_polldata.find(fd);
+            if (it == m_polldata.end()) {
+                continue;
+            }
+            int wanted = it->second->m_wantedEvents;
+            unsigned int evs = events[i].events;
+            // select() reports errors and hangups as readiness
+            bool err = (evs & (EPOLLERR | EPOLLHUP)) != 0;
+            bool canread = (wanted & Netcon::NETCONPOLL_READ) &&
+                (err || (evs & EPOLLIN));
+            bool canwrite = (wanted & Netcon::NETCONPOLL_WRITE) &&
+                (err || (evs & EPOLLOUT));
+            LOGDEB2(("Netcon::selectloop: fd %d %s %s\n", fd,
+                     canread ? "read" : "", canwrite ? "write" : ""));
+            if (canread || canwrite) {
+                dispatch(it, canread, canwrite);
+            }
+        }
+    }
+#endif
+    return -1;
+}
+
+int SelectLoop::doLoopSelect()
 {
     for (;;) {
         if (m_selectloopDoReturn) {
@@ -277,18 +482,7 @@ int SelectLoop::doLoop()
 
             // Next start will be one beyond last serviced (modulo nfds)
             m_placetostart = fd + 1;
-            NetconP& pll = it->second;
-            if (canread && pll->cando(Netcon::NETCONPOLL_READ) <= 0) {
-                pll->m_wantedEvents &= ~Netcon::NETCONPOLL_READ;
-            }
-            if (canwrite && pll->cando(Netcon::NETCONPOLL_WRITE) <= 0) {
-                pll->m_wantedEvents &= ~Netcon::NETCONPOLL_WRITE;
-            }
-            if (!(pll->m_wantedEvents & (Netcon::NETCONPOLL_WRITE | Netcon::NETCONPOLL_READ))) {
-                LOGDEB0(("Netcon::selectloop: fd %d has 0x%x mask, erasing\n",
-                         it->first, it->second->m_wantedEvents));
-                m_polldata.erase(it);
-            }
+            dispatch(it, canread, canwrite);
         } // fd sweep
 
     } // forever loop
@@ -305,8 +499,11 @@ int SelectLoop::addselcon(NetconP con, int events)
     LOGDEB1(("Netcon::addselcon: fd %d\n", con->m_fd));
     con->set_nonblock(1);
     con->setselevents(events);
+    // A registration for this fd, if any, is for a closed connection
+    m_registered.erase(con->m_fd);
     m_polldata[con->m_fd] = con;
     con->setloop(this);
+    setdirty(con->m_fd);
     return 0;
 }
 
@@ -323,6 +520,7 @@ int SelectLoop::remselcon(NetconP con)
         return -1;
     }
     con->setloop(0);
+    unregister(con->m_fd);
     m_polldata.erase(it);
     return 0;
 }
@@ -586,6 +784,137 @@ int NetconData::getline(char *buf, int cnt, int timeo)
     }
 }
 
+int NetconData::readavail()
+{
+    if (m_fd < 0) {
+        LOGERR(("NetconData::readavail: connection not opened\n"));
+        return -1;
+    }
+    if (m_buf == 0) {
+        if ((m_buf = (char *)malloc(defbufsize)) == 0) {
+            LOGSYSERR("NetconData::readavail: Out of mem", "malloc", "");
+            return -1;
+        }
+        m_bufsize = defbufsize;
+        m_bufbase = m_buf;
+        m_bufbytes = 0;
+    }
+    // Move the data to the start of the buffer, and grow it if there
+    // is not much space left.
+    if (m_bufbase != m_buf) {
+        memmove(m_buf, m_bufbase, m_bufbytes);
+        m_bufbase = m_buf;
+    }
+    if (m_bufsize - m_bufbytes < defbufsize) {
+        char *nbuf = (char *)realloc(m_buf, 2 * m_bufsize);
+        if (nbuf == 0) {
+            LOGSYSERR("NetconData::readavail: Out of mem", "realloc", "");
+            return -1;
+        }
+        m_buf = m_bufbase = nbuf;
+        m_bufsize *= 2;
+    }
+    int cnt = read(m_fd, m_buf + m_bufbytes, m_bufsize - m_bufbytes);
+    if (cnt < 0) {
+        char fdcbuf[20];
+        sprintf(fdcbuf, "%d", m_fd);
+        LOGSYSERR("NetconData::readavail", "read", fdcbuf);
+        return -1;
+    }
+    m_bufbytes += cnt;
+    return cnt;
+}
+
+bool NetconData::getlineview(const char **line, int *len)
+{
+    if (m_bufbytes <= 0) {
+        return false;
+    }
+    const char *nl = (const char *)memchr(m_bufbase, '\n', m_bufbytes);
+    if (nl == 0) {
+        return false;
+    }
+    *line = m_bufbase;
+    *len = nl - m_bufbase + 1;
+    m_bufbase += *len;
+    m_bufbytes -= *len;
+    return true;
+}
+
+bool NetconData::getdataview(int cnt, const char **data)
+{
+    if (cnt > m_bufbytes) {
+        return false;
+    }
+    *data = m_bufbase;
+    m_bufbase += cnt;
+    m_bufbytes -= cnt;
+    return true;
+}
+
+int NetconData::queuesend(std::string data, bool flush)
+{
+    if (m_fd < 0) {
+        LOGERR(("NetconData::queuesend: connection not opened\n"));
+        return -1;
+    }
+    if (!data.empty()) {
+        m_wqueue.push_back(std::string());
+        m_wqueue.back().swap(data);
+    }
+    return flush ? flushsend() : 0;
+}
+
+int NetconData::flushsend()
+{
+    if (writequeue() < 0) {
+        return -1;
+    }
+    if (!m_wqueue.empty() && m_loop) {
+        m_flushing = true;
+        addselevents(NETCONPOLL_WRITE);
+    }
+    return 0;
+}
+
+// Write as much of the queue as possible, in as few system calls as
+// possible.
+int NetconData::writequeue()
+{
+    while (!m_wqueue.empty()) {
+        struct iovec iov[16];
+        int niov = 0;
+        for (std::deque<std::string>::iterator it = m_wqueue.begin();
+             it != m_wqueue.end() && niov < 16; it++, niov++) {
+            std::string::size_type offs = niov == 0 ? m_wqoffset : 0;
+            iov[niov].iov_base = (void *)(it->c_str() + offs);
+            iov[niov].iov_len = it->size() - offs;
+        }
+        ssize_t ret = writev(m_fd, iov, niov);
+        if (ret < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            char fdcbuf[20];
+            sprintf(fdcbuf, "%d", m_fd);
+            LOGSYSERR("NetconData::writequeue", "writev", fdcbuf);
+            return -1;
+        }
+        size_t left = ret;
+        while (left > 0) {
+            size_t avail = m_wqueue.front().size() - m_wqoffset;
+            if (left < avail) {
+                m_wqoffset += left;
+                break;
+            }
+            left -= avail;
+            m_wqueue.pop_front();
+            m_wqoffset = 0;
+        }
+    }
+    return 0;
+}
+
 // Called when selectloop detects that data can be read or written on
 // the connection. The user callback would normally have been set
 // up. If it is, call it and return. Else, perform housecleaning: read
@@ -593,6 +922,18 @@ int NetconData::getline(char *buf, int cnt, int timeo)
 int NetconData::cando(Netcon::Event reason)
 {
     LOGDEB2(("NetconData::cando\n"));
+    if ((reason & NETCONPOLL_WRITE) && m_flushing) {
+        if (writequeue() < 0) {
+            return -1;
+        }
+        if (!m_wqueue.empty()) {
+            return 1;
+        }
+        // The queue is empty: tell the user, who may set the write
+        // flag again if needed.
+        m_flushing = false;
+        clearselevents(NETCONPOLL_WRITE);
+    }
     if (m_user) {
         return m_user->data(this, reason);
     }
@@ -825,7 +1166,7 @@ int NetconServLis::openservice(const char *serv, int backlog)
 }
 
 // Port is a natural host integer value
-int NetconServLis::openservice(int port, int backlog)
+int NetconServLis::openservice(int port, int backlog, const char *bindaddr)
 {
     LOGDEB1(("NetconServLis::openservice: port %d\n", port));
 #ifdef NETCON_ACCESSCONTROL
@@ -846,6 +1187,10 @@ int NetconServLis::openservice(int port, int backlog)
     memset(&ipaddr, 0, sizeof(ipaddr));
     ipaddr.sin_family = AF_INET;
     ipaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (bindaddr && inet_pton(AF_INET, bindaddr, &ipaddr.sin_addr) != 1) {
+        LOGERR(("NetconServLis::openservice: bad address [%s]\n", bindaddr));
+        goto out;
+    }
     ipaddr.sin_port = htons((short)port);
     if (::bind(m_fd, (struct sockaddr *)&ipaddr, sizeof(ipaddr)) < 0) {
         LOGSYSERR("NetconServLis", "bind", "");
@@ -18,7 +18,9 @@
  */
 #include <sys/time.h>
 
+#include <deque>
 #include <map>
+#include <set>
 #include <memory>
 #include <string>
 
@@ -79,20 +81,18 @@ public:
 
     /// Decide what events the connection will be looking for
     /// (NETCONPOLL_READ, NETCONPOLL_WRITE)
-    int setselevents(int evs) {
-        return m_wantedEvents = evs;
-    }
+    int setselevents(int evs);
     /// Retrieve the connection's currently monitored set of events
     int getselevents() {
         return m_wantedEvents;
     }
     /// Add events to current set
     int addselevents(int evs) {
-        return m_wantedEvents |= evs;
+        return setselevents(m_wantedEvents | evs);
     }
     /// Clear events from current set
     int clearselevents(int evs) {
-        return m_wantedEvents &= ~evs;
+        return setselevents(m_wantedEvents & ~evs);
     }
 
     friend class SelectLoop;
@@ -127,13 +127,14 @@ protected:
 // or written. In a multithread program which is also using select, it
 // would typically make sense to have one SelectLoop active per
 // thread.
+// Under Linux, the loop uses epoll (level-triggered, so that the
+// callbacks need not drain the connections), and only looks at the
+// active descriptors. Else, or if the epoll descriptor can't be
+// created, it uses select().
 class SelectLoop {
 public:
-    SelectLoop()
-        : m_selectloopDoReturn(false), m_selectloopReturnValue(0),
-          m_placetostart(0),
-          m_periodichandler(0), m_periodicparam(0), m_periodicmillis(0) {
-    }
+    SelectLoop();
+    ~SelectLoop();
 
     /// Loop waiting for events on the connections and call the
     /// cando() method on the object when something happens (this will in
@@ -167,6 +168,7 @@ public:
     void setperiodichandler(int (*handler)(void *), void *clp, int ms);
 
 private:
+    friend class Netcon;
     // Set by client callback to tell selectloop to return.
     bool m_selectloopDoReturn;
     int  m_selectloopReturnValue;
@@ -184,6 +186,21 @@ private:
     int m_periodicmillis;
     void periodictimeout(struct timeval *tv);
     int maybecallperiodic();
+
+    // epoll descriptor, or -1 if we use select()
+    int m_epfd;
+    // Events currently registered with epoll, by fd
+    std::map<int, int> m_registered;
+    // Descriptors which need their epoll registration to be updated
+    std::set<int> m_dirty;
+    void setdirty(int fd);
+    void unregister(int fd);
+    bool syncepoll();
+    int doLoopEpoll();
+    int doLoopSelect();
+    // Call the connection's cando() for the ready events, and clean up
+    void dispatch(std::map<int, NetconP>::iterator it, bool canread,
+                  bool canwrite);
 };
 
 ///////////////////////
@@ -209,7 +226,8 @@ public:
 /// Base class for connections that actually transfer data. T
 class NetconData : public Netcon {
 public:
-    NetconData() : m_buf(0), m_bufbase(0), m_bufbytes(0), m_bufsize(0) {
+    NetconData() : m_buf(0), m_bufbase(0), m_bufbytes(0), m_bufsize(0),
+                   m_wqoffset(0), m_flushing(false) {
     }
     virtual ~NetconData();
 
@@ -238,6 +256,38 @@ public:
     /// Read a line of text on an ascii connection. Returns -1 or byte count
     /// including final 0. \n is kept
     virtual int getline(char *buf, int cnt, int timeo = -1);
+
+    /// Buffered input, for use from the selectloop. Perform one read
+    /// into the input buffer, which grows as needed. Returns the
+    /// count of bytes read, 0 for EOF, -1 for error.
+    virtual int readavail();
+    /// Get the next complete line from the input buffer, without
+    /// copying. *line points into the buffer, is not null-terminated
+    /// and keeps the \n. It is valid until the next read call.
+    /// @return false if there is no complete line in the buffer.
+    virtual bool getlineview(const char **line, int *len);
+    /// Same for cnt bytes of data.
+    virtual bool getdataview(int cnt, const char **data);
+    /// Count of bytes in the input buffer.
+    virtual int bufferedbytes() {
+        return m_bufbytes;
+    }
+
+    /// Buffered output. Append data to the write queue, and write it
+    /// if flush is set. The queue is written with writev(). When the
+    /// connection is in a selectloop, the part which could not be
+    /// written at once is sent when the socket becomes writable, and
+    /// the callback is called with NETCONPOLL_WRITE when the queue
+    /// is empty.
+    /// @return -1 if an error occurred.
+    virtual int queuesend(std::string data, bool flush = true);
+    /// Write what we can of the queue.
+    virtual int flushsend();
+    /// Is there still data in the write queue ?
+    virtual bool sendqueued() {
+        return !m_wqueue.empty();
+    }
+
     /// Set handler to be called when the connection is placed in the
     /// selectloop and an event occurs.
     virtual void setcallback(std::shared_ptr<NetconWorker> user) {
@@ -249,6 +299,12 @@ private:
     char *m_bufbase;    // Pointer to current 1st byte of useful data
     int m_bufbytes; // Bytes of data.
     int m_bufsize;  // Total buffer size
+    // Write queue, and offset of the unsent data in its first element
+    std::deque<std::string> m_wqueue;
+    std::string::size_type m_wqoffset;
+    // Set while we need write events to flush the queue
+    bool m_flushing;
+    int writequeue();
     std::shared_ptr<NetconWorker> m_user;
     virtual int cando(Netcon::Event reason); // Selectloop slot
 };
@@ -319,8 +375,9 @@ public:
     /// Open named service. Used absolute pathname to create an
     /// AF_UNIX path-based socket instead of an IP one.
     int openservice(const char *serv, int backlog = 10);
-    /// Open service by port number.
-    int openservice(int port, int backlog = 10);
+    /// Open service by port number. bindaddr is a numeric IPv4
+    /// address to listen on, all interfaces if it is null.
+    int openservice(int port, int backlog = 10, const char *bindaddr = 0);
     /// Wait for incoming connection. Returned connected Netcon
     NetconServCon *accept(int timeo = -1);
 
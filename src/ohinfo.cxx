@@ -146,7 +146,7 @@ int OHInfo::details(const SoapIncoming& sc, SoapOutgoing& data)
 int OHInfo::metatext(const SoapIncoming& sc, SoapOutgoing& data)
 {
     LOGDEB("OHInfo::metatext" << endl);
-    data.addarg("Value", m_state["Metatext"]);
+    data.addarg("Value", m_metatext);
     return UPNP_E_SUCCESS;
 }
 
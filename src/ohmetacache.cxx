@@ -22,7 +22,10 @@
 #include <string.h>                     // for strchr
 #include <unistd.h>
 
+#include <atomic>
+#include <fstream>                      // for ifstream, ofstream
 #include <iostream>                     // for basic_ostream, operator<<, etc
+#include <sstream>                      // for istringstream
 #include <utility>                      // for pair
 
 #include "libupnpp/log.hxx"
@@ -31,7 +34,8 @@
 using namespace std;
 using namespace UPnPP;
 
-static unsigned int slptimesecs;
+// Can be changed by a configuration reload while a save task sleeps
+static std::atomic<unsigned int> slptimesecs(0);
 void dmcacheSetOpts(unsigned int slpsecs)
 {
     slptimesecs = slpsecs;
@@ -39,12 +43,14 @@ void dmcacheSetOpts(unsigned int slpsecs)
 
 class SaveCacheTask {
 public:
-    SaveCacheTask(const string& fn, const mcache_type& cache)
-        : m_fn(fn), m_cache(cache)
+    SaveCacheTask(const string& fn, const mcache_type& cache,
+                  const ohids_type& ids)
+        : m_fn(fn), m_cache(cache), m_ids(ids)
         {}
 
     string m_fn;
     mcache_type m_cache;
+    ohids_type m_ids;
 };
 static WorkQueue<SaveCacheTask*> saveQueue("SaveQueue");
 
@@ -101,9 +107,10 @@ static string decode(const string &in)
     return out;
 }
 
-bool dmcacheSave(const string& fn, const mcache_type& cache)
+bool dmcacheSave(const string& fn, const mcache_type& cache,
+                 const ohids_type& ids)
 {
-    SaveCacheTask *tsk = new SaveCacheTask(fn, cache);
+    SaveCacheTask *tsk = new SaveCacheTask(fn, cache, ids);
 
     // Use the flush option to put() so that only the latest version
     // stays on the queue, possibly saving writes.
@@ -114,6 +121,54 @@ bool dmcacheSave(const string& fn, const mcache_type& cache)
     return true;
 }
 
+// Id list: one "ohid mpdid uri" line per queue entry, in order.
+static void saveIds(const string& fn, const ohids_type& ids)
+{
+    string tfn = fn + "-";
+    ofstream output(tfn, ios::out | ios::trunc);
+    if (!output.is_open()) {
+        LOGERR("dmcacheSave: could not open " << tfn << " for writing" << endl);
+        return;
+    }
+    for (auto it = ids.begin(); it != ids.end(); it++) {
+        output << it->ohid << ' ' << it->mpdid << ' ' << encode(it->uri) <<
+            '\n';
+    }
+    output.flush();
+    if (!output.good()) {
+        LOGERR("dmcacheSave: write error while saving to " << tfn << endl);
+        return;
+    }
+    if (rename(tfn.c_str(), fn.c_str()) != 0) {
+        LOGERR("dmcacheSave: rename(" << tfn << ", " << fn << ")" <<
+               " failed: errno: " << errno << endl);
+    }
+}
+
+static void restoreIds(const string& fn, ohids_type& ids)
+{
+    ifstream input(fn, ios::in);
+    if (!input.is_open()) {
+        LOGDEB("dmcacheRestore: no id list in " << fn << endl);
+        return;
+    }
+    string line;
+    while (getline(input, line)) {
+        istringstream str(line);
+        OHIdEntry ent;
+        string uri;
+        // The uri is the rest of the line (it may contain spaces)
+        if (!(str >> ent.ohid >> ent.mpdid) || str.get() != ' ' ||
+            !getline(str, uri) || ent.ohid == 0) {
+            LOGERR("dmcacheRestore: bad line in " << fn << endl);
+            ids.clear();
+            return;
+        }
+        ent.uri = decode(uri);
+        ids.push_back(ent);
+    }
+}
+
 static void *dmcacheSaveWorker(void *)
 {
     for (;;) {
@@ -154,11 +209,13 @@ static void *dmcacheSaveWorker(void *)
             LOGERR("dmcacheSave: rename(" << tfn << ", " << tsk->m_fn << ")" <<
                    " failed: errno: " << errno << endl);
         }
+        saveIds(tsk->m_fn + ".ids", tsk->m_ids);
 
         delete tsk;
-        if (slptimesecs) {
-            LOGDEB1("dmcacheSave: sleeping " << slptimesecs << endl);
-            sleep(slptimesecs);
+        unsigned int slp = slptimesecs;
+        if (slp) {
+            LOGDEB1("dmcacheSave: sleeping " << slp << endl);
+            sleep(slp);
         }
     }
 }
@@ -166,7 +223,7 @@ static void *dmcacheSaveWorker(void *)
 // Max size of metadata element ??
 #define LL 10*1024
 
-bool dmcacheRestore(const string& fn, mcache_type& cache)
+bool dmcacheRestore(const string& fn, mcache_type& cache, ohids_type *ids)
 {
     // Restore is called once at startup, so seize the opportunity to start the
     // save thread
@@ -199,5 +256,8 @@ bool dmcacheRestore(const string& fn, mcache_type& cache)
         *cp = 0;
         cache[decode(cline)] = decode(cp+1);
     }
+    if (ids) {
+        restoreIds(fn + ".ids", *ids);
+    }
     return true;
 }
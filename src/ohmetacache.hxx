@@ -3,14 +3,33 @@
 
 #include <string>
 #include <unordered_map>
+#include <vector>
 
 typedef std::unordered_map<std::string, std::string> mcache_type;
 
 /** 
- * Saving and restoring the metadata cache to/from disk
+ * OpenHome Playlist id for a queue entry. The mpd song ids change when
+ * mpd restarts, the OpenHome ids stay the same (see ohplaylist.cxx).
+ */
+struct OHIdEntry {
+    OHIdEntry(unsigned int o = 0, int m = -1,
+              const std::string& u = std::string())
+        : ohid(o), mpdid(m), uri(u) {
+    }
+    unsigned int ohid;
+    int mpdid;
+    std::string uri;
+};
+typedef std::vector<OHIdEntry> ohids_type;
+
+/** 
+ * Saving and restoring the metadata cache to/from disk. The id list
+ * (queue order) is stored in a separate file (fn + ".ids").
  */
 extern void dmcacheSetOpts(unsigned int slptime);
-extern bool dmcacheSave(const std::string& fn, const mcache_type& cache);
-extern bool dmcacheRestore(const std::string& fn, mcache_type& cache);
+extern bool dmcacheSave(const std::string& fn, const mcache_type& cache,
+                        const ohids_type& ids = ohids_type());
+extern bool dmcacheRestore(const std::string& fn, mcache_type& cache,
+                           ohids_type *ids = 0);
 
 #endif /* _OHMETACACHE_H_X_INCLUDED_ */
@@ -0,0 +1,951 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef OHMRECEIVER_TEST
+#include "ohmreceiver.hxx"
+
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "libupnpp/log.hxx"
+
+using namespace std;
+using namespace UPnPP;
+
+// Songcast message types. Each message begins with an 8 bytes
+// header: "Ohm " or "Ohz ", version (1), type, total length (16 bits)
+enum OhmMsgType {OHM_JOIN = 0, OHM_LISTEN = 1, OHM_LEAVE = 2, OHM_AUDIO = 3,
+                 OHM_TRACK = 4, OHM_METATEXT = 5, OHM_SLAVE = 6,
+                 OHM_RESEND = 7};
+enum OhzMsgType {OHZ_ZONEQUERY = 0, OHZ_ZONEURI = 1};
+static const unsigned int msgHeaderSize = 8;
+// Fixed part of the audio message header, after the message header.
+static const unsigned int audioHeaderSize = 50;
+enum OhmAudioFlags {OHMAF_HALT = 1, OHMAF_LOSSLESS = 2, OHMAF_TIMESTAMPED = 4,
+                    OHMAF_RESENT = 8};
+
+// Interval between Listen messages, which keep the Sender sending.
+static const int listenIntervalMs = 1000;
+// Max count of frames waiting for a missing one. If more arrive, we
+// give up on the missing ones.
+static const unsigned int maxPendingFrames = 32;
+// Max count of frames in a Resend request
+static const unsigned int maxResendFrames = 16;
+// Audio buffer size
+static const unsigned int ringBytes = 1024 * 1024;
+// Amount of audio we send a new HTTP client from what was buffered
+// before it connected. More would just increase the latency.
+static const int initialBufferMs = 500;
+// Poll timeout for the threads, determines how fast they stop
+static const int pollMs = 100;
+// We're "receiving" if we got audio data in this interval
+static const int receivingTimeoutMs = 3000;
+
+static int64_t nowms()
+{
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static unsigned int getbe16(const unsigned char *cp)
+{
+    return (cp[0] << 8) | cp[1];
+}
+static unsigned int getbe32(const unsigned char *cp)
+{
+    return ((unsigned int)cp[0] << 24) | (cp[1] << 16) | (cp[2] << 8) | cp[3];
+}
+static void putbe32(string& out, unsigned int v)
+{
+    out += char((v >> 24) & 0xff);
+    out += char((v >> 16) & 0xff);
+    out += char((v >> 8) & 0xff);
+    out += char(v & 0xff);
+}
+static void putle16(string& out, unsigned int v)
+{
+    out += char(v & 0xff);
+    out += char((v >> 8) & 0xff);
+}
+static void putle32(string& out, unsigned int v)
+{
+    putle16(out, v & 0xffff);
+    putle16(out, (v >> 16) & 0xffff);
+}
+
+// Build message: magic is "Ohm " or "Ohz ", payload is what comes
+// after the header.
+static string makeMsg(const char *magic, int type, const string& payload)
+{
+    string msg(magic);
+    msg += char(1);
+    msg += char(type);
+    unsigned int len = msgHeaderSize + payload.size();
+    msg += char((len >> 8) & 0xff);
+    msg += char(len & 0xff);
+    msg += payload;
+    return msg;
+}
+
+// Check message header, return type or -1
+static int checkMsg(const char *magic, const unsigned char *buf, size_t len)
+{
+    if (len < msgHeaderSize || memcmp(buf, magic, 4) || buf[4] != 1 ||
+        getbe16(buf + 6) > len) {
+        return -1;
+    }
+    return buf[5];
+}
+
+// Parse Songcast URI like ohm://239.253.1.1:51972 or
+// ohz://239.255.255.250:51972/zoneid
+static bool parseUri(const string& uri, string& scheme, string& host,
+                     int& port, string& path)
+{
+    string::size_type pos = uri.find("://");
+    if (pos == string::npos)
+        return false;
+    scheme = uri.substr(0, pos);
+    string rest = uri.substr(pos + 3);
+    pos = rest.find('/');
+    if (pos != string::npos) {
+        path = rest.substr(pos + 1);
+        rest = rest.substr(0, pos);
+    }
+    pos = rest.find(':');
+    if (pos == string::npos)
+        return false;
+    host = rest.substr(0, pos);
+    port = atoi(rest.substr(pos + 1).c_str());
+    return !host.empty() && port > 0 && port < 65536;
+}
+
+static bool makeAddr(const string& host, int port, struct sockaddr_in& addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_aton(host.c_str(), &addr.sin_addr))
+        return true;
+    struct addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(host.c_str(), 0, &hints, &res) != 0 || res == 0) {
+        LOGERR("OhmReceiver: can't resolve " << host << endl);
+        return false;
+    }
+    addr.sin_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+    freeaddrinfo(res);
+    return true;
+}
+
+// Create UDP socket. If group is set, bind to its port and join it,
+// else bind to an ephemeral port.
+static int udpSocket(const struct sockaddr_in *group)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        LOGERR("OhmReceiver: socket() failed, errno " << errno << endl);
+        return -1;
+    }
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = group ? group->sin_port : 0;
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        LOGERR("OhmReceiver: bind() failed, errno " << errno << endl);
+        close(fd);
+        return -1;
+    }
+    if (group) {
+        struct ip_mreq mreq;
+        mreq.imr_multiaddr = group->sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+                       sizeof(mreq)) < 0) {
+            LOGERR("OhmReceiver: IP_ADD_MEMBERSHIP failed, errno " << errno
+                   << endl);
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+// Wait for readability, returns > 0 if readable
+static int waitReadable(int fd, int ms)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, ms);
+}
+
+class OhmReceiver::Internal {
+public:
+    Internal(int port)
+        : httpport(port), abortreq(false), stopreq(false), udpfd(-1),
+          lisfd(-1), started(false), formatset(false), rate(0), bits(0),
+          channels(0), ring(ringBytes), wpos(0), rpos(0),
+          clientconnected(false), lastaudioms(0), havenext(false),
+          nextframe(0), resentfor(0), lastframems(0) {
+    }
+    ~Internal() {
+        stopreq = true;
+        cond.notify_all();
+        if (rcvthread.joinable())
+            rcvthread.join();
+        if (httpthread.joinable())
+            httpthread.join();
+        if (udpfd >= 0) {
+            sendMsg(OHM_LEAVE, string());
+            close(udpfd);
+        }
+        if (lisfd >= 0)
+            close(lisfd);
+    }
+
+    bool resolveZone(const string& host, int port, const string& zone,
+                     int timeosecs, string& uri);
+    bool setupHttp();
+    void sendMsg(int type, const string& payload);
+    void receiver();
+    void handleAudio(const unsigned char *buf, size_t len);
+    void deliverFrame(const string& data);
+    void requestResend(unsigned int from, unsigned int to);
+    void httpServer();
+    void serveClient(int fd);
+    string wavHeader();
+
+    int httpport;
+    atomic<bool> abortreq;
+    atomic<bool> stopreq;
+    // Socket for the audio stream and address where we send our
+    // messages (group or sender)
+    int udpfd;
+    struct sockaddr_in senderaddr;
+    // HTTP listen socket
+    int lisfd;
+    bool started;
+    thread rcvthread;
+    thread httpthread;
+
+    // The following are protected by the mutex
+    mutex mmutex;
+    condition_variable cond;
+    // Audio format from the first frame
+    bool formatset;
+    unsigned int rate;
+    unsigned int bits;
+    unsigned int channels;
+    // Ring buffer. wpos and rpos are total counts of bytes written
+    // and read. Bytes between rpos and wpos are being read (maybe
+    // directly from the buffer to the socket, outside the lock) and
+    // never overwritten while a client is connected.
+    vector<char> ring;
+    uint64_t wpos;
+    uint64_t rpos;
+    bool clientconnected;
+    int64_t lastaudioms;
+
+    // Reception thread only: frame reordering
+    bool havenext;
+    unsigned int nextframe;
+    map<unsigned int, string> pending;
+    // We asked for a resend for frames before this one
+    unsigned int resentfor;
+    // Arrival time of the last audio message
+    int64_t lastframems;
+};
+
+OhmReceiver::OhmReceiver(int httpport)
+{
+    m = new Internal(httpport);
+}
+
+OhmReceiver::~OhmReceiver()
+{
+    delete m;
+}
+
+void OhmReceiver::abort()
+{
+    m->abortreq = true;
+}
+
+bool OhmReceiver::receiving()
+{
+    unique_lock<mutex> lock(m->mmutex);
+    return m->started && m->lastaudioms != 0 &&
+        nowms() - m->lastaudioms < receivingTimeoutMs;
+}
+
+// Ask on the zone multicast group for the actual stream URI.
+bool OhmReceiver::Internal::resolveZone(const string& host, int port,
+                                        const string& zone, int timeosecs,
+                                        string& uri)
+{
+    struct sockaddr_in group;
+    if (!makeAddr(host, port, group))
+        return false;
+    int fd = udpSocket(&group);
+    if (fd < 0)
+        return false;
+
+    string payload;
+    putbe32(payload, zone.size());
+    payload += zone;
+    string query = makeMsg("Ohz ", OHZ_ZONEQUERY, payload);
+
+    bool found = false;
+    int64_t deadline = nowms() + timeosecs * 1000;
+    int64_t lastquery = 0;
+    unsigned char buf[2048];
+    while (!found && !abortreq && nowms() < deadline) {
+        if (nowms() - lastquery >= 1000) {
+            sendto(fd, query.c_str(), query.size(), 0,
+                   (struct sockaddr *)&group, sizeof(group));
+            lastquery = nowms();
+        }
+        if (waitReadable(fd, pollMs) <= 0)
+            continue;
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0 || checkMsg("Ohz ", buf, n) != OHZ_ZONEURI ||
+            n < msgHeaderSize + 8) {
+            continue;
+        }
+        unsigned int zlen = getbe32(buf + msgHeaderSize);
+        unsigned int ulen = getbe32(buf + msgHeaderSize + 4);
+        if (msgHeaderSize + 8 + zlen + ulen > (size_t)n)
+            continue;
+        const char *zp = (const char *)buf + msgHeaderSize + 8;
+        if (string(zp, zlen) != zone)
+            continue;
+        uri.assign(zp + zlen, ulen);
+        found = true;
+    }
+    close(fd);
+    if (found) {
+        LOGDEB("OhmReceiver: zone " << zone << " -> " << uri << endl);
+    } else {
+        LOGERR("OhmReceiver: could not resolve zone " << zone << endl);
+    }
+    return found;
+}
+
+bool OhmReceiver::start(const string& _uri, int timeosecs)
+{
+    LOGDEB("OhmReceiver::start: " << _uri << endl);
+    if (m->started) {
+        LOGERR("OhmReceiver::start: already started\n");
+        return false;
+    }
+    string uri(_uri), scheme, host, path;
+    int port;
+    if (!parseUri(uri, scheme, host, port, path)) {
+        LOGERR("OhmReceiver::start: bad uri " << uri << endl);
+        return false;
+    }
+    if (scheme == "ohz") {
+        if (!m->resolveZone(host, port, path, timeosecs, uri) ||
+            !parseUri(uri, scheme, host, port, path)) {
+            return false;
+        }
+    }
+    if (m->abortreq)
+        return false;
+    if ((scheme != "ohm" && scheme != "ohu") ||
+        !makeAddr(host, port, m->senderaddr)) {
+        LOGERR("OhmReceiver::start: can't use " << uri << endl);
+        return false;
+    }
+
+    m->udpfd = udpSocket(scheme == "ohm" ? &m->senderaddr : 0);
+    if (m->udpfd < 0 || !m->setupHttp())
+        return false;
+
+    m->sendMsg(OHM_JOIN, string());
+    try {
+        m->rcvthread = thread(&OhmReceiver::Internal::receiver, m);
+        m->httpthread = thread(&OhmReceiver::Internal::httpServer, m);
+    } catch (const std::exception& ex) {
+        LOGERR("OhmReceiver::start: could not start thread: " << ex.what()
+               << endl);
+        return false;
+    }
+    unique_lock<mutex> lock(m->mmutex);
+    m->started = true;
+    return true;
+}
+
+void OhmReceiver::Internal::sendMsg(int type, const string& payload)
+{
+    string msg = makeMsg("Ohm ", type, payload);
+    if (sendto(udpfd, msg.c_str(), msg.size(), 0,
+               (struct sockaddr *)&senderaddr, sizeof(senderaddr)) < 0) {
+        LOGDEB("OhmReceiver::sendMsg: sendto failed, errno " << errno << endl);
+    }
+}
+
+void OhmReceiver::Internal::receiver()
+{
+    LOGDEB("OhmReceiver::receiver: starting\n");
+    vector<unsigned char> buf(65536);
+    int64_t lastlisten = nowms();
+    while (!stopreq) {
+        if (nowms() - lastlisten >= listenIntervalMs) {
+            sendMsg(OHM_LISTEN, string());
+            lastlisten = nowms();
+        }
+        if (waitReadable(udpfd, pollMs) <= 0)
+            continue;
+        ssize_t n = recv(udpfd, &buf[0], buf.size(), 0);
+        if (n <= 0)
+            continue;
+        if (checkMsg("Ohm ", &buf[0], n) == OHM_AUDIO) {
+            handleAudio(&buf[0] + msgHeaderSize, n - msgHeaderSize);
+        }
+    }
+    LOGDEB("OhmReceiver::receiver: exiting\n");
+}
+
+void OhmReceiver::Internal::handleAudio(const unsigned char *buf, size_t len)
+{
+    if (len < audioHeaderSize || buf[0] < audioHeaderSize)
+        return;
+    unsigned int hdrlen = buf[0];
+    unsigned int flags = buf[1];
+    unsigned int samples = getbe16(buf + 2);
+    unsigned int frame = getbe32(buf + 4);
+    unsigned int srate = getbe32(buf + 36);
+    unsigned int sbits = buf[46];
+    unsigned int schans = buf[47];
+    unsigned int codeclen = buf[49];
+    if (hdrlen + codeclen > len)
+        return;
+    string codec((const char *)buf + hdrlen, codeclen);
+    if (codec.find("PCM") != 0) {
+        LOGDEB("OhmReceiver: unsupported codec [" << codec << "]\n");
+        return;
+    }
+    unsigned int bps = sbits / 8;
+    if (bps == 0 || bps > 4 || schans == 0)
+        return;
+    const unsigned char *data = buf + hdrlen + codeclen;
+    size_t datalen = samples * schans * bps;
+    if (data + datalen > buf + len)
+        return;
+
+    {
+        unique_lock<mutex> lock(mmutex);
+        if (!formatset || srate != rate || sbits != bits ||
+            schans != channels) {
+            if (formatset) {
+                LOGERR("OhmReceiver: audio format change, clients will "
+                       "need to reconnect\n");
+            }
+            rate = srate;
+            bits = sbits;
+            channels = schans;
+            formatset = true;
+            cond.notify_all();
+        }
+    }
+
+    // Network order to WAV little-endian
+    string le;
+    le.resize(datalen);
+    for (size_t i = 0; i < datalen; i += bps) {
+        for (unsigned int j = 0; j < bps; j++) {
+            le[i + j] = data[i + bps - 1 - j];
+        }
+    }
+
+    // Reorder. The frame numbers start over when the Sender is
+    // restarted: resync after a long silence, or if we are sent
+    // frames from far back (a Halt normally tells us, see below).
+    int64_t now = nowms();
+    if (havenext && (now - lastframems > receivingTimeoutMs ||
+                     int(frame - nextframe) < -int(maxPendingFrames))) {
+        LOGDEB("OhmReceiver: resyncing: expected frame " << nextframe <<
+               " got " << frame << endl);
+        havenext = false;
+    }
+    lastframems = now;
+    if (!havenext) {
+        nextframe = frame;
+        resentfor = frame;
+        pending.clear();
+        havenext = true;
+    }
+    int delta = int(frame - nextframe);
+    if (delta < 0) {
+        // Duplicate or too late
+        return;
+    }
+    if (delta > 0) {
+        pending[frame].swap(le);
+        if (int(nextframe - resentfor) >= 0) {
+            requestResend(nextframe, frame);
+            resentfor = frame;
+        }
+        if (pending.size() <= maxPendingFrames)
+            return;
+        LOGDEB("OhmReceiver: giving up on frames " << nextframe << " to " <<
+               pending.begin()->first - 1 << endl);
+        nextframe = pending.begin()->first;
+    } else {
+        deliverFrame(le);
+        nextframe++;
+    }
+    for (auto it = pending.begin(); it != pending.end() &&
+             it->first == nextframe; it = pending.begin()) {
+        deliverFrame(it->second);
+        pending.erase(it);
+        nextframe++;
+    }
+    // Halt: last frame before the Sender stops. Whatever comes next
+    // starts a new sequence.
+    if ((flags & OHMAF_HALT) && int(nextframe - frame) > 0) {
+        LOGDEB("OhmReceiver: halt at frame " << frame << endl);
+        havenext = false;
+    }
+}
+
+void OhmReceiver::Internal::requestResend(unsigned int from, unsigned int to)
+{
+    unsigned int cnt = to - from;
+    if (cnt > maxResendFrames)
+        cnt = maxResendFrames;
+    LOGDEB1("OhmReceiver: resend " << cnt << " frames from " << from << endl);
+    string payload;
+    putbe32(payload, cnt);
+    for (unsigned int i = 0; i < cnt; i++) {
+        putbe32(payload, from + i);
+    }
+    sendMsg(OHM_RESEND, payload);
+}
+
+void OhmReceiver::Internal::deliverFrame(const string& data)
+{
+    unique_lock<mutex> lock(mmutex);
+    lastaudioms = nowms();
+    uint64_t avail = ringBytes - (wpos - rpos);
+    if (data.size() > avail) {
+        if (clientconnected) {
+            LOGDEB("OhmReceiver: buffer full, dropping data\n");
+            return;
+        }
+        // Nobody reading: drop the oldest data, keeping sample frames
+        // aligned.
+        uint64_t align = channels * (bits / 8);
+        uint64_t todrop = data.size() - avail;
+        todrop = ((todrop + align - 1) / align) * align;
+        rpos += todrop;
+    }
+    size_t off = wpos % ringBytes;
+    size_t first = min(data.size(), ringBytes - off);
+    memcpy(&ring[off], data.c_str(), first);
+    if (first < data.size())
+        memcpy(&ring[0], data.c_str() + first, data.size() - first);
+    wpos += data.size();
+    cond.notify_all();
+}
+
+bool OhmReceiver::Internal::setupHttp()
+{
+    lisfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (lisfd < 0) {
+        LOGERR("OhmReceiver: socket() failed, errno " << errno << endl);
+        return false;
+    }
+    int one = 1;
+    setsockopt(lisfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(httpport);
+    // The previous receiver may still be going away
+    for (int i = 0; ; i++) {
+        if (bind(lisfd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            break;
+        if (errno != EADDRINUSE || i == 20 || abortreq) {
+            LOGERR("OhmReceiver: bind() to port " << httpport <<
+                   " failed, errno " << errno << endl);
+            return false;
+        }
+        usleep(pollMs * 1000);
+    }
+    if (listen(lisfd, 5) < 0) {
+        LOGERR("OhmReceiver: listen() failed, errno " << errno << endl);
+        return false;
+    }
+    return true;
+}
+
+string OhmReceiver::Internal::wavHeader()
+{
+    // Endless stream: use the biggest possible sizes
+    unsigned int datasize = 0xffffffff - 36;
+    unsigned int blockalign = channels * (bits / 8);
+    string out("RIFF");
+    putle32(out, datasize + 36);
+    out += "WAVEfmt ";
+    putle32(out, 16);
+    putle16(out, 1);
+    putle16(out, channels);
+    putle32(out, rate);
+    putle32(out, rate * blockalign);
+    putle16(out, blockalign);
+    putle16(out, bits);
+    out += "data";
+    putle32(out, datasize);
+    return out;
+}
+
+void OhmReceiver::Internal::httpServer()
+{
+    LOGDEB("OhmReceiver::httpServer: starting\n");
+    while (!stopreq) {
+        if (waitReadable(lisfd, pollMs) <= 0)
+            continue;
+        int fd = accept(lisfd, 0, 0);
+        if (fd < 0)
+            continue;
+        serveClient(fd);
+        close(fd);
+    }
+    LOGDEB("OhmReceiver::httpServer: exiting\n");
+}
+
+void OhmReceiver::Internal::serveClient(int fd)
+{
+    // Read the request header. We don't look at it much: there is
+    // only one thing to serve.
+    string request;
+    char buf[1024];
+    int64_t deadline = nowms() + 2000;
+    while (request.find("\r\n\r\n") == string::npos) {
+        if (stopreq || nowms() > deadline || request.size() > 8192)
+            return;
+        if (waitReadable(fd, pollMs) <= 0)
+            continue;
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0)
+            return;
+        request.append(buf, n);
+    }
+    LOGDEB("OhmReceiver: HTTP request: " <<
+           request.substr(0, request.find("\r\n")) << endl);
+
+    // Timeout the sends so that we can check the stop request
+    struct timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = pollMs * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    unique_lock<mutex> lock(mmutex);
+    while (!formatset) {
+        if (stopreq)
+            return;
+        cond.wait_for(lock, chrono::milliseconds(pollMs));
+    }
+    string header("HTTP/1.0 200 OK\r\n"
+                  "Content-Type: audio/wav\r\n"
+                  "Connection: close\r\n\r\n");
+    if (request.find("HEAD") != 0)
+        header += wavHeader();
+    // Skip the older buffered data.
+    uint64_t blockalign = channels * (bits / 8);
+    uint64_t initial = ((uint64_t)rate * initialBufferMs / 1000) * blockalign;
+    if (wpos - rpos > initial)
+        rpos = wpos - initial;
+    clientconnected = true;
+    lock.unlock();
+    if (send(fd, header.c_str(), header.size(), MSG_NOSIGNAL) !=
+        (ssize_t)header.size() || request.find("HEAD") == 0) {
+        lock.lock();
+        clientconnected = false;
+        return;
+    }
+
+    lock.lock();
+    while (!stopreq) {
+        if (wpos == rpos) {
+            cond.wait_for(lock, chrono::milliseconds(pollMs));
+            // A new connection (e.g. MPD restarting the stream)
+            // replaces this one.
+            if (waitReadable(lisfd, 0) > 0)
+                break;
+            continue;
+        }
+        // Send directly from the ring. The writer does not touch
+        // the [rpos, wpos] region while we're connected.
+        size_t off = rpos % ringBytes;
+        size_t cnt = min(wpos - rpos, (uint64_t)(ringBytes - off));
+        const char *cp = &ring[off];
+        lock.unlock();
+        ssize_t n = send(fd, cp, cnt, MSG_NOSIGNAL);
+        lock.lock();
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                continue;
+            LOGDEB("OhmReceiver: HTTP client gone, errno " << errno << endl);
+            break;
+        }
+        rpos += n;
+    }
+    clientconnected = false;
+}
+
+#else // OHMRECEIVER_TEST ->
+
+// Test driver: play a synthetic unicast Sender on the loopback
+// interface, sending frames out of order and omitting one until it
+// is asked to resend it, then restarting the frame numbers after a
+// Halt and without one, and check the WAV stream from the HTTP
+// server.
+
+#include <stdio.h>
+#include <string.h>
+#include <poll.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "ohmreceiver.hxx"
+
+using namespace std;
+
+static const int httpport = 8799;
+static const unsigned int nframes = 10;
+static const unsigned int samplesperframe = 100;
+
+static string audioMsg(unsigned int frame, bool resent, bool halt = false)
+{
+    string payload;
+    payload += char(50);
+    payload += char((resent ? 8 : 0) | (halt ? 1 : 0));
+    payload += char(samplesperframe >> 8);
+    payload += char(samplesperframe & 0xff);
+    for (int i = 3; i >= 0; i--)
+        payload += char((frame >> (8 * i)) & 0xff);
+    // Timestamps, latency, sample start/total
+    payload += string(28, 0);
+    unsigned int rate = 44100;
+    for (int i = 3; i >= 0; i--)
+        payload += char((rate >> (8 * i)) & 0xff);
+    // bitrate, volume offset
+    payload += string(6, 0);
+    payload += char(16);
+    payload += char(2);
+    payload += char(0);
+    payload += char(4);
+    payload += "PCM ";
+    // The sample value is the global sample index, big-endian.
+    for (unsigned int i = 0; i < samplesperframe; i++) {
+        unsigned int v = (frame * samplesperframe + i) & 0xffff;
+        for (int c = 0; c < 2; c++) {
+            payload += char(v >> 8);
+            payload += char(v & 0xff);
+        }
+    }
+    string msg("Ohm ");
+    msg += char(1);
+    msg += char(3);
+    unsigned int len = 8 + payload.size();
+    msg += char(len >> 8);
+    msg += char(len & 0xff);
+    return msg + payload;
+}
+
+static int recvMsg(int fd, struct sockaddr_in *from, string& msg, int ms)
+{
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, ms) <= 0)
+        return -1;
+    char buf[2048];
+    socklen_t alen = sizeof(*from);
+    ssize_t n = recvfrom(fd, buf, sizeof(buf), 0, (struct sockaddr *)from,
+                         &alen);
+    if (n < 8 || memcmp(buf, "Ohm ", 4))
+        return -1;
+    msg.assign(buf, n);
+    return buf[5];
+}
+
+int main(int argc, char **argv)
+{
+    int sfd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("bind");
+        return 1;
+    }
+    socklen_t alen = sizeof(addr);
+    getsockname(sfd, (struct sockaddr *)&addr, &alen);
+    char uri[100];
+    sprintf(uri, "ohu://127.0.0.1:%d", ntohs(addr.sin_port));
+
+    OhmReceiver rcv(httpport);
+    if (!rcv.start(uri)) {
+        cerr << "start failed" << endl;
+        return 1;
+    }
+
+    // Wait for Join
+    struct sockaddr_in rcvaddr;
+    string msg;
+    int tp;
+    while ((tp = recvMsg(sfd, &rcvaddr, msg, 2000)) != 0) {
+        if (tp < 0) {
+            cerr << "No Join received" << endl;
+            return 1;
+        }
+    }
+    // Send frames, 6 before 5, omitting 4.
+    unsigned int order[] = {0, 1, 2, 3, 6, 5, 7, 8, 9};
+    for (unsigned int i = 0; i < sizeof(order) / sizeof(int); i++) {
+        string am = audioMsg(order[i], false);
+        sendto(sfd, am.c_str(), am.size(), 0, (struct sockaddr *)&rcvaddr,
+               sizeof(rcvaddr));
+    }
+    // Wait for a resend request for frame 4
+    bool resent = false;
+    while ((tp = recvMsg(sfd, &rcvaddr, msg, 2000)) >= 0) {
+        if (tp == 7 && msg.size() >= 16 && msg[15] == 4) {
+            string am = audioMsg(4, true);
+            sendto(sfd, am.c_str(), am.size(), 0, (struct sockaddr *)&rcvaddr,
+                   sizeof(rcvaddr));
+            resent = true;
+            break;
+        }
+    }
+    if (!resent) {
+        cerr << "No resend request" << endl;
+        return 1;
+    }
+    // The expected stream, in frame numbers
+    vector<unsigned int> expected;
+    for (unsigned int i = 0; i < nframes; i++)
+        expected.push_back(i);
+    // Halt, then the Sender restarts at 100. Then it restarts at 0
+    // without telling us.
+    vector<pair<unsigned int, bool> > restarts{{nframes, true}};
+    for (unsigned int i = 100; i < 105; i++)
+        restarts.push_back({i, false});
+    for (unsigned int i = 0; i < 5; i++)
+        restarts.push_back({i, false});
+    for (auto& fr : restarts) {
+        string am = audioMsg(fr.first, false, fr.second);
+        sendto(sfd, am.c_str(), am.size(), 0, (struct sockaddr *)&rcvaddr,
+               sizeof(rcvaddr));
+        expected.push_back(fr.first);
+    }
+
+    // Read the stream
+    int cfd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in haddr;
+    memset(&haddr, 0, sizeof(haddr));
+    haddr.sin_family = AF_INET;
+    haddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    haddr.sin_port = htons(httpport);
+    if (connect(cfd, (struct sockaddr *)&haddr, sizeof(haddr)) < 0) {
+        perror("connect");
+        return 1;
+    }
+    string req("GET /Songcast.wav HTTP/1.0\r\n\r\n");
+    send(cfd, req.c_str(), req.size(), 0);
+    string data;
+    size_t needed = expected.size() * samplesperframe * 4;
+    for (;;) {
+        struct pollfd pfd = {cfd, POLLIN, 0};
+        if (poll(&pfd, 1, 2000) <= 0)
+            break;
+        char buf[4096];
+        ssize_t n = recv(cfd, buf, sizeof(buf), 0);
+        if (n <= 0)
+            break;
+        data.append(buf, n);
+        string::size_type pos = data.find("\r\n\r\n");
+        if (pos != string::npos && data.size() >= pos + 4 + 44 + needed)
+            break;
+    }
+    string::size_type pos = data.find("\r\n\r\n");
+    if (pos == string::npos || data.compare(pos + 4, 4, "RIFF")) {
+        cerr << "Bad HTTP response" << endl;
+        return 1;
+    }
+    string audio = data.substr(pos + 4 + 44);
+    if (audio.size() < needed) {
+        cerr << "Short audio data: " << audio.size() << endl;
+        return 1;
+    }
+    for (unsigned int i = 0; i < expected.size() * samplesperframe; i++) {
+        const unsigned char *cp = (const unsigned char *)audio.c_str() + 4 * i;
+        unsigned int l = cp[0] | (cp[1] << 8);
+        unsigned int r = cp[2] | (cp[3] << 8);
+        unsigned int v = (expected[i / samplesperframe] * samplesperframe +
+                          i % samplesperframe) & 0xffff;
+        if (l != v || r != v) {
+            cerr << "Bad sample at " << i << ": " << l << " " << r <<
+                " expected " << v << endl;
+            return 1;
+        }
+    }
+    if (!rcv.receiving()) {
+        cerr << "receiving() is false" << endl;
+        return 1;
+    }
+    close(cfd);
+    cout << "Received " << expected.size() << " frames in order OK" << endl;
+    return 0;
+}
+
+#endif // OHMRECEIVER_TEST
@@ -0,0 +1,61 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _OHMRECEIVER_H_X_INCLUDED_
+#define _OHMRECEIVER_H_X_INCLUDED_
+
+#include <string>
+
+/**
+ * In-process Songcast receiver, an alternative to running sc2mpd in
+ * "mpd" mode.
+ *
+ * This joins the OHM (multicast) or OHU (unicast) audio stream from a
+ * Songcast Sender (resolving an OHZ zone URI first if needed),
+ * reorders the audio frames, asking for resends when some are
+ * missing, and stores the audio data in a ring buffer. A minimal
+ * HTTP server on localhost serves the data as an endless WAV
+ * stream, for MPD to play.
+ *
+ * There is one OhmReceiver object for each Play: start() is called
+ * once, and the receiver runs until the object is deleted.
+ */
+class OhmReceiver {
+public:
+    /** @param httpport the localhost port for MPD connections. */
+    OhmReceiver(int httpport);
+    ~OhmReceiver();
+
+    /** Resolve the Sender URI if it is an ohz one, then start
+     *  receiving and serving HTTP. This may block for timeosecs while
+     *  waiting for the zone resolution.
+     *  @return false if the URI could not be resolved, or the
+     *    sockets could not be set up. */
+    bool start(const std::string& uri, int timeosecs = 5);
+
+    /** Make a start() running in another thread return as soon as
+     *  possible. */
+    void abort();
+
+    /** start() succeeded and we have received audio data recently. */
+    bool receiving();
+
+    class Internal;
+private:
+    Internal *m;
+};
+
+#endif /* _OHMRECEIVER_H_X_INCLUDED_ */
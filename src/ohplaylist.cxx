@@ -24,6 +24,7 @@
 #include <functional>                   // for _Bind, bind, _1, _2
 #include <iostream>                     // for endl, etc
 #include <string>                       // for string, allocator, etc
+#include <unordered_set>                // for unordered_set
 #include <utility>                      // for pair
 #include <vector>                       // for vector
 
@@ -47,7 +48,8 @@ static const string sIdProduct("urn:av-openhome-org:serviceId:Playlist");
 // Playlist is the default oh service, so it's active when starting up
 OHPlaylist::OHPlaylist(UpMpd *dev, unsigned int cssleep)
     : OHService(sTpProduct, sIdProduct, dev),
-      m_active(true), m_cachedirty(false), m_mpdqvers(-1)
+      m_active(true), m_parked(false), m_cachedirty(false), m_mpdqvers(-1),
+      m_nextohid(1), m_idarraytoken(1)
 {
     dev->addActionMapping(this, "Play", 
                           bind(&OHPlaylist::play, this, _1, _2));
@@ -85,6 +87,8 @@ OHPlaylist::OHPlaylist(UpMpd *dev, unsigned int cssleep)
                           bind(&OHPlaylist::readList, this, _1, _2));
     dev->addActionMapping(this, "Insert",
                           bind(&OHPlaylist::insert, this, _1, _2));
+    dev->addActionMapping(this, "InsertList",
+                          bind(&OHPlaylist::insertList, this, _1, _2));
     dev->addActionMapping(this, "DeleteId",
                           bind(&OHPlaylist::deleteId, this, _1, _2));
     dev->addActionMapping(this, "DeleteAll",
@@ -100,11 +104,18 @@ OHPlaylist::OHPlaylist(UpMpd *dev, unsigned int cssleep)
     
     if ((dev->m_options & UpMpd::upmpdOhMetaPersist)) {
         dmcacheSetOpts(cssleep);
-        if (!dmcacheRestore(dev->getMetaCacheFn(), m_metacache)) {
+        if (!dmcacheRestore(dev->getMetaCacheFn(), m_metacache, &m_ohqueue)) {
             LOGERR("ohPlaylist: cache restore failed" << endl);
         } else {
             LOGDEB("ohPlaylist: cache restore done" << endl);
         }
+        // The mpd ids may be stale, mapIds() will check them.
+        for (auto it = m_ohqueue.begin(); it != m_ohqueue.end(); it++) {
+            m_mpd2oh[it->mpdid] = *it;
+            m_oh2mpd[it->ohid] = it->mpdid;
+            if (it->ohid >= m_nextohid)
+                m_nextohid = it->ohid + 1;
+        }
     }
 }
 
@@ -128,12 +139,12 @@ static string mpdstatusToTransportState(MpdStatus::State st)
 
 // The data format for id lists is an array of msb 32 bits ints
 // encoded in base64...
-static string translateIdArray(const vector<UpSong>& in)
+static string translateIdArray(const vector<OHIdEntry>& in)
 {
     string out1;
     string sdeb;
     for (auto us = in.begin(); us != in.end(); us++) {
-        unsigned int val = us->mpdid;
+        unsigned int val = us->ohid;
         if (val) {
             out1 += (unsigned char) ((val & 0xff000000) >> 24);
             out1 += (unsigned char) ((val & 0x00ff0000) >> 16);
@@ -146,12 +157,118 @@ static string translateIdArray(const vector<UpSong>& in)
     return base64_encode(out1);
 }
 
+// Compute the OpenHome ids for the current mpd queue. An entry keeps
+// its id if we know its mpd id (with the same uri). Else (e.g. mpd
+// restarted, or the queue was restored by re-inserting the songs), we
+// use the old id for the same uri at the same position, or else the
+// first unused old id for the uri, so that the control points see the
+// same id array as before. The remaining entries get new ids.
+// Returns true if the OpenHome queue changed.
+bool OHPlaylist::mapIds(const vector<UpSong>& vdata)
+{
+    vector<OHIdEntry> nqueue(vdata.size());
+    unordered_set<unsigned int> used;
+    bool allfound = true;
+    for (unsigned int i = 0; i < vdata.size(); i++) {
+        auto it = m_mpd2oh.find(vdata[i].mpdid);
+        if (it != m_mpd2oh.end() && it->second.uri == vdata[i].uri &&
+            used.insert(it->second.ohid).second) {
+            nqueue[i] = OHIdEntry(it->second.ohid, vdata[i].mpdid,
+                                  vdata[i].uri);
+        } else {
+            allfound = false;
+        }
+    }
+
+    if (!allfound) {
+        // Old ids by uri, in queue order
+        unordered_map<string, vector<unsigned int> > byuri;
+        for (auto it = m_ohqueue.begin(); it != m_ohqueue.end(); it++) {
+            byuri[it->uri].push_back(it->ohid);
+        }
+        for (unsigned int i = 0; i < vdata.size(); i++) {
+            if (nqueue[i].ohid != 0)
+                continue;
+            const string& uri = vdata[i].uri;
+            unsigned int ohid = 0;
+            if (i < m_ohqueue.size() && m_ohqueue[i].uri == uri &&
+                used.find(m_ohqueue[i].ohid) == used.end()) {
+                ohid = m_ohqueue[i].ohid;
+            } else {
+                auto bu = byuri.find(uri);
+                if (bu != byuri.end()) {
+                    for (auto id : bu->second) {
+                        if (used.find(id) == used.end()) {
+                            ohid = id;
+                            break;
+                        }
+                    }
+                }
+            }
+            if (ohid == 0) {
+                ohid = m_nextohid++;
+            }
+            used.insert(ohid);
+            nqueue[i] = OHIdEntry(ohid, vdata[i].mpdid, uri);
+        }
+    }
+
+    bool changed = nqueue.size() != m_ohqueue.size();
+    for (unsigned int i = 0; !changed && i < nqueue.size(); i++) {
+        changed = nqueue[i].ohid != m_ohqueue[i].ohid ||
+            nqueue[i].mpdid != m_ohqueue[i].mpdid ||
+            nqueue[i].uri != m_ohqueue[i].uri;
+    }
+    m_ohqueue.swap(nqueue);
+    m_mpd2oh.clear();
+    m_oh2mpd.clear();
+    for (auto it = m_ohqueue.begin(); it != m_ohqueue.end(); it++) {
+        m_mpd2oh[it->mpdid] = *it;
+        m_oh2mpd[it->ohid] = it->mpdid;
+    }
+    return changed;
+}
+
+// The mapping is normally refreshed by makestate(), which does not
+// run when nobody subscribed to our events. If a lookup fails and the
+// mpd queue changed since the last mapping (e.g. songs added by
+// another client), map again. Returns true if this was done.
+bool OHPlaylist::syncIds()
+{
+    if (!m_active || m_dev->getMpdStatusNoUpdate().qvers == m_mpdqvers)
+        return false;
+    string idarray;
+    return makeIdArray(idarray);
+}
+
+// OpenHome id for mpd song id, 0 if unknown
+unsigned int OHPlaylist::ohId(int mpdid)
+{
+    auto it = m_mpd2oh.find(mpdid);
+    if (it == m_mpd2oh.end() && syncIds())
+        it = m_mpd2oh.find(mpdid);
+    return it == m_mpd2oh.end() ? 0 : it->second.ohid;
+}
+
+// Mpd song id for OpenHome id, -1 if unknown
+int OHPlaylist::mpdId(unsigned int ohid)
+{
+    auto it = m_oh2mpd.find(ohid);
+    if (it == m_oh2mpd.end() && syncIds())
+        it = m_oh2mpd.find(ohid);
+    return it == m_oh2mpd.end() ? -1 : it->second;
+}
+
 bool OHPlaylist::makeIdArray(string& out)
 {
+    flushDeletes();
     //LOGDEB1("OHPlaylist::makeIdArray\n");
     const MpdStatus &mpds = m_dev->getMpdStatusNoUpdate();
 
-    if (mpds.qvers == m_mpdqvers) {
+    // If we're not active, the mpd queue belongs to another service
+    // (e.g. radio). Keep our ids as they were, we'll map them again
+    // when the queue is restored.
+    if (mpds.qvers == m_mpdqvers || !m_active) {
         out = m_idArrayCached;
         // Mpd queue did not change: no need to look at the metadata cache
         //LOGDEB("OHPlaylist::makeIdArray: mpd queue did not change" << endl);
@@ -159,7 +276,7 @@ bool OHPlaylist::makeIdArray(string& out)
         // the title may have changed with no indication from the
         // queue. Only do this if the metadata originated from mpd of
         // course...
-        if (mpds.songid != -1) {
+        if (m_active && mpds.songid != -1) {
             auto it = m_metacache.find(mpds.currentsong.uri);
             if (it != m_metacache.end() && 
                 it->second.find("<orig>mpd</orig>") != string::npos) {
@@ -179,16 +296,13 @@ bool OHPlaylist::makeIdArray(string& out)
         return false;
     }
 
-    m_idArrayCached = out = translateIdArray(vdata);
+    bool idschanged = mapIds(vdata);
+    out = translateIdArray(m_ohqueue);
+    if (out != m_idArrayCached)
+        m_idarraytoken++;
+    m_idArrayCached = out;
     m_mpdqvers = mpds.qvers;
 
-    // Don't perform metadata cache maintenance if we're not active
-    // (the mpd playlist belongs to e.g. the radio service). We would
-    // be destroying data which we may need later.
-    if (!m_active) {
-        return true;
-    }
-
     // Update metadata cache: entries not in the current list are not
     // valid any more. Also there may be entries which were added
     // through an MPD client and which don't know about, record the
@@ -229,9 +343,9 @@ bool OHPlaylist::makeIdArray(string& out)
     // If we added entries or there are some stale entries, the new
     // map differs, save it to cache
     if ((m_dev->m_options & UpMpd::upmpdOhMetaPersist) &&
-        (!m_metacache.empty() || m_cachedirty)) {
+        (!m_metacache.empty() || m_cachedirty || idschanged)) {
         LOGDEB("OHPlaylist::makeIdArray: saving metacache" << endl);
-        dmcacheSave(m_dev->getMetaCacheFn(), nmeta);
+        dmcacheSave(m_dev->getMetaCacheFn(), nmeta, m_ohqueue);
         m_cachedirty = false;
     }
     m_metacache = nmeta;
@@ -243,15 +357,20 @@ bool OHPlaylist::makestate(unordered_map<string, string> &st)
 {
     st.clear();
 
+    // Retry restoring the queue if this failed when we were activated
+    if (m_active && m_parked && unpark())
+        m_dev->getMpdStatus();
+
     const MpdStatus &mpds = m_dev->getMpdStatusNoUpdate();
 
     st["TransportState"] =  mpdstatusToTransportState(mpds.state);
     st["Repeat"] = SoapHelp::i2s(mpds.rept);
     st["Shuffle"] = SoapHelp::i2s(mpds.random);
-    st["Id"] = mpds.songid == -1 ? "0" : SoapHelp::i2s(mpds.songid);
+    // Map the ids first, the current song may be new
+    makeIdArray(st["IdArray"]);
+    st["Id"] = mpds.songid == -1 ? "0" : SoapHelp::i2s(ohId(mpds.songid));
     st["TracksMax"] = SoapHelp::i2s(tracksmax);
     st["ProtocolInfo"] = g_protocolInfo;
-    makeIdArray(st["IdArray"]);
 
     return true;
 }
@@ -269,22 +388,55 @@ void OHPlaylist::maybeWakeUp(bool ok)
         m_dev->loopWakeup();
 }
 
+// Name of the MPD stored playlist where the queue is kept while
+// another source is active.
+static const string o_parkname("upmpdcli-parked-Playlist");
+
+// Restore the parked queue. If this fails, the stored playlist is
+// still there, and we keep m_parked set to retry from makestate(),
+// rather than fall back to the (empty) m_mpdsavedstate queue.
+bool OHPlaylist::unpark()
+{
+    if (!m_dev->m_mpdcli->unparkState(o_parkname, m_mpdsavedstate)) {
+        LOGERR("OHPlaylist: could not restore the parked queue, "
+               "will retry" << endl);
+        return false;
+    }
+    m_parked = false;
+    m_mpdqvers = -1;
+    return true;
+}
+
 void OHPlaylist::setActive(bool onoff)
 {
+    flushDeletes();
     m_active = onoff;
     if (m_active) {
-        m_dev->m_mpdcli->clearQueue();
-        m_dev->m_mpdcli->restoreState(m_mpdsavedstate);
+        if (m_parked) {
+            unpark();
+        } else {
+            m_dev->m_mpdcli->clearQueue();
+            m_dev->m_mpdcli->restoreState(m_mpdsavedstate);
+            m_mpdsavedstate.queue.clear();
+        }
         refreshState();
         maybeWakeUp(true);
-    } else {
-        m_dev->m_mpdcli->saveState(m_mpdsavedstate, 0);
+    } else if (!m_parked) {
+        // Park the queue inside MPD if we can, this is much faster
+        // than reading and re-inserting it for big playlists. If
+        // we're still parked (failed unpark), the stored playlist is
+        // the real queue, keep it.
+        m_parked = m_dev->m_mpdcli->parkState(o_parkname, m_mpdsavedstate);
+        if (!m_parked) {
+            m_dev->m_mpdcli->saveState(m_mpdsavedstate, 0);
+        }
     }
 }
 
 int OHPlaylist::play(const SoapIncoming& sc, SoapOutgoing& data)
 {
     LOGDEB("OHPlaylist::play" << endl);
+    flushDeletes();
     if (!m_active && m_dev->m_ohpr) {
         m_dev->m_ohpr->iSetSourceIndexByName("Playlist");
     }
@@ -318,6 +470,7 @@ int OHPlaylist::stop(const SoapIncoming& sc, SoapOutgoing& data)
 int OHPlaylist::next(const SoapIncoming& sc, SoapOutgoing& data)
 {
     LOGDEB("OHPlaylist::next" << endl);
+    flushDeletes();
     bool ok = m_dev->m_mpdcli->next();
     maybeWakeUp(ok);
     return ok ? UPNP_E_SUCCESS : UPNP_E_INTERNAL_ERROR;
@@ -326,6 +479,7 @@ int OHPlaylist::next(const SoapIncoming& sc, SoapOutgoing& data)
 int OHPlaylist::previous(const SoapIncoming& sc, SoapOutgoing& data)
 {
     LOGDEB("OHPlaylist::previous" << endl);
+    flushDeletes();
     bool ok = m_dev->m_mpdcli->previous();
     maybeWakeUp(ok);
     return ok ? UPNP_E_SUCCESS : UPNP_E_INTERNAL_ERROR;
@@ -408,6 +562,7 @@ int OHPlaylist::seekSecondRelative(const SoapIncoming& sc, SoapOutgoing& data)
 int OHPlaylist::transportState(const SoapIncoming& sc, SoapOutgoing& data)
 {
     LOGDEB("OHPlaylist::transportState" << endl);
+    flushDeletes();
     const MpdStatus &mpds = m_dev->getMpdStatusNoUpdate();
     string tstate;
     switch(mpds.state) {
@@ -428,6 +583,7 @@ int OHPlaylist::transportState(const SoapIncoming& sc, SoapOutgoing& data)
 int OHPlaylist::seekId(const SoapIncoming& sc, SoapOutgoing& data)
 {
     LOGDEB("OHPlaylist::seekId" << endl);
+    flushDeletes();
     if (!m_active) {
         // If I'm not active, the ids in the playlist are those of
         // another service (e.g. radio). If I activate myself and
@@ -440,7 +596,8 @@ int OHPlaylist::seekId(const SoapIncoming& sc, SoapOutgoing& data)
     int id;
     bool ok = sc.get("Value", &id);
     if (ok) {
-        ok = m_dev->m_mpdcli->playId(id);
+        int mpdid = mpdId(id);
+        ok = mpdid != -1 && m_dev->m_mpdcli->playId(mpdid);
         maybeWakeUp(ok);
     }
     return ok ? UPNP_E_SUCCESS : UPNP_E_INTERNAL_ERROR;
@@ -450,6 +607,7 @@ int OHPlaylist::seekId(const SoapIncoming& sc, SoapOutgoing& data)
 int OHPlaylist::seekIndex(const SoapIncoming& sc, SoapOutgoing& data)
 {
     LOGDEB("OHPlaylist::seekIndex" << endl);
+    flushDeletes();
 
     // Unlike seekid, this should work as the indices are restored by
     // mpdcli restorestate
@@ -469,13 +627,15 @@ int OHPlaylist::seekIndex(const SoapIncoming& sc, SoapOutgoing& data)
 int OHPlaylist::id(const SoapIncoming& sc, SoapOutgoing& data)
 {
     LOGDEB("OHPlaylist::id" << endl);
+    flushDeletes();
     if (!m_active) {
         LOGERR("OHPlaylist::id: not active" << endl);
         return UPNP_E_INTERNAL_ERROR;
     }
 
     const MpdStatus &mpds = m_dev->getMpdStatusNoUpdate();
-    data.addarg("Value", mpds.songid == -1 ? "0" : SoapHelp::i2s(mpds.songid));
+    data.addarg("Value", mpds.songid == -1 ? "0" :
+                SoapHelp::i2s(ohId(mpds.songid)));
     return UPNP_E_SUCCESS;
 }
 
@@ -493,6 +653,7 @@ bool OHPlaylist::cacheFind(const string& uri, string& meta)
 // Returns a 800 fault code if the given id is not in the playlist. 
 int OHPlaylist::ohread(const SoapIncoming& sc, SoapOutgoing& data)
 {
+    flushDeletes();
     if (!m_active) {
         // See comment in seekId()
         LOGERR("OHPlaylist::read: not active" << endl);
@@ -503,7 +664,8 @@ int OHPlaylist::ohread(const SoapIncoming& sc, SoapOutgoing& data)
     LOGDEB("OHPlaylist::ohread id " << id << endl);
     UpSong song;
     if (ok) {
-        ok = m_dev->m_mpdcli->statSong(song, id, true);
+        int mpdid = mpdId(id);
+        ok = mpdid != -1 && m_dev->m_mpdcli->statSong(song, mpdid, true);
     }
     if (ok) {
         auto cached = m_metacache.find(song.uri);
@@ -535,6 +697,7 @@ int OHPlaylist::ohread(const SoapIncoming& sc, SoapOutgoing& data)
 // Any ids not in the playlist are ignored. 
 int OHPlaylist::readList(const SoapIncoming& sc, SoapOutgoing& data)
 {
+    flushDeletes();
     if (!m_active) {
         // See comment in seekId()
         LOGERR("OHPlaylist::readList: not active" << endl);
@@ -555,7 +718,8 @@ int OHPlaylist::readList(const SoapIncoming& sc, SoapOutgoing& data)
                 continue;
             }
             UpSong song;
-            if (!m_dev->m_mpdcli->statSong(song, id, true)) {
+            int mpdid = mpdId(id);
+            if (mpdid == -1 || !m_dev->m_mpdcli->statSong(song, mpdid, true)) {
                 LOGDEB("OHPlaylist::readList:stat failed for " << id << endl);
                 continue;
             }
@@ -590,6 +754,7 @@ int OHPlaylist::readList(const SoapIncoming& sc, SoapOutgoing& data)
 
 bool OHPlaylist::ireadList(const vector<int>& ids, vector<UpSong>& songs)
 {
+    flushDeletes();
     for (auto it = ids.begin(); it != ids.end(); it++) {
         UpSong song;
         if (!m_dev->m_mpdcli->statSong(song, *it, true)) {
@@ -611,6 +776,7 @@ bool OHPlaylist::ireadList(const vector<int>& ids, vector<UpSong>& songs)
 int OHPlaylist::insert(const SoapIncoming& sc, SoapOutgoing& data)
 {
     LOGDEB("OHPlaylist::insert" << endl);
+    flushDeletes();
     int afterid;
     string uri, metadata;
     bool ok = sc.get("AfterId", &afterid);
@@ -634,12 +800,17 @@ int OHPlaylist::insert(const SoapIncoming& sc, SoapOutgoing& data)
 
     LOGDEB("OHPlaylist::insert: afterid " << afterid << " Uri " <<
            uri << " Metadata " << metadata << endl);
+    int mpdafter = afterid == 0 ? 0 : mpdId(afterid);
+    if (mpdafter == -1) {
+        LOGERR("OHPlaylist::insert: unknown AfterId " << afterid << endl);
+        ok = false;
+    }
     if (ok) {
         int newid;
-        ok = insertUri(afterid, uri, metadata, &newid);
+        ok = insertUri(mpdafter, uri, metadata, &newid);
         if (ok) {
-            data.addarg("NewId", SoapHelp::i2s(newid));
-            LOGDEB("OHPlaylist::insert: new id: " << newid << endl);
+            data.addarg("NewId", SoapHelp::i2s(ohId(newid)));
+            LOGDEB("OHPlaylist::insert: new id: " << ohId(newid) << endl);
         }
     }
     maybeWakeUp(ok);
@@ -650,6 +821,7 @@ bool OHPlaylist::insertUri(int afterid, const string& uri,
                            const string& metadata, int *newid)
 {
     LOGDEB1("OHPlaylist::insertUri: " << uri << endl);
+    flushDeletes();
     if (!m_active) {
         LOGERR("OHPlaylist::insertUri: not active" << endl);
         return UPNP_E_INTERNAL_ERROR;
@@ -665,6 +837,9 @@ bool OHPlaylist::insertUri(int afterid, const string& uri,
         m_metacache[uri] = metadata;
         m_cachedirty = true;
         m_mpdqvers = -1;
+        OHIdEntry ent(m_nextohid++, id, uri);
+        m_mpd2oh[id] = ent;
+        m_oh2mpd[ent.ohid] = id;
         if (newid)
             *newid = id;
         return true;
@@ -673,6 +848,129 @@ bool OHPlaylist::insertUri(int afterid, const string& uri,
     return false;
 }
 
+// Extract the value of the first <tag> element in [start, end[
+static string elementValue(const string& in, const string& tag,
+                           string::size_type start, string::size_type end)
+{
+    string otag = "<" + tag + ">";
+    string::size_type pos = in.find(otag, start);
+    if (pos == string::npos || pos >= end)
+        return string();
+    pos += otag.size();
+    string::size_type cpos = in.find("</" + tag + ">", pos);
+    if (cpos == string::npos || cpos > end)
+        return string();
+    return SoapHelp::xmlUnquote(in.substr(pos, cpos - pos));
+}
+
+// Upmpdcli extension (not in the OpenHome spec): insert a list of
+// tracks with one call. This is much faster than calling Insert for
+// each track: the tracks are sent to mpd with command lists, and we
+// only update the metadata cache and wake up the event loop once.
+// The EntryList argument has the same format as the ReadList
+// output, minus the Ids:
+//
+//  <EntryList>
+//    <Entry>
+//      <Uri></Uri>
+//      <Metadata></Metadata>
+//    </Entry>
+//  </EntryList>
+//
+// The tracks are inserted in order after AfterId (0: at the
+// start). NewIdList gets the space separated new ids, one for each
+// entry, 0 for an entry which could not be inserted.
+int OHPlaylist::insertList(const SoapIncoming& sc, SoapOutgoing& data)
+{
+    LOGDEB("OHPlaylist::insertList" << endl);
+    flushDeletes();
+    int afterid;
+    string entries;
+    bool ok = sc.get("AfterId", &afterid);
+    ok = ok && sc.get("EntryList", &entries);
+    if (!ok) {
+        LOGERR("OHPlaylist::insertList: no AfterId or EntryList" << endl);
+        return UPNP_E_INVALID_PARAM;
+    }
+
+    if (!m_active) {
+        // Same as insert()
+        if (afterid == 0 && m_dev->m_ohpr) {
+            m_dev->m_ohpr->iSetSourceIndexByName("Playlist");
+        } else {
+            LOGERR("OHPlaylist::insertList: not active" << endl);
+            return UPNP_E_INTERNAL_ERROR;
+        }
+    }
+
+    vector<UpSong> songs;
+    vector<string> metas;
+    // Index in songs for each entry, or -1 if we could not parse it.
+    vector<int> sidx;
+    string::size_type pos = 0;
+    for (;;) {
+        pos = entries.find("<Entry>", pos);
+        if (pos == string::npos)
+            break;
+        string::size_type end = entries.find("</Entry>", pos);
+        if (end == string::npos)
+            break;
+        string uri = elementValue(entries, "Uri", pos, end);
+        string metadata = elementValue(entries, "Metadata", pos, end);
+        pos = end;
+        UpSong song;
+        if (uri.empty() || !uMetaToUpSong(metadata, &song)) {
+            LOGERR("OHPlaylist::insertList: bad entry: Uri [" << uri <<
+                   "] Metadata [" << metadata << "]" << endl);
+            sidx.push_back(-1);
+            continue;
+        }
+        song.uri = uri;
+        sidx.push_back(songs.size());
+        songs.push_back(song);
+        metas.push_back(metadata);
+    }
+    LOGDEB("OHPlaylist::insertList: afterid " << afterid << " " <<
+           sidx.size() << " entries" << endl);
+    if (sidx.size() > (unsigned int)tracksmax) {
+        LOGERR("OHPlaylist::insertList: too many entries" << endl);
+        return UPNP_E_INVALID_PARAM;
+    }
+
+    int mpdafter = afterid == 0 ? 0 : mpdId(afterid);
+    if (mpdafter == -1) {
+        LOGERR("OHPlaylist::insertList: unknown AfterId " << afterid << endl);
+        return UPNP_E_INTERNAL_ERROR;
+    }
+    vector<int> mpdids;
+    ok = m_dev->m_mpdcli->insertSongsAfterId(songs, mpdafter, &mpdids);
+    if (ok) {
+        string out;
+        for (unsigned int i = 0; i < sidx.size(); i++) {
+            unsigned int ohid = 0;
+            if (sidx[i] >= 0 && mpdids[sidx[i]] != -1) {
+                int id = mpdids[sidx[i]];
+                const UpSong& song = songs[sidx[i]];
+                m_metacache[song.uri] = metas[sidx[i]];
+                OHIdEntry ent(m_nextohid++, id, song.uri);
+                m_mpd2oh[id] = ent;
+                m_oh2mpd[ent.ohid] = id;
+                ohid = ent.ohid;
+            }
+            if (i)
+                out += " ";
+            out += SoapHelp::i2s(ohid);
+        }
+        m_cachedirty = true;
+        m_mpdqvers = -1;
+        data.addarg("NewIdList", out);
+    } else {
+        LOGERR("OHPlaylist::insertList: mpd error" << endl);
+    }
+    maybeWakeUp(ok);
+    return ok ? UPNP_E_SUCCESS : UPNP_E_INTERNAL_ERROR;
+}
+
 int OHPlaylist::deleteId(const SoapIncoming& sc, SoapOutgoing& data)
 {
     LOGDEB("OHPlaylist::deleteId" << endl);
@@ -683,23 +981,72 @@ int OHPlaylist::deleteId(const SoapIncoming& sc, SoapOutgoing& data)
     }
     int id;
     bool ok = sc.get("Value", &id);
+    int mpdid = ok ? mpdId(id) : -1;
+    if (mpdid == -1) {
+        LOGDEB("OHPlaylist::deleteId: unknown id " << id << endl);
+        ok = false;
+    }
     if (ok) {
-        const MpdStatus &mpds = m_dev->getMpdStatusNoUpdate();
-        if (mpds.songid == id) {
-            // MPD skips to the next track if the current one is removed,
-            // but I think it's better to stop in this case
-            m_dev->m_mpdcli->stop();
-        }
-        ok = m_dev->m_mpdcli->deleteId(id);
-        m_mpdqvers = -1;
+        // Control points often delete a selection with a burst of
+        // DeleteId calls. Queue the deletion, it will be sent to mpd
+        // with the others before anything looks at the queue.
+        m_pendingdeletes.push_back(mpdid);
+        m_oh2mpd.erase(id);
         maybeWakeUp(ok);
     }
     return ok ? UPNP_E_SUCCESS : UPNP_E_INTERNAL_ERROR;
 }
 
+// Apply the deletions queued by deleteId(). If the queue did not
+// change since we last read it, we know the song positions, and use
+// range deletes for contiguous songs. Else we delete by id. Either
+// way, this is one command list.
+void OHPlaylist::flushDeletes()
+{
+    if (m_pendingdeletes.empty())
+        return;
+    vector<int> ids;
+    ids.swap(m_pendingdeletes);
+    LOGDEB("OHPlaylist::flushDeletes: " << ids.size() << " ids" << endl);
+    const MpdStatus &mpds = m_dev->m_mpdcli->getStatus();
+    unordered_set<int> idset(ids.begin(), ids.end());
+    if (idset.find(mpds.songid) != idset.end()) {
+        // MPD skips to the next track if the current one is removed,
+        // but I think it's better to stop in this case
+        m_dev->m_mpdcli->stop();
+    }
+
+    // Ranges, from the end of the queue
+    vector<pair<unsigned int, unsigned int> > ranges;
+    if (mpds.qvers == m_mpdqvers) {
+        vector<unsigned int> positions;
+        for (unsigned int i = 0; i < m_ohqueue.size(); i++) {
+            if (idset.find(m_ohqueue[i].mpdid) != idset.end())
+                positions.push_back(i);
+        }
+        if (positions.size() == idset.size()) {
+            for (auto it = positions.rbegin(); it != positions.rend(); it++) {
+                if (!ranges.empty() && ranges.back().first == *it + 1) {
+                    ranges.back().first = *it;
+                } else {
+                    ranges.push_back(
+                        pair<unsigned int, unsigned int>(*it, *it + 1));
+                }
+            }
+        }
+    }
+    if (ranges.empty() || !m_dev->m_mpdcli->deletePosRanges(ranges)) {
+        if (!m_dev->m_mpdcli->deleteIds(ids)) {
+            LOGERR("OHPlaylist::flushDeletes: delete failed" << endl);
+        }
+    }
+    m_mpdqvers = -1;
+}
+
 int OHPlaylist::deleteAll(const SoapIncoming& sc, SoapOutgoing& data)
 {
     LOGDEB("OHPlaylist::deleteAll" << endl);
+    m_pendingdeletes.clear();
     if (!m_active && m_dev->m_ohpr) {
         m_dev->m_ohpr->iSetSourceIndexByName("Playlist");
     }
@@ -740,47 +1087,44 @@ bool OHPlaylist::iidArray(string& idarray, int *token)
 {
     LOGDEB("OHPlaylist::idArray (internal)" << endl);
     if (makeIdArray(idarray)) {
-        const MpdStatus &mpds = m_dev->getMpdStatusNoUpdate();
-        LOGDEB("OHPlaylist::idArray: qvers " << mpds.qvers << endl);
+        LOGDEB("OHPlaylist::idArray: token " << m_idarraytoken << endl);
         if (token)
-            *token = mpds.qvers;
+            *token = m_idarraytoken;
         return true;
     }
     return false;
 }
 
+// Map the mpd ids in the queue to uris. The queue may belong to
+// another service (e.g. receiver).
 bool OHPlaylist::urlMap(unordered_map<int, string>& umap)
 {
     //LOGDEB1("OHPlaylist::urlMap\n");
-    string sarray; 
-    if (iidArray(sarray, 0)) {
-        vector<int> ids;
-        if (ohplIdArrayToVec(sarray, &ids)) {
-            vector<UpSong> songs;
-            if (ireadList(ids, songs)) {
-                for (auto it = songs.begin(); it != songs.end(); it++) {
-                    umap[it->mpdid] = it->uri;
-                }
-                return true;
-            }
-        }
+    flushDeletes();
+    vector<UpSong> songs;
+    if (!m_dev->m_mpdcli->getQueueData(songs)) {
+        return false;
     }
-    return false;
+    for (auto it = songs.begin(); it != songs.end(); it++) {
+        umap[it->mpdid] = it->uri;
+    }
+    return true;
 }
 
 // Check if id array changed since last call (which returned a gen token)
 int OHPlaylist::idArrayChanged(const SoapIncoming& sc, SoapOutgoing& data)
 {
     LOGDEB("OHPlaylist::idArrayChanged" << endl);
-    int qvers;
-    bool ok = sc.get("Token", &qvers);
-    const MpdStatus &mpds = m_dev->getMpdStatusNoUpdate();
-    
-    LOGDEB("OHPlaylist::idArrayChanged: query qvers " << qvers << 
-           " mpd qvers " << mpds.qvers << endl);
+    int token;
+    bool ok = sc.get("Token", &token);
+    string idarray;
+    makeIdArray(idarray);
+
+    LOGDEB("OHPlaylist::idArrayChanged: query token " << token << 
+           " current " << m_idarraytoken << endl);
 
     // Bool indicating if array changed
-    int val = mpds.qvers == qvers;
+    int val = token != m_idarraytoken;
     data.addarg("Value", SoapHelp::i2s(val));
 
     return ok ? UPNP_E_SUCCESS : UPNP_E_INTERNAL_ERROR;
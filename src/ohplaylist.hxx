@@ -25,6 +25,7 @@
 #include "libupnpp/soaphelp.hxx"        // for SoapIncoming, SoapOutgoing
 
 #include "mpdcli.hxx"
+#include "ohmetacache.hxx"
 #include "ohservice.hxx"
 
 using namespace UPnPP;
@@ -36,7 +37,8 @@ public:
     bool cacheFind(const std::string& uri, std:: string& meta);
 
     // Internal non-soap versions of some of the interface for use by
-    // e.g. ohreceiver
+    // e.g. ohreceiver. These use mpd song ids, not OpenHome ids (except
+    // for iidArray()).
     bool insertUri(int afterid, const std::string& uri, 
                    const std::string& metadata, int *newid = 0);
     bool ireadList(const std::vector<int>&, std::vector<UpSong>&);
@@ -45,6 +47,9 @@ public:
 
     int iStop();
     void refreshState();
+    // Apply the queued DeleteIds. Called before anything reads the
+    // mpd status or queue.
+    void flushDeletes();
 
     // Source active ?
     void setActive(bool onoff);
@@ -70,6 +75,8 @@ private:
     int ohread(const SoapIncoming& sc, SoapOutgoing& data);
     int readList(const SoapIncoming& sc, SoapOutgoing& data);
     int insert(const SoapIncoming& sc, SoapOutgoing& data);
+    // upmpdcli extension: insert many tracks in one call
+    int insertList(const SoapIncoming& sc, SoapOutgoing& data);
     int deleteId(const SoapIncoming& sc, SoapOutgoing& data);
     int deleteAll(const SoapIncoming& sc, SoapOutgoing& data);
     int tracksMax(const SoapIncoming& sc, SoapOutgoing& data);
@@ -79,9 +86,17 @@ private:
 
     bool makeIdArray(std::string&);
     void maybeWakeUp(bool ok);
+    bool unpark();
+    bool mapIds(const std::vector<UpSong>& vdata);
+    bool syncIds();
+    unsigned int ohId(int mpdid);
+    int mpdId(unsigned int ohid);
 
     bool m_active;
     MpdState m_mpdsavedstate;
+    // The queue was parked in an MPD stored playlist when we were
+    // deactivated (else it's in m_mpdsavedstate)
+    bool m_parked;
     
     // Storage for song metadata, indexed by URL.  This used to be
     // indexed by song id, but this does not survive MPD restarts.
@@ -93,6 +108,22 @@ private:
     // queue version.
     int m_mpdqvers;
     std::string m_idArrayCached;
+
+    // OpenHome track ids. We don't show the mpd song ids, which start
+    // again from 0 when mpd restarts: the control points would see a
+    // new playlist and read it all again. The OpenHome ids are mapped
+    // to the mpd ones when we read the queue, and saved with the
+    // metadata cache.
+    // The queue, as of the last mapIds()
+    std::vector<OHIdEntry> m_ohqueue;
+    // mpd id -> entry, including the ones inserted since mapIds()
+    std::unordered_map<int, OHIdEntry> m_mpd2oh;
+    std::unordered_map<unsigned int, int> m_oh2mpd;
+    unsigned int m_nextohid;
+    // IdArray token, changed when the OpenHome id array changes.
+    int m_idarraytoken;
+    // Mpd ids from DeleteId, not yet deleted (see flushDeletes())
+    std::vector<int> m_pendingdeletes;
 };
 
 #endif /* _OHPLAYLIST_H_X_INCLUDED_ */
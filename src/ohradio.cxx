@@ -39,6 +39,8 @@
 #include "execmd.h"
 #include "ohproduct.hxx"
 #include "ohinfo.hxx"
+#include "streamcache.hxx"
+#include "icymeta.hxx"
 
 using namespace std;
 using namespace std::placeholders;
@@ -47,31 +49,80 @@ static const string sTpProduct("urn:av-openhome-org:service:Radio:1");
 static const string sIdProduct("urn:av-openhome-org:serviceId:Radio");
 
 struct RadioMeta {
-    RadioMeta(const string& t, const string& u, const string& au)
-        : title(t), uri(u), artUri(au) {
+    RadioMeta(const string& t, const string& u, const string& au,
+              bool pf = true)
+        : title(t), uri(u), artUri(au), prefetch(pf) {
     }
     string title;
     string uri;
     string artUri;
+    // ReadList entry, from the Uri element to the end. Computed once
+    // when the list is loaded.
+    string entry;
+    // Keep the stream URL translation current in the background. Only
+    // for the config file radios, the catalog file may be big.
+    bool prefetch;
 };
 
+// The channel list. The ids are the positions in the list. 0 is
+// reserved for the channel set by SetChannel.
 static vector<RadioMeta> o_radios;
+// IdArray and ChannelsMax values, and the IdArray token, computed
+// when the list changes.
+static string o_idarray;
+static string o_channelsmax;
+static int o_idarraytoken;
+
+static bool readRadios(const ConfSimple& conf, vector<RadioMeta>& radios);
+static void indexRadios();
+static string radioDidlMake(const string& title, const string& uri,
+                            const string& artUri);
+
+static int streamTTL(const ConfSimple& conf)
+{
+    int ttlsecs = 1200;
+    string value;
+    if (conf.get("radiostreamttl", value))
+        ttlsecs = atoi(value.c_str());
+    return ttlsecs;
+}
 
 OHRadio::OHRadio(UpMpd *dev)
     : OHService(sTpProduct, sIdProduct, dev), m_active(false),
-      m_id(0), m_songid(0), m_ok(false)
+      m_id(0), m_songid(0), m_havepython(false),
+      m_playtask([dev] () {dev->loopWakeup();}), m_playid(0), m_ok(false)
 {
-    // Need Python
+    // makestate() finishes the Play actions and gets the stream titles
+    m_pollalways = true;
+    // Python is only needed for the fallback stream URL fetching script
     string pypath;
-    if (!ExecCmd::which("python2", pypath)) {
-        LOGINF("OHRadio: python2 not found, no radio service will be created\n");
-        return;
-    }
-    if (!readRadios()) {
+    m_havepython = ExecCmd::which("python2", pypath);
+    if (!readRadios(*g_config, o_radios)) {
         LOGINF("OHRadio: readRadios() failed, no radio service will be created\n");
         return;
     }
+    indexRadios();
     m_ok = true;
+
+    // Translate the radio URLs in advance and keep them fresh, so
+    // that switching channels does not wait for the playlist fetches.
+    // Without Python, there is no fallback for the https URLs: let
+    // mpd try them as direct streams.
+    m_streamcache = shared_ptr<StreamCache>(
+        new StreamCache(streamTTL(*g_config), !m_havepython));
+    vector<string> urls;
+    for (unsigned int i = 1; i < o_radios.size(); i++) {
+        if (o_radios[i].prefetch)
+            urls.push_back(o_radios[i].uri);
+    }
+    m_streamcache->start(urls);
+
+    // Optionally read the stream titles from the ICY metadata
+    string value;
+    if (g_config->get("radioicymeta", value) && atoi(value.c_str())) {
+        m_icy = shared_ptr<IcyMeta>(
+            new IcyMeta([dev] () {dev->loopWakeup();}));
+    }
     
     dev->addActionMapping(this, "Channel",
                           bind(&OHRadio::channel, this, _1, _2));
@@ -107,30 +158,186 @@ OHRadio::OHRadio(UpMpd *dev)
                           bind(&OHRadio::transportState, this, _1, _2));
 }
 
-bool OHRadio::readRadios()
+// Get the value for an attribute in a M3U #EXTINF line or an XML tag.
+static string attrValue(const string& s, const string& nm)
+{
+    string::size_type pos = 0;
+    while ((pos = s.find(nm + "=\"", pos)) != string::npos) {
+        // Check that this is not the end of another attribute name
+        if (pos == 0 || s[pos-1] == ' ' || s[pos-1] == '\t') {
+            pos += nm.size() + 2;
+            string::size_type end = s.find('"', pos);
+            if (end == string::npos)
+                return string();
+            return s.substr(pos, end - pos);
+        }
+        pos += nm.size();
+    }
+    return string();
+}
+
+// Extended M3U: 
+//   #EXTINF:-1 tvg-logo="http://icon.png",Channel title
+//   http://channel/url
+static void readM3U(const string& data, vector<RadioMeta>& radios)
+{
+    vector<string> lines;
+    stringToTokens(data, lines, "\r\n");
+    string title, artUri;
+    for (auto& line : lines) {
+        string ln(line);
+        trimstring(ln);
+        if (ln.empty())
+            continue;
+        if (ln.find("#EXTINF:") == 0) {
+            // The title is after the first comma outside of quotes
+            bool inquote = false;
+            string::size_type comma = string::npos;
+            for (string::size_type i = 0; i < ln.size(); i++) {
+                if (ln[i] == '"') {
+                    inquote = !inquote;
+                } else if (ln[i] == ',' && !inquote) {
+                    comma = i;
+                    break;
+                }
+            }
+            title = comma == string::npos ? string() : ln.substr(comma + 1);
+            trimstring(title);
+            artUri = attrValue(ln.substr(0, comma), "tvg-logo");
+            if (artUri.empty())
+                artUri = attrValue(ln.substr(0, comma), "logo");
+        } else if (ln[0] != '#') {
+            radios.push_back(RadioMeta(title.empty() ? ln : title, ln,
+                                       artUri, false));
+            title.clear();
+            artUri.clear();
+        }
+    }
+}
+
+// OPML: <outline type="audio" text="Channel title" URL="http://url"
+//                image="http://icon.png"/>
+static void readOPML(const string& data, vector<RadioMeta>& radios)
+{
+    string::size_type pos = 0;
+    while ((pos = data.find("<outline", pos)) != string::npos) {
+        string::size_type end = data.find('>', pos);
+        if (end == string::npos)
+            break;
+        string tag = data.substr(pos, end - pos);
+        pos = end;
+        string uri = attrValue(tag, "URL");
+        if (uri.empty())
+            uri = attrValue(tag, "url");
+        if (uri.empty())
+            continue;
+        string title = attrValue(tag, "text");
+        if (title.empty())
+            title = attrValue(tag, "title");
+        radios.push_back(
+            RadioMeta(SoapHelp::xmlUnquote(title.empty() ? uri : title),
+                      SoapHelp::xmlUnquote(uri),
+                      SoapHelp::xmlUnquote(attrValue(tag, "image")), false));
+    }
+}
+
+// Read a channel catalog file, in M3U or OPML format.
+static bool readCatalog(const string& fn, vector<RadioMeta>& radios)
+{
+    string data, reason;
+    if (!file_to_string(fn, data, &reason)) {
+        LOGERR("OHRadio::readCatalog: can't read " << fn << ": " << reason <<
+               endl);
+        return false;
+    }
+    unsigned int count = radios.size();
+    if (data.find("<opml") != string::npos) {
+        readOPML(data, radios);
+    } else {
+        readM3U(data, radios);
+    }
+    LOGINF("OHRadio::readCatalog: " << radios.size() - count <<
+           " channels in " << fn << endl);
+    return true;
+}
+
+static bool readRadios(const ConfSimple& conf, vector<RadioMeta>& radios)
 {
     // Id 0 means no selection
-    o_radios.push_back(RadioMeta("Unknown radio", "", ""));
+    radios.push_back(RadioMeta("Unknown radio", "", ""));
     
-    vector<string> allsubk = g_config->getSubKeys_unsorted();
+    vector<string> allsubk = conf.getSubKeys_unsorted();
     for (auto it = allsubk.begin(); it != allsubk.end(); it++) {
         LOGDEB("OHRadio::readRadios: subk " << *it << endl);
         if (it->find("radio ") == 0) {
             string uri, artUri;
             string title = it->substr(6);
-            bool ok = g_config->get("url", uri, *it);
-            g_config->get("artUrl", artUri, *it);
+            bool ok = conf.get("url", uri, *it);
+            conf.get("artUrl", artUri, *it);
             if (ok && !uri.empty()) {
-                o_radios.push_back(RadioMeta(title, uri, artUri));
+                radios.push_back(RadioMeta(title, uri, artUri));
                 LOGDEB("OHRadio::readRadios:RADIO: [" << title << "] uri [" <<
                        uri << "] artUri [" << artUri << "]\n");
             }
         }
     }
-    LOGDEB("OHRadio::readRadios: " << o_radios.size() << " radios found\n");
+
+    string catalog;
+    if (conf.get("radiolist", catalog) && !catalog.empty()) {
+        readCatalog(path_tildexpand(catalog), radios);
+    }
+    LOGDEB("OHRadio::readRadios: " << radios.size() << " radios found\n");
     return true;
 }
 
+// Find the position of the channel with the same title in the new
+// list, or 0 if it's gone.
+static unsigned int remapId(unsigned int id, const vector<RadioMeta>& radios)
+{
+    if (id == 0 || id >= o_radios.size())
+        return 0;
+    for (unsigned int i = 1; i < radios.size(); i++) {
+        if (radios[i].title == o_radios[id].title)
+            return i;
+    }
+    return 0;
+}
+
+void OHRadio::reconfigure(const ConfSimple& conf)
+{
+    vector<RadioMeta> radios;
+    if (!readRadios(conf, radios)) {
+        return;
+    }
+    // Keep the channel set by SetChannel
+    radios[0] = o_radios[0];
+
+    // The channel ids are positions in the list: the current channel
+    // keeps playing, but may need a new id.
+    unsigned int id = remapId(m_id, radios);
+    unsigned int playid = remapId(m_playid, radios);
+    if (m_playtask.pending() && (id == 0 || playid != id)) {
+        m_playtask.cancel();
+    }
+    if (id != m_id) {
+        LOGDEB("OHRadio::reconfigure: current channel id " << m_id << " -> "
+               << id << endl);
+    }
+    m_id = id;
+    m_playid = playid;
+    o_radios.swap(radios);
+    indexRadios();
+
+    vector<string> urls;
+    for (unsigned int i = 1; i < o_radios.size(); i++) {
+        if (o_radios[i].prefetch)
+            urls.push_back(o_radios[i].uri);
+    }
+    m_streamcache->reconfigure(urls, streamTTL(conf));
+    LOGINF("OHRadio: " << o_radios.size() - 1 << " channels after reload\n");
+    maybeWakeUp(true);
+}
+
 static string mpdstatusToTransportState(MpdStatus::State st)
 {
     string tstate;
@@ -151,34 +358,61 @@ static string mpdstatusToTransportState(MpdStatus::State st)
 // encoded in base64. The values could be anything, but, for us, they
 // are just the indices into o_radios(), beginning at 1 because 0 is
 // special (it's reserved in o_radios too).
-bool OHRadio::makeIdArray(string& out)
+//
+// The IdArray, and the ReadList entries, which are the costly
+// parts, are computed once when the list is loaded.
+static void indexRadios()
 {
-    //LOGDEB1("OHRadio::makeIdArray\n");
     string out1;
+    out1.reserve(4 * o_radios.size());
     for (unsigned int val = 1; val < o_radios.size(); val++) {
         out1 += (unsigned char) ((val & 0xff000000) >> 24);
         out1 += (unsigned char) ((val & 0x00ff0000) >> 16);
         out1 += (unsigned char) ((val & 0x0000ff00) >> 8);
         out1 += (unsigned char) ((val & 0x000000ff));
+
+        RadioMeta& radio = o_radios[val];
+        radio.entry = "</Id><Uri>";
+        radio.entry += SoapHelp::xmlQuote(radio.uri);
+        radio.entry += "</Uri><Metadata>";
+        radio.entry += SoapHelp::xmlQuote(
+            radioDidlMake(radio.title, radio.uri, radio.artUri));
+        radio.entry += "</Metadata></Entry>";
     }
-    out = base64_encode(out1);
-    return true;
+    o_idarray = base64_encode(out1);
+    o_channelsmax = SoapHelp::i2s(o_radios.size());
+    o_idarraytoken++;
 }
 
 bool OHRadio::makestate(unordered_map<string, string>& st)
 {
     st.clear();
 
-    MpdStatus mpds = m_dev->getMpdStatusNoUpdate();
+    // Finish a Play action if the stream URL is ready
+    bool fetchok;
+    string audiourl;
+    bool finished = m_playtask.collect(fetchok, audiourl);
+    if (finished) {
+        finishPlaying(fetchok, audiourl);
+    }
+
+    MpdStatus mpds = finished ? m_dev->getMpdStatus() :
+        m_dev->getMpdStatusNoUpdate();
 
-    st["ChannelsMax"] = SoapHelp::i2s(o_radios.size());
+    if (m_icy)
+        m_icy->collect(m_icytitle);
+
+    st["ChannelsMax"] = o_channelsmax;
     st["Id"] = SoapHelp::i2s(m_id);
-    makeIdArray(st["IdArray"]);
+    st["IdArray"] = o_idarray;
     if (m_active && m_id >= 0 && m_id < o_radios.size()) {
         if (mpds.currentsong.album.empty()) {
             mpds.currentsong.album = o_radios[m_id].title;
         }
         mpds.currentsong.artUri = o_radios[m_id].artUri;
+        if (!m_icytitle.empty()) {
+            mpds.currentsong.title = m_icytitle;
+        }
         string meta = didlmake(mpds.currentsong);
         st["Metadata"] =  meta;
         m_dev->m_ohif->setMetatext(meta);
@@ -189,7 +423,11 @@ bool OHRadio::makestate(unordered_map<string, string>& st)
         m_dev->m_ohif->setMetatext("");
     }
     st["ProtocolInfo"] = g_protocolInfo;
-    st["TransportState"] =  mpdstatusToTransportState(mpds.state);
+    if (m_playtask.pending()) {
+        st["TransportState"] = "Buffering";
+    } else {
+        st["TransportState"] =  mpdstatusToTransportState(mpds.state);
+    }
     st["Uri"] = mpds.currentsong.uri;
     return true;
 }
@@ -201,40 +439,81 @@ void OHRadio::maybeWakeUp(bool ok)
     }
 }
 
-int OHRadio::setPlaying()
+// Use the rdpl2stream Python code to get the audio stream
+// URL. This is the old method, only used as a fallback now.
+static bool fetchStreamWithScript(const string& uri, string& audiourl)
 {
-    if (m_id > o_radios.size() || o_radios[m_id].uri.empty()) {
-        LOGERR("OHRadio::setPlaying: called with bad id (" << m_id <<
-               ") or empty preset uri [" << o_radios[m_id].uri << "]\n");
-        return UPNP_E_INTERNAL_ERROR;
-    }
-    
     string cmdpath = path_cat(g_datadir, "rdpl2stream");
     cmdpath = path_cat(cmdpath, "fetchStream.py");
 
     // Execute the playlist parser
     ExecCmd cmd;
     vector<string> args;
-    args.push_back(o_radios[m_id].uri);
-    LOGDEB("OHRadio::setPlaying: exec: " << cmdpath << " " << args[0] << endl);
+    args.push_back(uri);
+    LOGDEB("OHRadio::fetchStreamWithScript: exec: " << cmdpath << " " <<
+           args[0] << endl);
     if (cmd.startExec(cmdpath, args, false, true) < 0) {
-        LOGDEB("OHRadio::setPlaying: startExec failed for " <<
+        LOGDEB("OHRadio::fetchStreamWithScript: startExec failed for " <<
                cmdpath << " " << args[0] << endl);
-        return UPNP_E_INTERNAL_ERROR;
+        return false;
     }
 
     // Read actual audio stream url
-    string audiourl;
     if (cmd.getline(audiourl, 10) < 0) {
-        LOGDEB("OHRadio::setPlaying: could not get audio url\n");
-        return UPNP_E_INTERNAL_ERROR;
+        LOGDEB("OHRadio::fetchStreamWithScript: could not get audio url\n");
+        return false;
     }
     trimstring(audiourl, "\r\n");
     if (audiourl.empty()) {
-        LOGDEB("OHRadio::setPlaying: audio url empty\n");
+        LOGDEB("OHRadio::fetchStreamWithScript: audio url empty\n");
+        return false;
+    }
+    return true;
+}
+
+// Start the Play action: the translation of the radio URL (usually
+// a playlist) to the actual audio stream URL can take a long time, so
+// it's done in a separate thread. We return immediately and the
+// TransportState is Buffering until it's done, and makestate() calls
+// finishPlaying().
+int OHRadio::setPlaying()
+{
+    if (m_id >= o_radios.size() || o_radios[m_id].uri.empty()) {
+        LOGERR("OHRadio::setPlaying: called with bad id (" << m_id <<
+               ") or empty preset uri\n");
         return UPNP_E_INTERNAL_ERROR;
     }
 
+    string uri = o_radios[m_id].uri;
+    shared_ptr<StreamCache> cache(m_streamcache);
+    bool havepython = m_havepython;
+    m_playid = m_id;
+    bool ok = m_playtask.start(
+        [uri, cache, havepython] (string& audiourl) -> bool {
+            if (cache->get(uri, audiourl, 10))
+                return true;
+            LOGDEB("OHRadio::setPlaying: native decoder failed for " <<
+                   uri << endl);
+            return havepython && fetchStreamWithScript(uri, audiourl);
+        });
+    return ok ? UPNP_E_SUCCESS : UPNP_E_INTERNAL_ERROR;
+}
+
+// Called from makestate() when the stream URL translation is done.
+void OHRadio::finishPlaying(bool ok, const string& audiourl)
+{
+    if (!m_active || m_playid != m_id || m_id >= o_radios.size()) {
+        // Can't happen, the task is cancelled when these change.
+        LOGDEB("OHRadio::finishPlaying: state changed, ignoring\n");
+        return;
+    }
+    if (!ok) {
+        LOGERR("OHRadio::finishPlaying: could not get audio url for " <<
+               o_radios[m_id].uri << endl);
+        return;
+    }
+    LOGDEB("OHRadio::finishPlaying: audio url " << audiourl << endl);
+
     // Send url to mpd
     //m_dev->m_mpdcli->clearQueue();
     UpSong song;
@@ -245,15 +524,28 @@ int OHRadio::setPlaying()
     m_songid = m_dev->m_mpdcli->insert(audiourl, 0, song);
     if (m_songid < 0) {
         m_songid = 0;
-        LOGDEB("OHRadio::setPlaying: mpd insert failed\n");
-        return UPNP_E_INTERNAL_ERROR;
+        LOGDEB("OHRadio::finishPlaying: mpd insert failed\n");
+        m_streamcache->invalidate(o_radios[m_id].uri);
+        return;
     }
     m_dev->m_mpdcli->single(true);
     if (!m_dev->m_mpdcli->play(0)) {
-        LOGDEB("OHRadio::setPlaying: mpd play failed\n");
-        return UPNP_E_INTERNAL_ERROR;
+        LOGDEB("OHRadio::finishPlaying: mpd play failed\n");
+        m_streamcache->invalidate(o_radios[m_id].uri);
+        return;
+    }
+    if (m_icy) {
+        m_icytitle.clear();
+        m_icy->start(audiourl);
+    }
+}
+
+void OHRadio::icyStop()
+{
+    if (m_icy) {
+        m_icy->stop();
+        m_icytitle.clear();
     }
-    return UPNP_E_SUCCESS;
 }
 
 void OHRadio::setActive(bool onoff) {
@@ -262,6 +554,8 @@ void OHRadio::setActive(bool onoff) {
         m_dev->m_mpdcli->clearQueue();
         maybeWakeUp(true);
     } else {
+        m_playtask.cancel();
+        icyStop();
         m_dev->m_mpdcli->clearQueue();
         m_songid = 0;
     }
@@ -281,6 +575,8 @@ int OHRadio::play(const SoapIncoming& sc, SoapOutgoing& data)
 int OHRadio::pause(const SoapIncoming& sc, SoapOutgoing& data)
 {
     LOGDEB("OHRadio::pause" << endl);
+    m_playtask.cancel();
+    icyStop();
     bool ok = m_dev->m_mpdcli->pause(true);
     maybeWakeUp(ok);
     return ok ? UPNP_E_SUCCESS : UPNP_E_INTERNAL_ERROR;
@@ -288,6 +584,8 @@ int OHRadio::pause(const SoapIncoming& sc, SoapOutgoing& data)
 
 int OHRadio::iStop()
 {
+    m_playtask.cancel();
+    icyStop();
     bool ok = m_dev->m_mpdcli->stop();
     maybeWakeUp(ok);
     return ok ? UPNP_E_SUCCESS : UPNP_E_INTERNAL_ERROR;
@@ -331,7 +629,7 @@ int OHRadio::setId(const SoapIncoming& sc, SoapOutgoing& data)
         LOGDEB("OHRadio::setId: no value ??\n");
         return UPNP_E_INTERNAL_ERROR;
     }
-    if (id <= 0 || id > int(o_radios.size())) {
+    if (id <= 0 || id >= int(o_radios.size())) {
         LOGDEB("OHRadio::setId: bad value " << id << endl);
         return UPNP_E_INTERNAL_ERROR;
     }
@@ -431,17 +729,12 @@ int OHRadio::readList(const SoapIncoming& sc, SoapOutgoing& data)
                 LOGDEB("OHRadio::readlist: bad id " << id << endl);
                 continue;
             }
-            string meta = metaForId(id);
             out += "<Entry><Id>";
             out += *it;
-            out += "</Id><Uri>";
-            out += SoapHelp::xmlQuote(o_radios[id].uri);
-            out += "</Uri><Metadata>";
-            out += SoapHelp::xmlQuote(meta);
-            out += "</Metadata></Entry>";
+            out += o_radios[id].entry;
         }
         out += "</ChannelList>";
-        LOGDEB("OHRadio::readList: out: [" << out << "]" << endl);
+        LOGDEB1("OHRadio::readList: out: [" << out << "]" << endl);
         data.addarg("ChannelList", out);
     }
     return ok ? UPNP_E_SUCCESS : UPNP_E_INTERNAL_ERROR;
@@ -452,13 +745,9 @@ int OHRadio::readList(const SoapIncoming& sc, SoapOutgoing& data)
 int OHRadio::idArray(const SoapIncoming& sc, SoapOutgoing& data)
 {
     LOGDEB("OHRadio::idArray" << endl);
-    string idarray;
-    if (makeIdArray(idarray)) {
-        data.addarg("Token", SoapHelp::i2s(1));
-        data.addarg("Array", idarray);
-        return UPNP_E_SUCCESS;
-    }
-    return UPNP_E_INTERNAL_ERROR;
+    data.addarg("Token", SoapHelp::i2s(o_idarraytoken));
+    data.addarg("Array", o_idarray);
+    return UPNP_E_SUCCESS;
 }
 
 int OHRadio::seekSecondAbsolute(const SoapIncoming& sc, SoapOutgoing& data)
@@ -498,33 +787,32 @@ int OHRadio::transportState(const SoapIncoming& sc, SoapOutgoing& data)
     LOGDEB("OHRadio::transportState" << endl);
     const MpdStatus& mpds = m_dev->getMpdStatusNoUpdate();
     string tstate;
-    switch (mpds.state) {
-    case MpdStatus::MPDS_PLAY:
-        tstate = "Playing";
-        break;
-    case MpdStatus::MPDS_PAUSE:
-        tstate = "Paused";
-        break;
-    default:
-        tstate = "Stopped";
+    if (m_playtask.pending()) {
+        tstate = "Buffering";
+    } else {
+        tstate = mpdstatusToTransportState(mpds.state);
     }
     data.addarg("Value", tstate);
     return UPNP_E_SUCCESS;
 }
 
 // Check if id array changed since last call (which returned a gen
-// token). Our array never changes
+// token). The array changes when the configuration is reloaded.
 int OHRadio::idArrayChanged(const SoapIncoming& sc, SoapOutgoing& data)
 {
     LOGDEB("OHRadio::idArrayChanged" << endl);
-    data.addarg("Value", SoapHelp::i2s(0));
-    return UPNP_E_SUCCESS;
+    int token;
+    bool ok = sc.get("Token", &token);
+    if (ok) {
+        data.addarg("Value", SoapHelp::i2s(token != o_idarraytoken));
+    }
+    return ok ? UPNP_E_SUCCESS : UPNP_E_INTERNAL_ERROR;
 }
 
 int OHRadio::channelsMax(const SoapIncoming& sc, SoapOutgoing& data)
 {
     LOGDEB("OHRadio::channelsMax" << endl);
-    data.addarg("Value", SoapHelp::i2s(o_radios.size()));
+    data.addarg("Value", o_channelsmax);
     return UPNP_E_SUCCESS;
 }
 
@@ -17,6 +17,7 @@
 #ifndef _OHRADIO_H_X_INCLUDED_
 #define _OHRADIO_H_X_INCLUDED_
 
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -25,8 +26,12 @@
 #include "libupnpp/soaphelp.hxx"
 #include "mpdcli.hxx"
 #include "ohservice.hxx"
+#include "bgtask.hxx"
 
 class UpMpd;
+class StreamCache;
+class IcyMeta;
+class ConfSimple;
 
 using namespace UPnPP;
 
@@ -34,8 +39,7 @@ class OHRadio : public OHService {
 public:
     OHRadio(UpMpd *dev);
 
-    // We can only offer this if Python is available because of the
-    // stream uri fetching script. This is checked during construction.
+    // Set during construction, false if the radio list could not be read.
     bool ok() {return m_ok;}
     
     int iStop();
@@ -43,6 +47,10 @@ public:
     // Source active ?
     void setActive(bool onoff);
 
+    // Update the channel list and stream cache parameters after a
+    // configuration file change.
+    void reconfigure(const ConfSimple& conf);
+
 protected:
     bool makestate(std::unordered_map<std::string, std::string>& st);
     
@@ -65,9 +73,9 @@ private:
     int transportState(const SoapIncoming& sc, SoapOutgoing& data);
 
     std::string metaForId(unsigned int id);
-    bool readRadios();
     int setPlaying();
-    bool makeIdArray(std::string&);
+    void finishPlaying(bool ok, const std::string& audiourl);
+    void icyStop();
     void maybeWakeUp(bool ok);
 
     bool m_active;
@@ -75,6 +83,18 @@ private:
     unsigned int m_id; 
     // MPD song id for the radio uri, or 0
     int m_songid;
+    // python2 found: we can use the rdpl2stream script as fallback
+    bool m_havepython;
+    // Radio URL to audio stream URL translations
+    std::shared_ptr<StreamCache> m_streamcache;
+    // Stream URL translation for the current Play action. The mpd
+    // part is done by makestate() when it's done.
+    BgTask m_playtask;
+    // Channel id for the pending translation
+    unsigned int m_playid;
+    // Stream title reader, if enabled, and last title
+    std::shared_ptr<IcyMeta> m_icy;
+    std::string m_icytitle;
 
     bool m_ok;
 };
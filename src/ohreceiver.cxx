@@ -18,6 +18,7 @@
 #include "ohreceiver.hxx"
 
 #include <stdlib.h>                     // for atoi
+#include <time.h>                       // for time
 
 #include <upnp/upnp.h>                  // for UPNP_E_SUCCESS, etc
 
@@ -35,6 +36,8 @@
 #include "upmpdutils.hxx"               // for didlmake, diffmaps, etc
 #include "ohplaylist.hxx"
 #include "ohproduct.hxx"
+#include "ohmreceiver.hxx"
+#include "execwatch.hxx"
 
 using namespace std;
 using namespace std::placeholders;
@@ -44,8 +47,12 @@ static const string sIdProduct("urn:av-openhome-org:serviceId:Receiver");
 
 OHReceiver::OHReceiver(UpMpd *dev, const OHReceiverParams& parms)
     : OHService(sTpProduct, sIdProduct, dev), m_active(false),
+      m_connecttask([dev] () {dev->loopWakeup();}), m_connectdeadline(0),
+      m_cmdexited(false),
       m_httpport(parms.httpport), m_sc2mpdpath(parms.sc2mpdpath), m_pm(parms.pm)
 {
+    // makestate() finishes the Play actions and watches the player
+    m_pollalways = true;
     dev->addActionMapping(this, "Play", 
                           bind(&OHReceiver::play, this, _1, _2));
     dev->addActionMapping(this, "Stop", 
@@ -63,13 +70,32 @@ OHReceiver::OHReceiver(UpMpd *dev, const OHReceiverParams& parms)
         "/Songcast.wav";
 }
 
+// Max time for sc2mpd to connect in mpd mode
+static const int connecttimeo = 15;
+
 static const string o_protocolinfo("ohz:*:*:*,ohm:*:*:*,ohu:*.*.*");
 
 bool OHReceiver::makestate(unordered_map<string, string> &st)
 {
-    if (m_pm == OHReceiverParams::OHRP_MPD) {
-        const MpdStatus &mpds = m_dev->getMpdStatusNoUpdate();
-        if (m_cmd && mpds.state != MpdStatus::MPDS_PLAY && 
+    if (m_pm != OHReceiverParams::OHRP_ALSA) {
+        // Finish a Play action if sc2mpd (or the internal receiver)
+        // is ready
+        bool connok;
+        string line;
+        bool finished = m_connecttask.collect(connok, line);
+        if (finished) {
+            finishPlay(connok);
+        } else if (m_cmd && m_connecttask.pending() &&
+                   time(0) >= m_connectdeadline) {
+            LOGERR("OHReceiver: mpd mode: sc2mpd still not ready "
+                   "to play after " << connecttimeo << " seconds\n");
+            finishPlay(false);
+            finished = true;
+        }
+        const MpdStatus &mpds = finished ? m_dev->getMpdStatus() :
+            m_dev->getMpdStatusNoUpdate();
+        if ((m_cmd || m_ohmrcv) && !m_connecttask.pending() &&
+            mpds.state != MpdStatus::MPDS_PLAY && 
             mpds.state != MpdStatus::MPDS_PAUSE) {
             // playing was stopped through ohplaylist or
             // avtransport. I'm not sure we're supposed to let this
@@ -77,13 +103,10 @@ bool OHReceiver::makestate(unordered_map<string, string> &st)
             iStop();
         }
     } else {
-        if (m_cmd) {
-            int status;
-            if (m_cmd->maybereap(&status)) {
-                LOGDEB("OHReceiver: sc2cmd exited with status " << status
-                       << endl);
-                m_cmd = shared_ptr<ExecCmd>(new ExecCmd());
-            }
+        if (m_cmd && m_cmdexited) {
+            // The process was reaped by the watcher
+            m_cmdexited = false;
+            m_cmd = shared_ptr<ExecCmd>(new ExecCmd());
         }
     }
 
@@ -91,24 +114,58 @@ bool OHReceiver::makestate(unordered_map<string, string> &st)
 
     st["Uri"] = m_uri;
     st["Metadata"] = m_metadata;
-    // Allowed states: Stopped, Playing,Waiting, Buffering
-    // We won't receive a Stop action if we are not Playing. So we
-    // are playing as long as we have a subprocess
-    if (m_cmd)
-        st["TransportState"] = "Playing";
-    else 
-        st["TransportState"] = "Stopped";
+    st["TransportState"] = tpstate();
     st["ProtocolInfo"] = o_protocolinfo;
     return true;
 }
 
+// Allowed states: Stopped, Playing,Waiting, Buffering
+// We won't receive a Stop action if we are not Playing. So we
+// are playing as long as we have a subprocess, except while
+// waiting for it to connect. The internal receiver tells us if
+// data is actually coming.
+string OHReceiver::tpstate()
+{
+    if (m_connecttask.pending())
+        return "Waiting";
+    if (m_ohmrcv)
+        return m_ohmrcv->receiving() ? "Playing" : "Buffering";
+    if (m_cmd)
+        return "Playing";
+    return "Stopped";
+}
+
 void OHReceiver::maybeWakeUp(bool ok)
 {
     if (ok && m_dev)
         m_dev->loopWakeup();
 }
 
-bool OHReceiver::iPlay()
+// In mpd mode, sc2mpd may take some time to connect to the sender,
+// and we don't want to block the action, so we just start waiting
+// for it in a separate thread here, then return. finishPlay() is
+// called from makestate() when the wait is over. In alsa mode, there
+// is nothing to wait for.
+bool OHReceiver::iPlay(bool wait)
+{
+    bool ok = iStartPlay();
+    if (!ok || !wait || !m_connecttask.pending())
+        return ok;
+
+    // Synchronous call: we need the stream to be inserted and
+    // played by the current MPD, do it now instead of in makestate().
+    bool connok = false;
+    string line;
+    if (!m_connecttask.wait(connecttimeo) ||
+        !m_connecttask.collect(connok, line)) {
+        LOGERR("OHReceiver::play: receiver still not ready "
+               "to play after " << connecttimeo << " seconds\n");
+        connok = false;
+    }
+    return finishPlay(connok);
+}
+
+bool OHReceiver::iStartPlay()
 {
     bool ok = false;
 
@@ -125,15 +182,14 @@ bool OHReceiver::iPlay()
         return false;
     }
 
-    int id = -1;
-    unordered_map<int, string> urlmap;
-    string line;
-        
     // We start the songcast command to receive the audio flux and either
     // export it as HTTP (then insert http URI at the front of the
     // queue and execute next/play), or play it directly to the sound card
-    if (m_cmd)
-        m_cmd->zapChild();
+    zapCmd();
+    m_ohmrcv = shared_ptr<OhmReceiver>();
+    if (m_pm == OHReceiverParams::OHRP_INTERNAL) {
+        return iPlayInternal();
+    }
     m_cmd = shared_ptr<ExecCmd>(new ExecCmd());
     vector<string> args;
     if (m_pm == OHReceiverParams::OHRP_ALSA) {
@@ -156,45 +212,104 @@ bool OHReceiver::iPlay()
         LOGDEB("OHReceiver::play: sc2mpd pid "<< m_cmd->getChildPid()<< endl);
     }
 
-    if (m_pm == OHReceiverParams::OHRP_MPD) {
-        m_dev->m_mpdcli->stop();
-
-        // Wait for sc2mpd to signal ready, then play.
-        // sc2mpd writes a single line to stdout "CONNECTED" when
-        // it gets there, which should be more or less instantaneous
-        int timeo = 15;
-        if (m_cmd->getline(line, timeo) < 0) {
-            LOGERR("OHReceiver: mpd mode: sc2mpd still not ready to play after "
-                   << timeo << " seconds\n");
-            goto out;
-        }
-        LOGDEB("OHReceiver: sc2mpd sent: " << line);
-        // And insert the appropriate uri in the mpd playlist
-        if (!m_dev->m_ohpl->urlMap(urlmap)) {
-            LOGERR("OHReceiver::play: urlMap() failed" <<endl);
-            goto out;
-        }
-        for (auto it = urlmap.begin(); it != urlmap.end(); it++) {
-            if (it->second == m_httpuri) {
-                id = it->first;
-            }
-        }
-        if (id == -1) {
-            ok = m_dev->m_ohpl->insertUri(0, m_httpuri,
-                                          SoapHelp::xmlUnquote(m_metadata),&id);
-            if (!ok) {
-                LOGERR("OHReceiver::play: insertUri() failed\n");
-                goto out;
-            }
+    // The process output and exit are monitored by the ExecWatch
+    // thread. In mpd mode, wait for sc2mpd to signal ready: it writes
+    // a single line to stdout "CONNECTED" when it gets there, which
+    // should be more or less instantaneous. makestate() enforces the
+    // timeout.
+    {
+        BgTask::Done done;
+        if (m_pm == OHReceiverParams::OHRP_MPD) {
+            m_dev->m_mpdcli->stop();
+            done = m_connecttask.startDone();
+            m_connectdeadline = time(0) + connecttimeo;
         }
+        m_cmdexited = false;
+        UpMpd *dev = m_dev;
+        ok = ExecWatch::getWatch()->add(
+            m_cmd,
+            [done] (const string& line) {
+                if (done) {
+                    LOGDEB("OHReceiver: sc2mpd sent: " << line);
+                    done(true, line);
+                }
+            },
+            [this, done, dev] (int status) {
+                LOGDEB("OHReceiver: sc2mpd exited with status " << status
+                       << endl);
+                if (done)
+                    done(false, string());
+                m_cmdexited = true;
+                dev->loopWakeup();
+            });
+    }
 
-        ok = m_dev->m_mpdcli->playId(id);
+out:
+    if (!ok) {
+        iStop();
+    }
+    return ok;
+}
+
+// Internal mode: start our own receiver, which will serve the audio
+// to mpd on the same local URL as sc2mpd. Starting may need to
+// resolve the zone URI, so it's done in the background too.
+bool OHReceiver::iPlayInternal()
+{
+    m_dev->m_mpdcli->stop();
+    m_ohmrcv = shared_ptr<OhmReceiver>(new OhmReceiver(m_httpport));
+    shared_ptr<OhmReceiver> rcv(m_ohmrcv);
+    string uri(m_uri);
+    bool ok = m_connecttask.start(
+        [rcv, uri] (string&) -> bool {
+            return rcv->start(uri);
+        },
+        [rcv] () {
+            rcv->abort();
+        });
+    if (!ok) {
+        iStop();
+    }
+    return ok;
+}
+
+// mpd and internal modes: sc2mpd is connected (or failed), play its
+// stream.
+bool OHReceiver::finishPlay(bool ok)
+{
+    int id = -1;
+    unordered_map<int, string> urlmap;
+
+    if (!ok || (!m_cmd && !m_ohmrcv)) {
+        goto out;
+    }
+
+    // Insert the appropriate uri in the mpd playlist
+    if (!m_dev->m_ohpl->urlMap(urlmap)) {
+        LOGERR("OHReceiver::play: urlMap() failed" <<endl);
+        ok = false;
+        goto out;
+    }
+    for (auto it = urlmap.begin(); it != urlmap.end(); it++) {
+        if (it->second == m_httpuri) {
+            id = it->first;
+        }
+    }
+    if (id == -1) {
+        ok = m_dev->m_ohpl->insertUri(0, m_httpuri,
+                                      SoapHelp::xmlUnquote(m_metadata),&id);
         if (!ok) {
-            LOGERR("OHReceiver::play: play() failed\n");
+            LOGERR("OHReceiver::play: insertUri() failed\n");
             goto out;
         }
     }
 
+    ok = m_dev->m_mpdcli->playId(id);
+    if (!ok) {
+        LOGERR("OHReceiver::play: play() failed\n");
+        goto out;
+    }
+
 out:
     if (!ok) {
         iStop();
@@ -212,15 +327,25 @@ int OHReceiver::play(const SoapIncoming& sc, SoapOutgoing& data)
     return ok ? UPNP_E_SUCCESS : UPNP_E_INTERNAL_ERROR;
 }
 
-bool OHReceiver::iStop()
+// Cancel any connection wait, and get rid of the sc2mpd process
+void OHReceiver::zapCmd()
 {
-    LOGDEB("OHReceiver::iStop()\n");
+    m_connecttask.cancel();
     if (m_cmd) {
+        // After this, the watcher won't touch the command any more
+        ExecWatch::getWatch()->remove(m_cmd);
         m_cmd->zapChild();
         m_cmd = shared_ptr<ExecCmd>();
     }
+}
+
+bool OHReceiver::iStop()
+{
+    LOGDEB("OHReceiver::iStop()\n");
+    zapCmd();
+    m_ohmrcv = shared_ptr<OhmReceiver>();
 
-    if (m_pm == OHReceiverParams::OHRP_MPD) {
+    if (m_pm != OHReceiverParams::OHRP_ALSA) {
         m_dev->m_mpdcli->stop();
         unordered_map<int, string> urlmap;
         // Remove our bogus URi from the playlist
@@ -261,7 +386,7 @@ bool OHReceiver::iSetSender(const string& uri, const string& metadata)
     // current playing. We probably should not receive this if we're
     // not in the stopped state, but just in case...
     if (m_uri.compare(uri) || m_metadata.compare(metadata)) {
-        if (m_cmd)
+        if (m_cmd || m_ohmrcv)
             iStop();
         m_uri = uri;
         m_metadata = metadata;
@@ -296,10 +421,7 @@ int OHReceiver::transportState(const SoapIncoming& sc, SoapOutgoing& data)
 {
     LOGDEB("OHReceiver::transportState" << endl);
 
-    // Allowed states: Stopped, Playing,Waiting, Buffering
-    // We won't receive a Stop action if we are not Playing. So we
-    // are playing as long as we have a subprocess
-    string tstate = m_cmd ? "Playing" : "Stopped";
+    string tstate = tpstate();
     data.addarg("Value", tstate);
     LOGDEB("OHReceiver::transportState: " << tstate << endl);
     return UPNP_E_SUCCESS;
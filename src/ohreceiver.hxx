@@ -17,6 +17,9 @@
 #ifndef _OHRECEIVER_H_X_INCLUDED_
 #define _OHRECEIVER_H_X_INCLUDED_
 
+#include <time.h>                       // for time_t
+
+#include <atomic>
 #include <string>                       // for string
 #include <unordered_map>                // for unordered_map
 #include <vector>                       // for vector
@@ -27,14 +30,18 @@
 
 #include "ohservice.hxx"
 #include "execmd.h"
+#include "bgtask.hxx"
 
 using namespace UPnPP;
 class UpMpd;
 class OHPlaylist;
 class OHProduct;
+class OhmReceiver;
 
 struct OHReceiverParams {
-    enum PlayMethod {OHRP_MPD, OHRP_ALSA};
+    // OHRP_INTERNAL: use our own Songcast receiver (ohmreceiver.hxx)
+    // instead of sc2mpd, and play through MPD.
+    enum PlayMethod {OHRP_MPD, OHRP_ALSA, OHRP_INTERNAL};
     PlayMethod pm;
     int httpport;
     std::string sc2mpdpath;
@@ -46,7 +53,10 @@ public:
     OHReceiver(UpMpd *dev, const OHReceiverParams& parms);
 
     bool iStop();
-    bool iPlay();
+    // If wait is set, the connection wait and the mpd part are
+    // done before returning (used by the sender code, which switches
+    // MPD right after).
+    bool iPlay(bool wait = false);
     bool iSetSender(const std::string& uri, const std::string& meta);
     OHReceiverParams::PlayMethod playMethod() {return m_pm;}
 
@@ -66,6 +76,11 @@ private:
     int transportState(const SoapIncoming& sc, SoapOutgoing& data);
 
     void maybeWakeUp(bool ok);
+    bool iStartPlay();
+    bool iPlayInternal();
+    bool finishPlay(bool ok);
+    void zapCmd();
+    std::string tpstate();
 
     // Current
     std::string m_uri;
@@ -73,6 +88,14 @@ private:
 
     bool   m_active;
     std::shared_ptr<ExecCmd> m_cmd;
+    // Internal receiver, replaces m_cmd in internal mode
+    std::shared_ptr<OhmReceiver> m_ohmrcv;
+    // mpd mode: waiting for sc2mpd to connect, the mpd part of the
+    // Play action is done by makestate() after this.
+    BgTask m_connecttask;
+    time_t m_connectdeadline;
+    // Set by the ExecWatch thread when sc2mpd exits
+    std::atomic<bool> m_cmdexited;
     int m_httpport;
     std::string m_sc2mpdpath;
     std::string m_httpuri;
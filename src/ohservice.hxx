@@ -31,7 +31,8 @@ using namespace UPnPP;
 class OHService : public UPnPProvider::UpnpService {
 public:
     OHService(const std::string& servtp, const std::string &servid, UpMpd *dev)
-        : UpnpService(servtp, servid, dev), m_dev(dev) {
+        : UpnpService(servtp, servid, dev), m_dev(dev), m_subscribed(false),
+          m_pollalways(false) {
     }
     virtual ~OHService() { }
 
@@ -44,6 +45,14 @@ protected:
     // State variable storage
     std::unordered_map<std::string, std::string> m_state;
     UpMpd *m_dev;
+    // A control point subscribed to our events. We don't see the
+    // unsubscriptions and expirations (libupnp handles them), so
+    // this stays set.
+    bool m_subscribed;
+    // makestate() must run on every pass, even with no subscribers,
+    // because it does more than computing the state (e.g. collecting
+    // background task results).
+    bool m_pollalways;
 };
 
 #endif /* _OHSERVICE_H_X_INCLUDED_ */
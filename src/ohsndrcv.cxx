@@ -17,6 +17,10 @@
 
 #include "ohsndrcv.hxx"
 
+#include <chrono>
+#include <exception>
+#include <thread>
+
 #include "libupnpp/log.hxx"
 #include "libupnpp/base64.hxx"
 
@@ -41,11 +45,14 @@ public:
     // ssender is an arbitrary script probably reading from an audio
     // driver input and managing a sender. Our local source or mpd are
     // uninvolved
-    Internal(UpMpd *dv, const string& starterpath, int port)
+    Internal(UpMpd *dv, const string& starterpath, int port, bool pstart)
         : dev(dv), mpd(0), origmpd(0), isender(0), ssender(0),
-          makeisendercmd(starterpath), mpdport(port) {
+          makeisendercmd(starterpath), mpdport(port), doprestart(pstart) {
+        if (dev)
+            friendlyname = dev->m_friendlyname;
     }
     ~Internal() {
+        waitPrestart();
         clear();
     }
     void clear() {
@@ -69,12 +76,103 @@ public:
     string imeta;
     string makeisendercmd;
     int mpdport;
+    string friendlyname;
+    // Start the internal sender in advance, and restart it in the
+    // background if it was cleared.
+    bool doprestart;
+    thread prestarter;
+
+    bool startInternalSender(bool extvol);
+    void prestart();
+    void waitPrestart();
 };
 
 
-SenderReceiver::SenderReceiver(UpMpd *dev, const string& starterpath, int port)
+// Read the output from a just started sender script.
+static bool readSenderDetails(ExecCmd *sndcmd, string& uri, string& meta)
 {
-    m = new Internal(dev, starterpath, port);
+    string output;
+    if (sndcmd->getline(output) <= 0) {
+        LOGERR("SenderReceiver::start: makesender command failed\n");
+        return false;
+    }
+    LOGDEB("SenderReceiver::start got [" << output << "] from script\n");
+
+    // Output is like [Ok mpdport URI base64-encoded-uri METADATA b64-meta]
+    // mpdport is bogus, but present, for ext scripts
+    vector<string> toks;
+    stringToTokens(output, toks);
+    if (toks.size() != 6 || toks[0].compare("Ok")) {
+        LOGERR("SenderReceiver::start: bad output from script: " << output
+               << endl);
+        return false;
+    }
+    uri = base64_decode(toks[3]);
+    meta = base64_decode(toks[5]);
+    return true;
+}
+
+// Start the script which creates the fifo MPD and the Sender, and
+// connect to the new MPD. This may run in the prestart thread, so
+// we only touch our own data here (not dev), and clean up after
+// ourselves on failure.
+bool SenderReceiver::Internal::startInternalSender(bool extvol)
+{
+    isender = new ExecCmd();
+    vector<string> args;
+    args.push_back("-p");
+    args.push_back(SoapHelp::i2s(mpdport));
+    args.push_back("-f");
+    args.push_back(friendlyname);
+    if (extvol) args.push_back("-e");
+    isender->startExec(makeisendercmd, args, false, true);
+    if (!readSenderDetails(isender, iuri, imeta)) {
+        deleteZ(isender);
+        return false;
+    }
+
+    // Connect to the new MPD
+    mpd = new MPDCli("localhost", mpdport);
+    if (!mpd || !mpd->ok()) {
+        LOGERR("SenderReceiver::start: can't connect to new MPD\n");
+        deleteZ(mpd);
+        deleteZ(isender);
+        return false;
+    }
+    return true;
+}
+
+void SenderReceiver::Internal::prestart()
+{
+    waitPrestart();
+    if (!doprestart || isender)
+        return;
+    bool extvol = dev->m_mpdcli &&
+        dev->m_mpdcli->getStatus().externalvolumecontrol;
+    try {
+        prestarter = thread([this, extvol] () {
+                LOGDEB("SenderReceiver: starting sender in advance\n");
+                if (!startInternalSender(extvol)) {
+                    LOGERR("SenderReceiver: sender prestart failed\n");
+                }
+            });
+    } catch (const std::exception& ex) {
+        LOGERR("SenderReceiver: could not start thread: " << ex.what()
+               << endl);
+    }
+}
+
+void SenderReceiver::Internal::waitPrestart()
+{
+    if (prestarter.joinable())
+        prestarter.join();
+}
+
+SenderReceiver::SenderReceiver(UpMpd *dev, const string& starterpath, int port,
+                               bool prestart)
+{
+    m = new Internal(dev, starterpath, port, prestart);
+    m->prestart();
 }
 
 SenderReceiver::~SenderReceiver()
@@ -89,11 +187,25 @@ static bool copyMpd(MPDCli *src, MPDCli *dest, int seekms)
         LOGERR("copyMpd: src or dest is null\n");
         return false;
     }
+    // The queue is read once from the source, and sent to the
+    // destination with batched command lists (see
+    // MPDCli::appendSongs()), then the status (position, volume...)
+    // is restored.
+    chrono::steady_clock::time_point t0 = chrono::steady_clock::now();
     MpdState st;
-    src->saveState(st, seekms);
-    LOGERR("copyMpd:" << st.status.externalvolumecontrol << endl);
-    LOGERR("copyMpd:" << st.status.onvolumechange << endl);
-    return src->saveState(st, seekms) && dest->restoreState(st);
+    if (!src->saveState(st, seekms)) {
+        LOGERR("copyMpd: saveState failed\n");
+        return false;
+    }
+    chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+    bool ok = dest->restoreState(st);
+    chrono::steady_clock::time_point t2 = chrono::steady_clock::now();
+    LOGINF("copyMpd: " << st.queue.size() << " songs, read " <<
+           chrono::duration_cast<chrono::milliseconds>(t1 - t0).count() <<
+           " mS, restore " <<
+           chrono::duration_cast<chrono::milliseconds>(t2 - t1).count() <<
+           " mS" << (ok ? "" : " (failed)") << endl);
+    return ok;
 }
 
 // If script is empty, we are using an internal source and aux mpd +
@@ -110,83 +222,45 @@ bool SenderReceiver::start(const string& script, int seekms)
         return false;
     }
     
+    // Wait for the background start of the internal sender if it's
+    // still running
+    m->waitPrestart();
+
     // Stop MPD Play (normally already done)
     m->dev->m_mpdcli->stop();
     // test if external volume control is activated
-    MpdState st;
-    m->dev->m_mpdcli->saveState(st, 0);
-    // sndcmd will non empty if we actually started a script instead
-    // of reusing an old one (then need to read the initial data).
-    ExecCmd *sndcmd = 0;
-    if (script.empty() && !m->isender) {
-        // Internal source, first time: Start fifo MPD and Sender
-        m->isender = sndcmd = new ExecCmd();
-        vector<string> args;
-        args.push_back("-p");
-        args.push_back(SoapHelp::i2s(m->mpdport));
-        args.push_back("-f");
-        args.push_back(m->dev->m_friendlyname);
-	if (st.status.externalvolumecontrol) args.push_back("-e");
-        m->isender->startExec(m->makeisendercmd, args, false, true);
-    } else if (!script.empty()) {
-        // External source. ssender should already be zero, we delete
-        // it just in case
-        deleteZ(m->ssender);
-        m->ssender = sndcmd = new ExecCmd();
-        vector<string> args;
-        args.push_back("-f");
-        args.push_back(m->dev->m_friendlyname);
-        if (st.status.externalvolumecontrol) args.push_back("-e");
-        m->ssender->startExec(script, args, false, true);
-    }
+    bool extvol = m->dev->m_mpdcli->getStatus().externalvolumecontrol;
 
     string meta, uri;
-    if (sndcmd) {
-        // Just started internal or external sender script, need to read the
-        // details
-        string output;
-        if (sndcmd->getline(output) <= 0) {
-            LOGERR("SenderReceiver::start: makesender command failed\n");
-            m->clear();
-            return false;
-        }
-        LOGDEB("SenderReceiver::start got [" << output << "] from script\n");
-
-        // Output is like [Ok mpdport URI base64-encoded-uri METADATA b64-meta]
-        // mpdport is bogus, but present, for ext scripts
-        vector<string> toks;
-        stringToTokens(output, toks);
-        if (toks.size() != 6 || toks[0].compare("Ok")) {
-            LOGERR("SenderReceiver::start: bad output from script: " << output
-                   << endl);
+    if (script.empty()) {
+        // Internal source: start fifo MPD and Sender, the first time
+        if (!m->isender && !m->startInternalSender(extvol)) {
             m->clear();
             return false;
         }
-        uri = base64_decode(toks[3]);
-        meta = base64_decode(toks[5]);
-        if (script.empty()) {
-            m->iuri = uri;
-            m->imeta = meta;
-        }
-    } else {
-        // Reusing internal source
         uri = m->iuri;
         meta = m->imeta;
-    }
-    
-    if (sndcmd && script.empty()) {
-        // Just started the internal source script, connect to the new MPD
-        m->mpd = new MPDCli("localhost", m->mpdport);
-        if (!m->mpd || !m->mpd->ok()) {
-            LOGERR("SenderReceiver::start: can't connect to new MPD\n");
+    } else {
+        // External source. ssender should already be zero, we delete
+        // it just in case
+        deleteZ(m->ssender);
+        m->ssender = new ExecCmd();
+        vector<string> args;
+        args.push_back("-f");
+        args.push_back(m->dev->m_friendlyname);
+        if (extvol) args.push_back("-e");
+        m->ssender->startExec(script, args, false, true);
+        if (!readSenderDetails(m->ssender, uri, meta)) {
             m->clear();
             return false;
         }
     }
     
-    // Start our receiver
+    // Start our receiver. This has to be complete (stream inserted
+    // and playing in the current MPD) before we switch to the aux
+    // one, so don't let the receiver finish asynchronously.
     if (!m->dev->m_ohrcv->iSetSender(uri, meta) ||
-        !m->dev->m_ohrcv->iPlay()) {
+        !m->dev->m_ohrcv->iPlay(true)) {
         m->clear();
         return false;
     }
@@ -222,5 +296,9 @@ bool SenderReceiver::stop()
 
     // We don't reuse external source processes
     deleteZ(m->ssender);
+
+    // Have an internal sender ready for next time if it was cleared
+    // after an error
+    m->prestart();
     return true;
 }
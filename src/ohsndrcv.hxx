@@ -45,8 +45,11 @@ class UpMpd;
 
 class SenderReceiver {
 public:
+    // If prestart is set, the internal sender and auxiliary mpd are
+    // started in the background right away instead of on the first
+    // start() call.
     SenderReceiver(UpMpd *dev, const std::string& senderstarterpath,
-                   int mpdport);
+                   int mpdport, bool prestart = false);
     ~SenderReceiver();
 
     // script can be empty when using an internal source (radio or
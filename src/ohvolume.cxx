@@ -101,7 +101,6 @@ int OHVolume::setVolume(const SoapIncoming& sc, SoapOutgoing& data)
         return UPNP_E_INVALID_PARAM;
     }
     m_dev->m_rdctl->setvolume_i(volume);
-    m_dev->loopWakeup();
     return UPNP_E_SUCCESS;
 }
 
@@ -123,7 +122,6 @@ int OHVolume::volumeInc(const SoapIncoming& sc, SoapOutgoing& data)
     if (newvol > 100)
         newvol = 100;
     m_dev->m_rdctl->setvolume_i(newvol);
-    m_dev->loopWakeup();
     return UPNP_E_SUCCESS;
 }
 
@@ -134,7 +132,6 @@ int OHVolume::volumeDec(const SoapIncoming& sc, SoapOutgoing& data)
     if (newvol < 0)
         newvol = 0;
     m_dev->m_rdctl->setvolume_i(newvol);
-    m_dev->loopWakeup();
     return UPNP_E_SUCCESS;
 }
 
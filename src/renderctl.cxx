@@ -20,6 +20,7 @@
 #include <stdlib.h>                     // for atoi
 #include <upnp/upnp.h>                  // for UPNP_E_INVALID_PARAM, etc
 
+#include <chrono>                       // for steady_clock
 #include <functional>                   // for _Bind, bind, _1, _2
 #include <iostream>                     // for basic_ostream::operator<<, etc
 #include <map>                          // for _Rb_tree_const_iterator, etc
@@ -43,11 +44,20 @@ static const string
 sTpRender("urn:schemas-upnp-org:service:RenderingControl:1");
 static const string sIdRender("urn:upnp-org:serviceId:RenderingControl");
 
-static const int minVolumeDelta = 5;
+// Minimum interval between two volume changes actually sent to mpd
+// (and to the onvolumechange command). Knob-turning control points
+// can send tens of requests per second.
+static const int volumeApplyIntervalMs = 250;
+
+static int64_t nowms()
+{
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
 
 UpMpdRenderCtl::UpMpdRenderCtl(UpMpd *dev, bool noev)
     : UpnpService(sTpRender, sIdRender, dev, noev), m_dev(dev), 
-      m_desiredvolume(-1)
+      m_desiredvolume(-1), m_lastvolapplyms(0), m_subscribed(false)
 {
     m_dev->addActionMapping(this, "SetMute", 
                             bind(&UpMpdRenderCtl::setMute, this, _1, _2));
@@ -99,10 +109,16 @@ bool UpMpdRenderCtl::getEventData(bool all, std::vector<std::string>& names,
 {
     //LOGDEB("UpMpdRenderCtl::getEventDataRendering. desiredvolume " << 
     //		   m_desiredvolume << (all?" all " : "") << endl);
-    if (m_desiredvolume >= 0) {
-        m_dev->m_mpdcli->setVolume(m_desiredvolume);
-        m_desiredvolume = -1;
-    }
+    // Apply the end value of a volume burst. If we're still inside
+    // the rate limiting interval, this will happen on the next pass,
+    // and the event reports the desired value anyway.
+    flushvolume(false);
+
+    // Nothing more to do if nobody ever subscribed (see OHService)
+    if (m_dev->isSubscription(all))
+        m_subscribed = true;
+    if (!m_subscribed)
+        return true;
 
     unordered_map<string, string> newstate;
     rdstateMToU(newstate);
@@ -179,29 +195,40 @@ int UpMpdRenderCtl::getvolume_i()
         m_dev->m_mpdcli->getVolume();
 }
 
+void UpMpdRenderCtl::applyvolume(int volume)
+{
+    m_dev->m_mpdcli->setVolume(volume);
+    m_lastvolapplyms = nowms();
+}
+
+bool UpMpdRenderCtl::flushvolume(bool force)
+{
+    if (m_desiredvolume < 0)
+        return false;
+    if (!force && nowms() - m_lastvolapplyms < volumeApplyIntervalMs)
+        return false;
+    int volume = m_desiredvolume;
+    m_desiredvolume = -1;
+    applyvolume(volume);
+    return true;
+}
+
 void UpMpdRenderCtl::setvolume_i(int volume)
 {
-    int previous_volume = m_dev->m_mpdcli->getVolume();
-    int delta = previous_volume - volume;
-    if (delta < 0)
-        delta = -delta;
-    LOGDEB("UpMpdRenderCtl::setVolume: volume " << volume << " delta " << 
-           delta << endl);
-    if (delta >= minVolumeDelta) {
-        m_dev->m_mpdcli->setVolume(volume);
-        m_desiredvolume = -1;
-    } else {
-        m_desiredvolume = volume;
+    LOGDEB("UpMpdRenderCtl::setVolume: volume " << volume << endl);
+    m_desiredvolume = volume;
+    // Apply and event now if we have not done so recently. Else the
+    // value will be picked up by the event loop, which will also
+    // event the change (only once for the whole burst).
+    if (flushvolume(false)) {
+        m_dev->loopWakeup();
     }
 }
 
 void UpMpdRenderCtl::setmute_i(bool onoff)
 {
     if (onoff) {
-        if (m_desiredvolume >= 0) {
-            m_dev->m_mpdcli->setVolume(m_desiredvolume);
-            m_desiredvolume = -1;
-        }
+        flushvolume(true);
         m_dev->m_mpdcli->setVolume(0, true);
     } else {
         // Restore pre-mute
@@ -237,7 +264,7 @@ int UpMpdRenderCtl::getMute(const SoapIncoming& sc, SoapOutgoing& data)
         return UPNP_E_INVALID_PARAM;
     }
 
-    int volume = m_dev->m_mpdcli->getVolume();
+    int volume = getvolume_i();
     data.addarg("CurrentMute", volume == 0 ? "1" : "0");
     return UPNP_E_SUCCESS;
 }
@@ -263,8 +290,6 @@ int UpMpdRenderCtl::setVolume(const SoapIncoming& sc, SoapOutgoing& data, bool i
     }
 	
     setvolume_i(volume);
-
-    m_dev->loopWakeup();
     return UPNP_E_SUCCESS;
 }
 
@@ -304,7 +329,9 @@ int UpMpdRenderCtl::selectPreset(const SoapIncoming& sc, SoapOutgoing& data)
 
     // Well there is only the volume actually...
     int volume = 50;
-    m_dev->m_mpdcli->setVolume(volume);
+    m_desiredvolume = -1;
+    applyvolume(volume);
+    m_dev->loopWakeup();
 
     return UPNP_E_SUCCESS;
 }
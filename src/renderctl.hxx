@@ -20,6 +20,7 @@
 #include <string>                       // for string
 #include <vector>                       // for vector
 #include <unordered_map>                // for unordered_map
+#include <cstdint>                      // for int64_t
 
 #include "libupnpp/device/device.hxx"   // for UpnpService
 #include "libupnpp/soaphelp.hxx"        // for SoapIncoming, SoapOutgoing
@@ -35,6 +36,8 @@ public:
     virtual bool getEventData(bool all, std::vector<std::string>& names, 
                               std::vector<std::string>& values);
     int getvolume_i();
+    // Request a volume change. This wakes up the event loop when the
+    // value is applied immediately, so callers don't need to.
     void setvolume_i(int volume);
     void setmute_i(bool onoff);
 private:
@@ -46,12 +49,24 @@ private:
     int listPresets(const SoapIncoming& sc, SoapOutgoing& data);
     int selectPreset(const SoapIncoming& sc, SoapOutgoing& data);
 
+    // Apply a pending volume value if any, and if the rate
+    // limiter allows it (or force is set). Returns true if mpd was called.
+    bool flushvolume(bool force);
+    void applyvolume(int volume);
+
     UpMpd *m_dev;
-    // Desired volume target. We may delay executing small volume
-    // changes to avoid saturating with small requests.
+    // Desired volume target, or -1. Volume changes are applied at
+    // most once per volumeApplyIntervalMs, intermediate values in
+    // a burst are coalesced and the last one is applied by the event
+    // loop. Reads always return this value if it is set.
     int m_desiredvolume;
+    // Time of last volume application (steady clock, mS)
+    int64_t m_lastvolapplyms;
     // State variable storage
     std::unordered_map<std::string, std::string> m_rdstate;
+    // A control point subscribed to our events (never reset, see
+    // OHService)
+    bool m_subscribed;
 };
 
 #endif /* _RENDERING_H_X_INCLUDED_ */
@@ -0,0 +1,228 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+
+#include "streamcache.hxx"
+
+#include <time.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <unordered_map>
+#include <vector>
+
+#include "libupnpp/log.hxx"
+
+#include "streamdecoder.hxx"
+
+using namespace std;
+using namespace UPnPP;
+
+// Interval between checks for translations needing a refresh.
+static const int checkIntervalSecs = 10;
+// Minimum interval between two background attempts for an URL which
+// could not be translated.
+static const int retryIntervalSecs = 120;
+// Network timeout for background translations
+static const int bgTimeoutSecs = 10;
+
+class StreamCache::Internal {
+public:
+    Internal(int ttl, bool https)
+        : ttlsecs(ttl), httpsdirect(https), stopreq(false) {
+    }
+
+    struct Entry {
+        Entry() : resolved(0), lastattempt(0) {}
+        std::string streamurl;
+        // Time of last successful translation, or 0
+        time_t resolved;
+        // Time of last background translation attempt
+        time_t lastattempt;
+    };
+
+    bool fresh(const Entry& e, time_t now) {
+        return e.resolved != 0 && now - e.resolved < ttlsecs;
+    }
+    // Refresh the translations which are past 3/4 of their lifetime.
+    bool needsRefresh(const Entry& e, time_t now) {
+        if (e.resolved != 0 && now - e.resolved < (ttlsecs * 3) / 4)
+            return false;
+        return e.lastattempt == 0 || now - e.lastattempt >= retryIntervalSecs;
+    }
+    void store(const string& url, const string& streamurl) {
+        Entry& e = entries[url];
+        e.streamurl = streamurl;
+        e.resolved = time(0);
+    }
+
+    void worker();
+
+    int ttlsecs;
+    bool httpsdirect;
+    vector<string> urls;
+    unordered_map<string, Entry> entries;
+    bool stopreq;
+    mutex mmutex;
+    condition_variable cond;
+    thread wthread;
+};
+
+void StreamCache::Internal::worker()
+{
+    LOGDEB("StreamCache::worker: starting, " << urls.size() << " urls" <<
+           endl);
+    unique_lock<mutex> lock(mmutex);
+    while (!stopreq) {
+        // Work on a copy: the list may be changed by reconfigure()
+        // while we don't hold the lock.
+        vector<string> todo;
+        if (ttlsecs > 0)
+            todo = urls;
+        for (auto it = todo.begin(); it != todo.end() && !stopreq; it++) {
+            time_t now = time(0);
+            Entry& e = entries[*it];
+            if (!needsRefresh(e, now))
+                continue;
+            e.lastattempt = now;
+            // Don't hold the lock while we're talking to the network
+            lock.unlock();
+            string streamurl;
+            bool ok = streamDecode(*it, streamurl, bgTimeoutSecs,
+                                   httpsdirect);
+            lock.lock();
+            if (ok && ttlsecs > 0) {
+                LOGDEB1("StreamCache::worker: " << *it << " -> " <<
+                        streamurl << endl);
+                store(*it, streamurl);
+            } else {
+                LOGDEB("StreamCache::worker: translation failed for " << *it
+                       << endl);
+            }
+        }
+        cond.wait_for(lock, chrono::seconds(checkIntervalSecs));
+    }
+    LOGDEB("StreamCache::worker: exiting" << endl);
+}
+
+StreamCache::StreamCache(int ttlsecs, bool httpsdirect)
+{
+    m = new Internal(ttlsecs, httpsdirect);
+}
+
+StreamCache::~StreamCache()
+{
+    if (m->wthread.joinable()) {
+        {
+            unique_lock<mutex> lock(m->mmutex);
+            m->stopreq = true;
+        }
+        m->cond.notify_all();
+        m->wthread.join();
+    }
+    delete m;
+}
+
+bool StreamCache::start(const vector<string>& urls)
+{
+    if (m->ttlsecs <= 0 || m->wthread.joinable())
+        return true;
+    m->urls = urls;
+    try {
+        m->wthread = thread(&StreamCache::Internal::worker, m);
+    } catch (const std::exception& ex) {
+        LOGERR("StreamCache::start: could not start thread: " << ex.what()
+               << endl);
+        return false;
+    }
+    return true;
+}
+
+bool StreamCache::reconfigure(const vector<string>& urls, int ttlsecs)
+{
+    {
+        unique_lock<mutex> lock(m->mmutex);
+        m->ttlsecs = ttlsecs;
+        m->urls = urls;
+        unordered_set<string> keep(urls.begin(), urls.end());
+        for (auto it = m->entries.begin(); it != m->entries.end(); ) {
+            if (ttlsecs <= 0 || keep.find(it->first) == keep.end()) {
+                it = m->entries.erase(it);
+            } else {
+                it++;
+            }
+        }
+    }
+    if (m->wthread.joinable()) {
+        // Have the worker look at the new list now
+        m->cond.notify_all();
+        return true;
+    }
+    return start(urls);
+}
+
+bool StreamCache::get(const string& url, string& streamurl, int timeosecs)
+{
+    bool caching;
+    {
+        unique_lock<mutex> lock(m->mmutex);
+        caching = m->ttlsecs > 0;
+        auto it = m->entries.find(url);
+        if (caching && it != m->entries.end() &&
+            m->fresh(it->second, time(0))) {
+            LOGDEB("StreamCache::get: cache hit for " << url << endl);
+            streamurl = it->second.streamurl;
+            return true;
+        }
+    }
+
+    if (streamDecode(url, streamurl, timeosecs, m->httpsdirect)) {
+        if (caching) {
+            unique_lock<mutex> lock(m->mmutex);
+            m->store(url, streamurl);
+        }
+        return true;
+    }
+
+    // Live translation failed. An expired translation is better than
+    // nothing.
+    unique_lock<mutex> lock(m->mmutex);
+    auto it = m->entries.find(url);
+    if (it != m->entries.end() && !it->second.streamurl.empty()) {
+        LOGINF("StreamCache::get: using expired translation for " << url <<
+               endl);
+        streamurl = it->second.streamurl;
+        return true;
+    }
+    return false;
+}
+
+void StreamCache::invalidate(const string& url)
+{
+    unique_lock<mutex> lock(m->mmutex);
+    auto it = m->entries.find(url);
+    if (it != m->entries.end()) {
+        it->second.streamurl.clear();
+        it->second.resolved = 0;
+        it->second.lastattempt = 0;
+    }
+}
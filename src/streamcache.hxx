@@ -0,0 +1,63 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _STREAMCACHE_H_X_INCLUDED_
+#define _STREAMCACHE_H_X_INCLUDED_
+
+#include <string>
+#include <vector>
+
+/**
+ * Cache of radio URL to audio stream URL translations (see
+ * streamdecoder.hxx).
+ *
+ * Translating a radio URL may need several HTTP requests, so we keep
+ * the results for a time, and a background thread translates the
+ * configured radio URLs in advance, and refreshes them before they
+ * expire. Lookups which miss the cache are translated live.
+ */
+class StreamCache {
+public:
+    /** @param ttlsecs validity period for a translation. 0 disables
+     *  caching: all lookups are translated live.
+     *  @param httpsdirect see streamDecode(). */
+    StreamCache(int ttlsecs, bool httpsdirect = false);
+    ~StreamCache();
+
+    /** Start the background thread, which will keep the translations
+     *  for the urls list current. */
+    bool start(const std::vector<std::string>& urls);
+
+    /** Change the URL list and validity period after a configuration
+     *  change. Translations for URLs not in the list are dropped. */
+    bool reconfigure(const std::vector<std::string>& urls, int ttlsecs);
+
+    /** Translate URL, from the cache if possible.
+     * @param timeosecs network timeout if we need to translate live.
+     * @return true if streamurl was set.
+     */
+    bool get(const std::string& url, std::string& streamurl,
+             int timeosecs = 10);
+
+    /** Forget about a translation, e.g. because it did not play. */
+    void invalidate(const std::string& url);
+
+    class Internal;
+private:
+    Internal *m;
+};
+
+#endif /* _STREAMCACHE_H_X_INCLUDED_ */
@@ -0,0 +1,773 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef STREAMDECODER_TEST
+#include "streamdecoder.hxx"
+
+#include <stdlib.h>
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "libupnpp/log.hxx"
+#include "libupnpp/soaphelp.hxx"
+
+#include "netcon.h"
+#include "upmpdutils.hxx"
+
+using namespace std;
+using namespace UPnPP;
+
+#ifndef UPMPDCLI_PACKAGE_VERSION
+#define UPMPDCLI_PACKAGE_VERSION "0"
+#endif
+static const string userAgent("Upmpdcli/" UPMPDCLI_PACKAGE_VERSION);
+
+// Size of the data chunk used for deciding if this is a playlist
+static const unsigned int sniffBytes = 500;
+// Max size for a playlist document. Anything bigger is truncated.
+static const unsigned int maxPlaylistBytes = 256 * 1024;
+// Max count of redirects followed for one URL
+static const int maxRedirects = 5;
+// Max playlist nesting depth
+static const int maxDepth = 10;
+
+static string stringtolower(const string& in)
+{
+    string out(in);
+    for (unsigned int i = 0; i < out.size(); i++) {
+        out[i] = ::tolower(out[i]);
+    }
+    return out;
+}
+
+static bool beginswith(const string& big, const string& small)
+{
+    return big.compare(0, small.size(), small) == 0;
+}
+
+static bool endswith(const string& big, const string& small)
+{
+    return big.size() >= small.size() &&
+        big.compare(big.size() - small.size(), small.size(), small) == 0;
+}
+
+static bool ishttp(const string& url)
+{
+    return beginswith(stringtolower(url.substr(0, 7)), "http://");
+}
+
+// Schemes which may point to a playlist, but that we can't fetch. We
+// fail on these so that the caller falls back to the Python code,
+// unless it has none (httpsdirect), then they go to mpd as is.
+static bool isunhandled(const string& url)
+{
+    return beginswith(stringtolower(url.substr(0, 8)), "https://");
+}
+
+// Split on any combination of \r and \n, dropping empty lines and
+// trimming the others
+static void splitlines(const string& data, vector<string>& lines)
+{
+    vector<string> tmp;
+    stringToTokens(data, tmp, "\r\n");
+    for (auto it = tmp.begin(); it != tmp.end(); it++) {
+        trimstring(*it, " \t");
+        if (!it->empty())
+            lines.push_back(*it);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Minimal HTTP/1.0 client. We only ever need the headers and the
+// beginning of the data (or a small document), and we don't want to
+// pull another library for this.
+
+struct HttpUrl {
+    string host;
+    unsigned int port;
+    string path;
+    // What goes in the Host: header and in rebuilt URLs.
+    string hostport;
+};
+
+static bool parseHttpUrl(const string& url, HttpUrl& out)
+{
+    if (!ishttp(url))
+        return false;
+    string::size_type slash = url.find('/', 7);
+    out.hostport = url.substr(7, slash == string::npos ? string::npos :
+                              slash - 7);
+    out.path = slash == string::npos ? "/" : url.substr(slash);
+    string::size_type pos = out.path.find('#');
+    if (pos != string::npos)
+        out.path.erase(pos);
+    pos = out.hostport.rfind('@');
+    if (pos != string::npos)
+        out.hostport.erase(0, pos + 1);
+
+    out.port = 80;
+    string::size_type colon = out.hostport.find(':');
+    out.host = out.hostport.substr(0, colon);
+    if (colon != string::npos) {
+        out.port = atoi(out.hostport.c_str() + colon + 1);
+        if (out.port == 0)
+            return false;
+    }
+    return !out.host.empty();
+}
+
+// Compute the target for a redirect, which may be relative.
+static string resolveLocation(const HttpUrl& base, const string& loc)
+{
+    if (loc.find("://") != string::npos) {
+        return loc;
+    } else if (beginswith(loc, "//")) {
+        return "http:" + loc;
+    } else if (beginswith(loc, "/")) {
+        return "http://" + base.hostport + loc;
+    } else {
+        string dir = base.path.substr(0, base.path.find('?'));
+        dir = dir.substr(0, dir.rfind('/') + 1);
+        return "http://" + base.hostport + dir + loc;
+    }
+}
+
+// A GET request in progress.
+struct HttpFetch {
+    HttpFetch() : status(0), eof(false) {}
+    HttpUrl url;
+    shared_ptr<NetconCli> con;
+    int status;
+    string location;
+    string ctype;
+    string body;
+    bool eof;
+};
+
+// Read a complete header line (netcon getline() truncates at the
+// buffer size). Returns the line size, 0 for eof/timeout, -1 for error.
+static int readline(NetconCli *con, string& line, int timeo)
+{
+    line.clear();
+    char buf[1024];
+    for (;;) {
+        int n = con->getline(buf, sizeof(buf), timeo);
+        if (n < 0)
+            return -1;
+        if (n == 0 || buf[n-1] == '\n') {
+            line.append(buf, n);
+            return int(line.size());
+        }
+        line.append(buf, n);
+        // Don't let a crazy server make us eat all memory
+        if (line.size() > 64 * 1024)
+            return -1;
+    }
+}
+
+// Connect, send request, and read the response headers.
+static bool httpOpen(const string& url, HttpFetch& f, int timeo)
+{
+    f = HttpFetch();
+    if (!parseHttpUrl(url, f.url)) {
+        LOGERR("streamDecode: bad http url: " << url << endl);
+        return false;
+    }
+    f.con = shared_ptr<NetconCli>(new NetconCli());
+    if (f.con->openconn(f.url.host.c_str(), f.url.port, timeo) < 0) {
+        LOGERR("streamDecode: connection failed for " << url << endl);
+        return false;
+    }
+
+    string req = "GET " + f.url.path + " HTTP/1.0\r\n" +
+        "Host: " + f.url.hostport + "\r\n" +
+        "User-Agent: " + userAgent + "\r\n" +
+        "Accept: */*\r\n" +
+        "Connection: close\r\n\r\n";
+    if (f.con->send(req.c_str(), int(req.size())) != int(req.size())) {
+        LOGERR("streamDecode: send failed for " << url << endl);
+        return false;
+    }
+
+    // Status line. Shoutcast servers may answer "ICY 200 OK"
+    string line;
+    if (readline(f.con.get(), line, timeo) <= 0) {
+        LOGERR("streamDecode: no response from " << url << endl);
+        return false;
+    }
+    string::size_type sp = line.find(' ');
+    if (sp == string::npos) {
+        LOGERR("streamDecode: bad status line from " << url << ": " <<
+               line << endl);
+        return false;
+    }
+    f.status = atoi(line.c_str() + sp + 1);
+
+    // Headers, until empty line.
+    for (;;) {
+        if (readline(f.con.get(), line, timeo) <= 0) {
+            LOGERR("streamDecode: error reading headers for " << url << endl);
+            return false;
+        }
+        trimstring(line, " \t\r\n");
+        if (line.empty())
+            break;
+        string::size_type colon = line.find(':');
+        if (colon == string::npos)
+            continue;
+        string name = stringtolower(line.substr(0, colon));
+        string value = line.substr(colon + 1);
+        trimstring(value, " \t");
+        if (name == "content-type") {
+            f.ctype = stringtolower(value);
+        } else if (name == "location") {
+            f.location = value;
+        }
+    }
+    return true;
+}
+
+// Read data until we have at least cnt bytes or eof.
+static void httpRead(HttpFetch& f, unsigned int cnt, int timeo)
+{
+    char buf[4096];
+    while (!f.eof && f.body.size() < cnt) {
+        int n = f.con->getline(buf, sizeof(buf), timeo);
+        if (n <= 0) {
+            f.eof = true;
+            break;
+        }
+        f.body.append(buf, n);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+// Playlist decoders. The sniffing logic is the same as the
+// rdpl2stream Python code: ctype is the lowercased content-type,
+// first is the beginning of the data, trimmed and lowercased.
+
+// Windows Media streams URLs in playlists are http but actually mms.
+static void asfurlfix(string& url)
+{
+    if (endswith(url, "?MSWMExt=.asf")) {
+        string::size_type pos = url.find("http");
+        if (pos != string::npos) {
+            url.replace(pos, 4, "mms");
+        }
+    }
+}
+
+// Extract the values of the "attr" attributes in the "tag" elements
+// of an XML-ish document, ignoring case. e.g. ASX <ref href=...>
+static void xmlattrs(const string& data, const string& tag,
+                     const string& attr, vector<string>& values)
+{
+    string ldata = stringtolower(data);
+    string stag = "<" + tag;
+    for (string::size_type pos = 0;
+         (pos = ldata.find(stag, pos)) != string::npos; pos += stag.size()) {
+        char c = ldata[pos + stag.size()];
+        if (c != ' ' && c != '\t' && c != '\r' && c != '\n')
+            continue;
+        string::size_type end = ldata.find('>', pos);
+        if (end == string::npos)
+            break;
+        string::size_type apos = ldata.find(attr, pos);
+        if (apos == string::npos || apos > end)
+            continue;
+        apos = ldata.find_first_of("\"'", apos + attr.size());
+        if (apos == string::npos || apos > end)
+            continue;
+        string::size_type aend = ldata.find(ldata[apos], apos + 1);
+        if (aend == string::npos || aend > end)
+            continue;
+        values.push_back(SoapHelp::xmlUnquote(
+                             data.substr(apos + 1, aend - apos - 1)));
+    }
+}
+
+// Extract the contents of the "tag" elements inside "parent" elements.
+// e.g. XSPF <track><location>
+static void xmlelts(const string& data, const string& parent,
+                    const string& tag, vector<string>& values)
+{
+    string ldata = stringtolower(data);
+    string sparent = "<" + parent;
+    string eparent = "</" + parent + ">";
+    string stag = "<" + tag + ">";
+    string etag = "</" + tag + ">";
+    for (string::size_type pos = 0;
+         (pos = ldata.find(sparent, pos)) != string::npos;) {
+        string::size_type pend = ldata.find(eparent, pos);
+        if (pend == string::npos)
+            break;
+        string::size_type tpos = ldata.find(stag, pos);
+        if (tpos != string::npos && tpos < pend) {
+            tpos += stag.size();
+            string::size_type tend = ldata.find(etag, tpos);
+            if (tend != string::npos && tend < pend) {
+                string value = SoapHelp::xmlUnquote(
+                    data.substr(tpos, tend - tpos));
+                trimstring(value, " \t\r\n");
+                values.push_back(value);
+            }
+        }
+        pos = pend + eparent.size();
+    }
+}
+
+static bool plsSniff(const string& ctype, const string& first)
+{
+    return ctype.find("audio/x-scpls") != string::npos ||
+        ctype.find("application/pls+xml") != string::npos ||
+        beginswith(first, "[playlist]");
+}
+static void plsExtract(const string& data, vector<string>& urls)
+{
+    vector<string> lines;
+    splitlines(data, lines);
+    for (auto it = lines.begin(); it != lines.end(); it++) {
+        if (beginswith(stringtolower(*it), "file")) {
+            string::size_type eq = it->find('=');
+            if (eq != string::npos) {
+                string url = it->substr(eq + 1);
+                trimstring(url, " \t");
+                urls.push_back(url);
+            }
+        }
+    }
+}
+
+static bool asxSniff(const string& ctype, const string& first)
+{
+    return (ctype.find("audio/x-ms-wax") != string::npos ||
+            ctype.find("video/x-ms-wvx") != string::npos ||
+            ctype.find("video/x-ms-asf") != string::npos ||
+            ctype.find("video/x-ms-wmv") != string::npos) &&
+        beginswith(first, "<asx");
+}
+static void asxExtract(const string& data, vector<string>& urls)
+{
+    xmlattrs(data, "ref", "href", urls);
+    for (auto it = urls.begin(); it != urls.end(); it++) {
+        asfurlfix(*it);
+    }
+}
+
+static bool asfSniff(const string& ctype, const string& first)
+{
+    return ctype.find("video/x-ms-asf") != string::npos &&
+        beginswith(first, "[reference]");
+}
+static void asfExtract(const string& data, vector<string>& urls)
+{
+    vector<string> lines;
+    splitlines(data, lines);
+    for (auto it = lines.begin(); it != lines.end(); it++) {
+        if (beginswith(*it, "Ref")) {
+            string::size_type eq = it->find('=');
+            if (eq != string::npos) {
+                string url = it->substr(eq + 1);
+                trimstring(url, " \t");
+                asfurlfix(url);
+                urls.push_back(url);
+            }
+        }
+    }
+}
+
+static bool xspfSniff(const string& ctype, const string&)
+{
+    return ctype.find("application/xspf+xml") != string::npos;
+}
+static void xspfExtract(const string& data, vector<string>& urls)
+{
+    xmlelts(data, "track", "location", urls);
+}
+
+static bool ramSniff(const string& ctype, const string&)
+{
+    return ctype.find("audio/x-pn-realaudio") != string::npos ||
+        ctype.find("audio/vnd.rn-realaudio") != string::npos;
+}
+// Also used for m3u
+static void ramExtract(const string& data, vector<string>& urls)
+{
+    vector<string> lines;
+    splitlines(data, lines);
+    for (auto it = lines.begin(); it != lines.end(); it++) {
+        if ((*it)[0] != '#')
+            urls.push_back(*it);
+    }
+}
+
+static bool m3uSniff(const string& ctype, const string& first)
+{
+    if (ctype.find("audio/mpegurl") != string::npos ||
+        ctype.find("audio/x-mpegurl") != string::npos)
+        return true;
+    vector<string> lines;
+    splitlines(first, lines);
+    for (auto it = lines.begin(); it != lines.end(); it++) {
+        if (beginswith(*it, "http://"))
+            return true;
+    }
+    return false;
+}
+
+struct PlDecoder {
+    const char *name;
+    bool (*sniff)(const string& ctype, const string& first);
+    void (*extract)(const string& data, vector<string>& urls);
+};
+
+// Order matters: m3u sniffing is the loosest.
+static const PlDecoder o_decoders[] = {
+    {"pls", plsSniff, plsExtract},
+    {"asx", asxSniff, asxExtract},
+    {"asf", asfSniff, asfExtract},
+    {"xspf", xspfSniff, xspfExtract},
+    {"ram", ramSniff, ramExtract},
+    {"m3u", m3uSniff, ramExtract},
+};
+
+static const PlDecoder *findDecoder(const string& ctype, const string& data)
+{
+    string first = data.substr(0, sniffBytes);
+    trimstring(first, " \t\r\n");
+    first = stringtolower(first);
+    for (unsigned int i = 0; i < sizeof(o_decoders) / sizeof(PlDecoder); i++) {
+        if (o_decoders[i].sniff(ctype, first)) {
+            return &o_decoders[i];
+        }
+    }
+    return 0;
+}
+
+bool streamDecodePlaylist(const string& ctype, const string& data,
+                          vector<string>& urls)
+{
+    const PlDecoder *dec = findDecoder(stringtolower(ctype), data);
+    if (dec == 0)
+        return false;
+    dec->extract(data, urls);
+    return true;
+}
+
+static bool decodeOne(const string& url, string& streamurl, int timeo,
+                      int depth, bool httpsdirect)
+{
+    LOGDEB("streamDecode: depth " << depth << " url " << url << endl);
+    if (depth > maxDepth) {
+        LOGERR("streamDecode: playlists nested too deep" << endl);
+        return false;
+    }
+    if (isunhandled(url) && !httpsdirect) {
+        LOGDEB("streamDecode: can't fetch " << url << endl);
+        return false;
+    }
+    if (!ishttp(url)) {
+        LOGDEB("streamDecode: not http, maybe direct stream" << endl);
+        streamurl = url;
+        return true;
+    }
+
+    HttpFetch f;
+    string cururl = url;
+    for (int redirs = 0;; redirs++) {
+        if (!httpOpen(cururl, f, timeo))
+            return false;
+        if (f.status < 300 || f.status >= 400 || f.location.empty())
+            break;
+        if (redirs >= maxRedirects) {
+            LOGERR("streamDecode: too many redirects for " << url << endl);
+            return false;
+        }
+        cururl = resolveLocation(f.url, f.location);
+        LOGDEB("streamDecode: redirected to " << cururl << endl);
+        if (isunhandled(cururl) && !httpsdirect) {
+            LOGDEB("streamDecode: can't fetch " << cururl << endl);
+            return false;
+        }
+        if (!ishttp(cururl)) {
+            // e.g. mms redirect
+            streamurl = cururl;
+            return true;
+        }
+    }
+    if (f.status != 200) {
+        LOGERR("streamDecode: " << cururl << ": HTTP status " << f.status <<
+               endl);
+        return false;
+    }
+    // Like the Python code, we return the original URL for direct
+    // streams, and let mpd deal with any redirects.
+    if (f.ctype.empty()) {
+        LOGDEB("streamDecode: no content-type, maybe direct stream" << endl);
+        streamurl = url;
+        return true;
+    }
+    httpRead(f, sniffBytes, timeo);
+    const PlDecoder *dec = findDecoder(f.ctype, f.body);
+    if (dec == 0) {
+        LOGDEB("streamDecode: not a playlist: " << f.ctype << endl);
+        streamurl = url;
+        return true;
+    }
+    httpRead(f, maxPlaylistBytes, timeo);
+    f.con->closeconn();
+
+    vector<string> urls;
+    dec->extract(f.body, urls);
+    LOGDEB("streamDecode: " << dec->name << " playlist, " << urls.size() <<
+           " entries" << endl);
+    if (urls.empty()) {
+        LOGERR("streamDecode: empty playlist for " << url << endl);
+        return false;
+    }
+    for (auto it = urls.begin(); it != urls.end(); it++) {
+        if (decodeOne(*it, streamurl, timeo, depth + 1, httpsdirect))
+            return true;
+    }
+    return false;
+}
+
+bool streamDecode(const string& url, string& streamurl, int timeosecs,
+                  bool httpsdirect)
+{
+    return decodeOne(url, streamurl, timeosecs, 0, httpsdirect);
+}
+
+#else // STREAMDECODER_TEST ->
+
+// Test driver: run a local HTTP stand-in serving a chain of the
+// different playlist types, and check that we get to the stream.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "netcon.h"
+#include "streamdecoder.hxx"
+
+using namespace std;
+
+static char *thisprog;
+static char usage [] =
+"streamdecoder [-p port]: run tests against a local http server\n"
+"streamdecoder -u url: resolve url\n"
+"\n"
+;
+static void Usage(void)
+{
+    fprintf(stderr, "%s: usage:\n%s", thisprog, usage);
+    exit(1);
+}
+
+static int op_flags;
+#define OPT_p     0x1
+#define OPT_u     0x2
+
+static int port = 8765;
+
+static string lurl(const string& path)
+{
+    char buf[100];
+    sprintf(buf, "http://127.0.0.1:%d", port);
+    return string(buf) + path;
+}
+
+// Path -> (status line, content-type, data)
+struct Canned {
+    const char *path;
+    const char *status;
+    const char *ctype;
+    string data;
+};
+static vector<Canned> canned;
+
+static void setupCanned()
+{
+    canned = {
+        {"/pls", "HTTP/1.0 200 OK", "audio/x-scpls",
+         "[playlist]\r\nNumberOfEntries=2\r\nFile1=" + lurl("/redir") +
+         "\r\nTitle1=Redirected\r\nFile2=" + lurl("/notfound") + "\r\n"},
+        {"/redir", "HTTP/1.1 302 Found", "", "/dir/m3u"},
+        {"/dir/m3u", "HTTP/1.0 200 OK", "audio/x-mpegurl",
+         "#EXTM3U\n#EXTINF:-1,Test\n" + lurl("/asx") + "\n"},
+        {"/asx", "HTTP/1.0 200 OK", "video/x-ms-asf",
+         "<ASX version=\"3.0\"><Entry><Ref HREF=\"" + lurl("/xspf") +
+         "\"/></Entry></ASX>"},
+        {"/xspf", "HTTP/1.0 200 OK", "application/xspf+xml",
+         "<?xml version=\"1.0\"?><playlist version=\"1\" "
+         "xmlns=\"http://xspf.org/ns/0/\"><trackList><track><location>" +
+         lurl("/ram") + "</location></track></trackList></playlist>"},
+        {"/ram", "HTTP/1.0 200 OK", "audio/x-pn-realaudio",
+         lurl("/asf") + "\n"},
+        {"/asf", "HTTP/1.0 200 OK", "video/x-ms-asf",
+         "[Reference]\r\nRef1=" + lurl("/icy") + "\r\n"},
+        {"/icy", "ICY 200 OK", "audio/mpeg", string(2000, '\xff')},
+        {"/tohttps", "HTTP/1.1 302 Found", "",
+         "https://127.0.0.1/secure.pls"},
+        {"/mms", "HTTP/1.0 200 OK", "audio/x-mpegurl",
+         "mms://127.0.0.1/stream\n"},
+    };
+}
+
+static void server()
+{
+    NetconServLis lis;
+    if (lis.openservice(port) < 0) {
+        cerr << "openservice failed" << endl;
+        _exit(1);
+    }
+    for (;;) {
+        NetconServCon *con = lis.accept();
+        if (con == 0)
+            continue;
+        char buf[1024];
+        string path;
+        for (int i = 0; con->getline(buf, sizeof(buf), 2) > 2; i++) {
+            if (i == 0) {
+                path = buf + 4;
+                path = path.substr(0, path.find(' '));
+            }
+        }
+        string resp = "HTTP/1.0 404 Not Found\r\n\r\n";
+        for (auto it = canned.begin(); it != canned.end(); it++) {
+            if (path == it->path) {
+                resp = string(it->status) + "\r\n";
+                if (!strncmp(it->status + 9, "302", 3)) {
+                    resp += "Location: " + it->data + "\r\n\r\n";
+                } else {
+                    resp += string("Content-Type: ") + it->ctype +
+                        "\r\n\r\n" + it->data;
+                }
+            }
+        }
+        con->send(resp.c_str(), resp.size());
+        delete con;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    string url;
+    thisprog = argv[0];
+    argc--; argv++;
+    while (argc > 0 && **argv == '-') {
+        (*argv)++;
+        if (!(**argv))
+            Usage();
+        while (**argv)
+            switch (*(*argv)++) {
+            case 'p':   op_flags |= OPT_p; if (argc < 2)  Usage();
+                port = atoi(*(++argv)); argc--; goto b1;
+            case 'u':   op_flags |= OPT_u; if (argc < 2)  Usage();
+                url = *(++argv); argc--; goto b1;
+            default: Usage();   break;
+            }
+    b1: argc--; argv++;
+    }
+    if (argc != 0)
+        Usage();
+
+    string streamurl;
+    if (op_flags & OPT_u) {
+        if (!streamDecode(url, streamurl)) {
+            cerr << "streamDecode failed" << endl;
+            return 1;
+        }
+        cout << streamurl << endl;
+        return 0;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    setupCanned();
+    pid_t pid = fork();
+    if (pid == 0) {
+        server();
+        _exit(0);
+    }
+    sleep(1);
+
+    int errors = 0;
+    // Document decoding
+    for (auto it = canned.begin(); it != canned.end(); it++) {
+        if (it->ctype[0] == 0)
+            continue;
+        vector<string> urls;
+        bool ispl = streamDecodePlaylist(it->ctype, it->data, urls);
+        cout << it->path << ": " << (ispl ? "playlist" : "not playlist");
+        for (auto it1 = urls.begin(); it1 != urls.end(); it1++)
+            cout << " [" << *it1 << "]";
+        cout << endl;
+        if (ispl != (string(it->path) != "/icy") || (ispl && urls.empty()))
+            errors++;
+    }
+    // Full resolution, with nesting and redirect.
+    if (!streamDecode(lurl("/pls"), streamurl, 5) ||
+        streamurl != lurl("/icy")) {
+        cerr << "Chain resolution failed: [" << streamurl << "]" << endl;
+        errors++;
+    } else {
+        cout << "Chain resolved to " << streamurl << endl;
+    }
+    // https can't be fetched here: we must fail, directly or after a
+    // redirect, so that the caller uses the Python code.
+    if (streamDecode("https://127.0.0.1/secure.pls", streamurl, 5) ||
+        streamDecode(lurl("/tohttps"), streamurl, 5)) {
+        cerr << "https not rejected: [" << streamurl << "]" << endl;
+        errors++;
+    } else {
+        cout << "https rejected" << endl;
+    }
+    // Unless there is no fallback: then it's a direct stream
+    if (!streamDecode("https://127.0.0.1/secure.pls", streamurl, 5, true) ||
+        streamurl != "https://127.0.0.1/secure.pls" ||
+        !streamDecode(lurl("/tohttps"), streamurl, 5, true) ||
+        streamurl != "https://127.0.0.1/secure.pls") {
+        cerr << "https not passed through: [" << streamurl << "]" << endl;
+        errors++;
+    } else {
+        cout << "https passed through" << endl;
+    }
+    // Other schemes are direct streams for mpd
+    if (!streamDecode(lurl("/mms"), streamurl, 5) ||
+        streamurl != "mms://127.0.0.1/stream") {
+        cerr << "mms entry failed: [" << streamurl << "]" << endl;
+        errors++;
+    } else {
+        cout << "mms entry resolved to " << streamurl << endl;
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, 0, 0);
+    cout << (errors ? "FAILED" : "OK") << endl;
+    return errors ? 1 : 0;
+}
+
+#endif // STREAMDECODER_TEST
@@ -0,0 +1,64 @@
+/* Copyright (C) 2016 J.F.Dockes
+ *	 This program is free software; you can redistribute it and/or modify
+ *	 it under the terms of the GNU General Public License as published by
+ *	 the Free Software Foundation; either version 2 of the License, or
+ *	 (at your option) any later version.
+ *
+ *	 This program is distributed in the hope that it will be useful,
+ *	 but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	 MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	 GNU General Public License for more details.
+ *
+ *	 You should have received a copy of the GNU General Public License
+ *	 along with this program; if not, write to the
+ *	 Free Software Foundation, Inc.,
+ *	 59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.
+ */
+#ifndef _STREAMDECODER_H_X_INCLUDED_
+#define _STREAMDECODER_H_X_INCLUDED_
+
+#include <string>
+#include <vector>
+
+// Translation of radio URLs into actual audio stream URLs.
+//
+// The URLs for internet radios often point to playlist files (PLS,
+// M3U, ASX, XSPF, RAM, ASF reference), possibly nested, and not to
+// the audio stream itself. This is a native version of the
+// rdpl2stream Python code: fetch the URL, following redirects, decide
+// from the content-type and first bytes if this is a playlist, and if
+// it is, extract the entries and go on with the first one which
+// resolves.
+//
+// Only plain http is fetched. https URLs make the resolution fail, so
+// that the caller can fall back to the Python code, or, if it has no
+// fallback, are returned as is, like URLs with other schemes (mms...),
+// and left for mpd to deal with.
+
+/**
+ * Resolve radio URL to stream URL.
+ *
+ * @param url the radio URL.
+ * @param[out] streamurl the audio stream URL.
+ * @param timeosecs timeout for each network operation.
+ * @param httpsdirect return https URLs as direct streams instead of
+ *    failing.
+ * @return true if streamurl was set.
+ */
+extern bool streamDecode(const std::string& url, std::string& streamurl,
+                         int timeosecs = 10, bool httpsdirect = false);
+
+/**
+ * Decode playlist data. This is what streamDecode() uses for data
+ * fetched from the network, exposed separately mostly for testing.
+ *
+ * @param ctype the content-type from the HTTP header.
+ * @param data the document data.
+ * @param[out] urls the playlist entries.
+ * @return false if the data does not look like a known playlist format.
+ */
+extern bool streamDecodePlaylist(const std::string& ctype,
+                                 const std::string& data,
+                                 std::vector<std::string>& urls);
+
+#endif /* _STREAMDECODER_H_X_INCLUDED_ */
@@ -17,6 +17,9 @@
 
 #include "upmpd.hxx"
 
+#include <set>                          // for set
+#include <utility>                      // for pair
+
 #include "libupnpp/device/device.hxx"   // for UpnpDevice, UpnpService
 #include "libupnpp/log.hxx"             // for LOGFAT, LOGERR, Logger, etc
 #include "libupnpp/upnpplib.hxx"        // for LibUPnP
@@ -36,6 +39,9 @@
 #include "execmd.h"
 #include "httpfs.hxx"
 #include "ohsndrcv.hxx"
+#include "ohmetacache.hxx"
+#include "conftree.hxx"
+#include "confwatch.hxx"
 
 using namespace std;
 using namespace std::placeholders;
@@ -46,6 +52,16 @@ bool OHService::getEventData(bool all, vector<string>& names,
 {
     //LOGDEB("OHService::getEventData" << std::endl);
 
+    // Normally done by AVTransport, but it may have no eventing.
+    m_dev->checkConfig();
+
+    // Don't compute the state if nobody ever subscribed to our
+    // events. The initial event for a subscription computes it.
+    if (m_dev->isSubscription(all))
+        m_subscribed = true;
+    if (!m_subscribed && !m_pollalways)
+        return true;
+
     std::unordered_map<std::string, std::string> state, changed;
     makestate(state);
     if (all) {
@@ -75,7 +91,8 @@ UpMpd::UpMpd(const string& deviceid, const string& friendlyname,
       m_options(opts.options),
       m_mcachefn(opts.cachefn),
       m_rdctl(0), m_avt(0), m_ohpr(0), m_ohpl(0), m_ohrd(0), m_ohrcv(0),
-      m_sndrcv(0), m_friendlyname(friendlyname)
+      m_sndrcv(0), m_friendlyname(friendlyname), m_confwatch(0),
+      m_loopthread(this_thread::get_id())
 {
     bool avtnoev = (m_options & upmpdNoAV) != 0; 
     // Note: the order is significant here as it will be used when
@@ -110,6 +127,8 @@ UpMpd::UpMpd(const string& deviceid, const string& friendlyname,
                     parms.pm = OHReceiverParams::OHRP_ALSA;
                 } else if (!opts.scplaymethod.compare("mpd")) {
                     parms.pm = OHReceiverParams::OHRP_MPD;
+                } else if (!opts.scplaymethod.compare("internal")) {
+                    parms.pm = OHReceiverParams::OHRP_INTERNAL;
                 }
             }
             parms.sc2mpdpath = opts.sc2mpdpath;
@@ -119,16 +138,30 @@ UpMpd::UpMpd(const string& deviceid, const string& friendlyname,
         if (m_options& upmpdOhSenderReceiver) {
             // Note: this is not an UPnP service
             m_sndrcv = new SenderReceiver(this, opts.senderpath,
-                                          opts.sendermpdport);
+                                          opts.sendermpdport,
+                                          opts.senderprestart);
         }
         // Create ohpr last, so that it can ask questions to other services
         m_ohpr = new OHProduct(this, ohProductDesc);
         m_services.push_back(m_ohpr);
     }
+
+    // Watch the configuration file, checkConfig() will apply the changes.
+    if (g_config && !g_configfilename.empty()) {
+        m_confwatch = new ConfWatch(g_configfilename,
+                                    [this] () {loopWakeup();});
+        if (!m_confwatch->start()) {
+            delete m_confwatch;
+            m_confwatch = 0;
+        }
+    }
 }
 
 UpMpd::~UpMpd()
 {
+    delete m_confwatch;
+    if (m_config && g_config == m_config.get())
+        g_config = 0;
     delete m_sndrcv;
     for (vector<UpnpService*>::iterator it = m_services.begin();
          it != m_services.end(); it++) {
@@ -136,8 +169,127 @@ UpMpd::~UpMpd()
     }
 }
 
+// Top level parameters which checkConfig() applies. The [radio xxx]
+// sections are applied too, everything else needs a restart.
+static const set<string> o_hookkeys{"onstart", "onplay", "onstop",
+        "onvolumechange", "getexternalvolume"};
+static const set<string> o_extvolkeys{"externalvolumehelper",
+        "externalvolumettl"};
+// Read when needed, nothing to do
+static const set<string> o_dynkeys{"ohsrc_scripts_dir"};
+
+// List the (subkey, name) pairs which differ between two configurations
+static void confDiff(const ConfSimple& c1, const ConfSimple& c2,
+                     vector<pair<string, string> >& changed)
+{
+    set<string> sks{""};
+    for (auto& sk : c1.getSubKeys())
+        sks.insert(sk);
+    for (auto& sk : c2.getSubKeys())
+        sks.insert(sk);
+    for (auto& sk : sks) {
+        set<string> names;
+        for (auto& nm : c1.getNames(sk))
+            names.insert(nm);
+        for (auto& nm : c2.getNames(sk))
+            names.insert(nm);
+        for (auto& nm : names) {
+            string v1, v2;
+            bool h1 = c1.get(nm, v1, sk) != 0;
+            bool h2 = c2.get(nm, v2, sk) != 0;
+            if (h1 != h2 || v1 != v2)
+                changed.push_back(pair<string, string>(sk, nm));
+        }
+    }
+}
+
+static string confValue(const ConfSimple& conf, const string& nm,
+                        const string& dflt = string())
+{
+    string value;
+    if (!conf.get(nm, value))
+        return dflt;
+    return value;
+}
+
+// The new configuration is read by the ConfWatch thread. We apply it
+// from the event loop, so that we don't need locking for the objects
+// which use the parameters.
+void UpMpd::checkConfig()
+{
+    shared_ptr<ConfSimple> nconf;
+    if (!m_confwatch || !m_confwatch->collect(nconf) || !g_config)
+        return;
+
+    vector<pair<string, string> > changed;
+    confDiff(*g_config, *nconf, changed);
+    if (changed.empty()) {
+        LOGDEB("UpMpd::checkConfig: no changes\n");
+        return;
+    }
+
+    bool loglevel(false), hooks(false), extvol(false), metasleep(false),
+        radios(false);
+    for (auto& ent : changed) {
+        const string& sk = ent.first;
+        const string& nm = ent.second;
+        if (sk.find("radio ") == 0 || (sk.empty() && nm == "radiostreamttl")) {
+            radios = true;
+        } else if (!sk.empty()) {
+            LOGINF("UpMpd::checkConfig: [" << sk << "] " << nm <<
+                   " changed, restart needed\n");
+        } else if (nm == "loglevel") {
+            // The command line value has priority
+            loglevel = !(m_options & upmpdCmdLineLogLevel);
+        } else if (o_hookkeys.find(nm) != o_hookkeys.end()) {
+            hooks = true;
+        } else if (o_extvolkeys.find(nm) != o_extvolkeys.end()) {
+            extvol = true;
+        } else if (nm == "ohmetasleep") {
+            metasleep = true;
+        } else if (o_dynkeys.find(nm) == o_dynkeys.end()) {
+            LOGINF("UpMpd::checkConfig: " << nm <<
+                   " changed, restart needed\n");
+        }
+    }
+
+    // Switch the global configuration first, the update code may use it
+    m_config = nconf;
+    g_config = m_config.get();
+
+    if (loglevel) {
+        int level = atoi(confValue(*nconf, "loglevel", "3").c_str());
+        LOGINF("UpMpd::checkConfig: log level " << level << endl);
+        Logger::getTheLog("")->setLogLevel(Logger::LogLevel(level));
+    }
+    if (hooks) {
+        m_mpdcli->setHooks(confValue(*nconf, "onstart"),
+                           confValue(*nconf, "onplay"),
+                           confValue(*nconf, "onstop"),
+                           confValue(*nconf, "onvolumechange"),
+                           confValue(*nconf, "getexternalvolume"));
+    }
+    if (extvol) {
+        m_mpdcli->setExternalVolumeOpts(
+            atoi(confValue(*nconf, "externalvolumehelper", "0").c_str()) != 0,
+            atoi(confValue(*nconf, "externalvolumettl", "1").c_str()));
+    }
+    if (metasleep && (m_options & upmpdOhMetaPersist)) {
+        dmcacheSetOpts(atoi(confValue(*nconf, "ohmetasleep", "0").c_str()));
+    }
+    if (radios && m_ohrd) {
+        m_ohrd->reconfigure(*nconf);
+    }
+    LOGINF("UpMpd::checkConfig: configuration reloaded, " << changed.size()
+           << " changed values\n");
+}
+
 const MpdStatus& UpMpd::getMpdStatus()
 {
+    // This is called at the start of an event pass, and by most
+    // actions: the queued playlist deletions must be done first.
+    if (m_ohpl)
+        m_ohpl->flushDeletes();
     m_mpds = &m_mpdcli->getStatus();
     return *m_mpds;
 }
@@ -18,7 +18,9 @@
 #ifndef _UPMPD_H_X_INCLUDED_
 #define _UPMPD_H_X_INCLUDED_
 
+#include <memory>                       // for shared_ptr
 #include <string>                       // for string
+#include <thread>                       // for thread::id
 #include <unordered_map>                // for unordered_map
 #include <vector>                       // for vector
 
@@ -57,6 +59,7 @@ class OHProduct;
 class OHReceiver;
 class SenderReceiver;
 class OHRadio;
+class ConfWatch;
 
 // The UPnP MPD frontend device with its services
 class UpMpd : public UpnpDevice {
@@ -87,10 +90,13 @@ public:
         upmpdNoAV = 16,
         // mpd2sc et al were found: advertise songcast sender/receiver mode
         upmpdOhSenderReceiver = 32,
+        // The log level was set on the command line: don't change it
+        // when the configuration file is reloaded.
+        upmpdCmdLineLogLevel = 64,
     };
     struct Options {
         Options() : options(upmpdNone), ohmetasleep(0), schttpport(0),
-                    sendermpdport(0) {}
+                    sendermpdport(0), senderprestart(false) {}
         unsigned int options;
         std::string  cachefn;
         std::string  radioconf;
@@ -100,6 +106,7 @@ public:
         std::string sc2mpdpath;
         std::string senderpath;
         int sendermpdport;
+        bool senderprestart;
     };
     UpMpd(const std::string& deviceid, const std::string& friendlyname,
           ohProductDesc_t& ohProductDesc,
@@ -121,6 +128,19 @@ public:
             return m_mcachefn;
         }
 
+    // Apply the new configuration if the file changed. Called from
+    // the event loop, cheap if nothing changed.
+    void checkConfig();
+
+    // Tell if a getEventData() call is for the initial event of a
+    // new subscription. libupnpp also calls it with all set from the
+    // event loop, to resend the full state, and we can only tell the
+    // two apart by the calling thread.
+    bool isSubscription(bool all)
+        {
+            return all && std::this_thread::get_id() != m_loopthread;
+        }
+
 private:
     MPDCli *m_mpdcli;
     const MpdStatus *m_mpds;
@@ -136,6 +156,12 @@ private:
     SenderReceiver *m_sndrcv;
     std::vector<UpnpService*> m_services;
     std::string m_friendlyname;
+    ConfWatch *m_confwatch;
+    // Reloaded configuration (g_config points to it).
+    std::shared_ptr<ConfSimple> m_config;
+    // The event loop thread (main() runs it in the thread which
+    // creates us).
+    std::thread::id m_loopthread;
 };
 
 #endif /* _UPMPD_H_X_INCLUDED_ */
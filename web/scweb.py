@@ -3,6 +3,63 @@ import sys
 import bottle
 import re
 import time
+import os
+import socket
+import json
+
+# Persistent connection to the scctl server, using its JSON lines
+# protocol (see the description in scctl.cpp). This saves a process
+# execution and a connection setup for each command, and avoids
+# splitting names on white space. We fall back to executing scctl if
+# the server can't be reached.
+_scctlfile = None
+
+def _scctljson(req):
+    global _scctlfile
+    for attempt in (0, 1):
+        try:
+            if _scctlfile is None:
+                s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+                s.connect('/tmp/scctl%d/sock' % os.getuid())
+                _scctlfile = s.makefile('rwb', 0)
+            _scctlfile.write((json.dumps(req) + '\n').encode('utf-8'))
+            return json.loads(_scctlfile.readline().decode('utf-8'))
+        except Exception:
+            # Server restarted ? Retry once with a new connection
+            _scctlfile = None
+    return None
+
+# Return the receivers as a list of (status, fname, uuid, uri) tuples
+def receivers():
+    data = _scctljson({'op' : 'receivers'})
+    if data is not None and data.get('ok'):
+        return [(r['state'], r['name'], r['udn'], r['uri']) 
+                for r in data['receivers']]
+    devnull = open('/dev/null', 'w')
+    try:
+        data = subprocess.check_output(['scctl', '-l'], stderr = devnull)
+    except:
+        return []
+    o = []
+    for line in data.splitlines():
+        fields = re.split('''\s+''', line.strip());
+        if len(fields) == 4:
+            o.append(tuple(fields))
+        elif len(fields) == 3:
+            o.append(tuple(fields) + ('',))
+    return o
+
+def setFromReceiver(master, slaves):
+    if _scctljson({'op' : 'setfromreceiver', 'master' : master,
+                   'renderers' : slaves}) is None:
+        devnull = open('/dev/null', 'w')
+        subprocess.check_call(['scctl', '-s', master] + slaves,
+                              stderr = devnull)
+
+def stop(renderers):
+    if _scctljson({'op' : 'stop', 'renderers' : renderers}) is None:
+        devnull = open('/dev/null', 'w')
+        subprocess.check_call(['scctl', '-x'] + renderers, stderr = devnull)
 
 @bottle.route('/static/:path#.+#')
 def server_static(path):
@@ -20,61 +77,30 @@ def top():
 @bottle.route('/list')
 @bottle.view('list')
 def listReceivers():
-    devnull = open('/dev/null', 'w')
-    try:
-        data = subprocess.check_output(['scctl', '-l'], stderr = devnull)
-    except:
-        data = "scctl error"
     o = []
-    for line in data.splitlines():
-        #print >> sys.stderr, line
-        fields = re.split('''\s+''', line);
-        if len(fields) == 4:
-            status, fname, uuid, uri = fields
-        elif len(fields) == 3:
-            status, fname, uuid = fields
-            uri = ''
-        else:
-            status = None
-        if status is not None:
-            o.append((fname, status, uuid, uri))
+    for status, fname, uuid, uri in receivers():
+        o.append((fname, status, uuid, uri))
     return {'receivers' : o}
 
 @bottle.route('/assoc')
 @bottle.post('/assoc')
 @bottle.view('assoc')
 def assocReceivers():
-    devnull = open('/dev/null', 'w')
-
     assocs = bottle.request.forms.getall('Assoc')
     master = bottle.request.forms.get('Master')
     if master != '' and len(assocs) != 0:
-        arglist = ['scctl', '-s', master]
-        for uuid in assocs:
-            arglist.append(uuid)
-            try:
-                subprocess.check_call(arglist, stderr = devnull)
-            except:
-                pass
-
-    try:
-        data = subprocess.check_output(['scctl', '-l'], stderr = devnull)
-    except:
-        data = "scctl error"
+        try:
+            setFromReceiver(master, assocs)
+        except:
+            pass
 
     a = []
     o = []
-    for line in data.splitlines():
-        fields = re.split('''\s+''', line);
-        if len(fields) == 4:
-            status, fname, uuid, uri = fields
-            if status != 'Off' and uri != '':
-                a.append((fname, status, uuid, uri))
-            else:
-                o.append((fname, status, uuid, uri))
-        elif len(fields) == 3:
-            status, fname, uuid = fields
-            o.append(fname, status, uuid, '')
+    for status, fname, uuid, uri in receivers():
+        if status != 'Off' and uri != '':
+            a.append((fname, status, uuid, uri))
+        else:
+            o.append((fname, status, uuid, uri))
     return {'active' : a, 'others' : o}
 
 
@@ -82,27 +108,14 @@ def assocReceivers():
 @bottle.post('/stop')
 @bottle.view('stop')
 def stopReceivers():
-    devnull = open('/dev/null', 'w')
     for uuid in bottle.request.forms.getall('Stop'):
         try:
-            subprocess.check_call(['scctl', '-x', uuid], stderr=devnull)
+            stop([uuid])
         except:
             pass
 
-    try:
-        data = subprocess.check_output(['scctl', '-l'], stderr = devnull)
-    except:
-        data = "scctl error"
-
     a = []
-    for line in data.splitlines():
-        fields = re.split('''\s+''', line);
-        if len(fields) == 4:
-            status, fname, uuid, uri = fields
-            if status != 'Off':
-                a.append((fname, status, uuid, uri))
-        elif len(fields) == 3:
-            status, fname, uuid = fields
-            if status != 'Off':
-                a.append(fname, status, uuid, '')
+    for status, fname, uuid, uri in receivers():
+        if status != 'Off':
+            a.append((fname, status, uuid, uri))
     return {'active' : a}